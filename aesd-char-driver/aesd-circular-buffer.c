@@ -16,6 +16,34 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the location @param count entries past @param index, count being at most the capacity
+ */
+static inline uint32_t index_add(const struct aesd_circular_buffer *buffer, uint32_t index, uint32_t count)
+{
+    return index >= buffer->capacity - count ? index - (buffer->capacity - count) : index + count;
+}
+
+/**
+ * @return the number of entries held by @param buffer
+ */
+static inline uint32_t entry_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return buffer->capacity;
+    }
+    return buffer->in_offs >= buffer->out_offs ? buffer->in_offs - buffer->out_offs :
+           buffer->in_offs + buffer->capacity - buffer->out_offs;
+}
+
+/**
+ * @return the bytes added before the entry at location @param index
+ */
+static inline size_t entry_start(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return buffer->entry_end[index] - buffer->entry[index].size;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -25,58 +53,289 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ *
+ * The buffer is only read, so lookups may run concurrently under a shared lock.  Offsets are bisected
+ * over the entry ends in O(log n).
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t cumulative_offset = 0;
-    uint8_t index = buffer->out_offs;
-    int count;
-    int max_entries = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
-                      ((buffer->in_offs - buffer->out_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
-
-    for (count = 0; count < max_entries; count++) {
-        struct aesd_buffer_entry *entry = &buffer->entry[index];
-
-        if (char_offset < (cumulative_offset + entry->size)) {
-            if (entry_offset_byte_rtn) {
-                *entry_offset_byte_rtn = char_offset - cumulative_offset;
+    return aesd_circular_buffer_find_entry_offset_for_fpos_hint(buffer, char_offset, entry_offset_byte_rtn, NULL);
+}
+
+/**
+ * Like aesd_circular_buffer_find_entry_offset_for_fpos(), trying the entry at @param hint and the
+ * next one before bisecting.  A sequential reader keeps its own hint, with its file position for
+ * instance, so the buffer is still only read.
+ * @param hint if not NULL the location of the entry the last lookup found, receiving the one found
+ *      this time.  Any value is valid, a stale one only costs the bisection.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos_hint(
+            const struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn,
+            uint32_t *hint)
+{
+    uint32_t count = entry_count(buffer);
+    uint32_t index;
+    size_t base;
+    uint32_t lo;
+    uint32_t hi;
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    /* Ends are compared relative to the oldest entry, so the running total may wrap */
+    base = entry_start(buffer, buffer->out_offs);
+
+    if (char_offset >= buffer->entry_end[index_add(buffer, buffer->out_offs, count - 1)] - base) {
+        return NULL;
+    }
+
+    if (hint && *hint < buffer->capacity) {
+        /* Position of the hint from the oldest entry, only entries still held are tried */
+        uint32_t from = *hint >= buffer->out_offs ? *hint - buffer->out_offs :
+                        *hint + buffer->capacity - buffer->out_offs;
+        int tries;
+
+        for (tries = 0; tries < 2 && from < count; tries++, from++) {
+            index = index_add(buffer, buffer->out_offs, from);
+
+            if (char_offset >= entry_start(buffer, index) - base &&
+                char_offset < buffer->entry_end[index] - base) {
+                goto found;
             }
-            return entry;
         }
+    }
+
+    /* First entry ending after the offset, zero sized entries end where the next one starts */
+    lo = 0;
+    hi = count - 1;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (buffer->entry_end[index_add(buffer, buffer->out_offs, mid)] - base > char_offset) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    index = index_add(buffer, buffer->out_offs, lo);
+
+found:
+    if (hint) {
+        *hint = index;
+    }
 
-        cumulative_offset += entry->size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if (entry_offset_byte_rtn) {
+        *entry_offset_byte_rtn = char_offset - (entry_start(buffer, index) - base);
     }
+    return &buffer->entry[index];
+}
+
+/**
+ * Drops the oldest entry, giving back the arena bytes up to the next payload.
+ * @return the memory it referenced, NULL if the arena owns it
+ */
+static const char *drop_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+    const char *buffptr = buffer->arena ? NULL : oldest->buffptr;
+
+    buffer->out_offs = index_add(buffer, buffer->out_offs, 1);
+    buffer->full = false;
 
-    return NULL;
+    if (buffer->arena && buffer->in_offs == buffer->out_offs) {
+        buffer->arena_used = 0;
+    } else if (buffer->arena) {
+        size_t tail = oldest->buffptr - buffer->arena;
+        size_t next = buffer->entry[buffer->out_offs].buffptr - buffer->arena;
+
+        /* The next payload may have skipped the end of the ring */
+        buffer->arena_used -= next >= tail ? next - tail : next + buffer->arena_size - tail;
+    }
+
+    /* Sweeps with AESD_CIRCULAR_BUFFER_FOREACH only find entries still in the buffer */
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    return buffptr;
 }
 
 /**
-* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
+* Adds entry @param add_entry to @param buffer in the slot for buffer->in_offs.
+* If the buffer was already full, drops the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry dropped, for the caller to free, or NULL if none was or the arena owned it.
+* A buffer with an arena takes entries through aesd_circular_buffer_commit() and aesd_circular_buffer_add_copy().
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry)
 {
-    buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    uint32_t last = index_add(buffer, buffer->in_offs, buffer->capacity - 1);
+    size_t end = entry_count(buffer) != 0 ? buffer->entry_end[last] : 0;
+    const char *dropped = NULL;
 
     if (buffer->full) {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        dropped = drop_oldest(buffer);
     }
 
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_end[buffer->in_offs] = end + add_entry->size;
+    buffer->in_offs = index_add(buffer, buffer->in_offs, 1);
+
     if (buffer->in_offs == buffer->out_offs) {
         buffer->full = true;
     }
+    return dropped;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Finds room for a payload of @param size bytes in the arena of @param buffer, dropping the oldest
+* entries until there is.  The payload is written there and added with aesd_circular_buffer_commit(),
+* before anything else is added.  An empty payload takes no room and drops nothing.
+* @return where to write the payload, NULL if it is larger than the arena or there is none
+*/
+char *aesd_circular_buffer_reserve(struct aesd_circular_buffer *buffer, size_t size)
+{
+    if (!buffer->arena || size > buffer->arena_size) {
+        return NULL;
+    }
+
+    buffer->arena_reserved_size = size;
+
+    if (size == 0) {
+        buffer->arena_reserved = buffer->arena_head;
+        return buffer->arena + buffer->arena_head;
+    }
+
+    for (;;) {
+        size_t head = buffer->arena_head;
+        size_t tail;
+
+        if (entry_count(buffer) == 0) {
+            buffer->arena_head = 0;
+            buffer->arena_used = 0;
+            buffer->arena_reserved = 0;
+            return buffer->arena;
+        }
+
+        tail = buffer->entry[buffer->out_offs].buffptr - buffer->arena;
+
+        /* Free bytes run from head to tail, around the end of the ring if head is past tail */
+        if (buffer->arena_used < buffer->arena_size) {
+            if (head >= tail && size <= buffer->arena_size - head) {
+                buffer->arena_reserved = head;
+                return buffer->arena + head;
+            }
+            if (head >= tail && size <= tail) {
+                buffer->arena_reserved = 0;
+                return buffer->arena;
+            }
+            if (head < tail && size <= tail - head) {
+                buffer->arena_reserved = head;
+                return buffer->arena + head;
+            }
+        }
+
+        drop_oldest(buffer);
+    }
+}
+
+/**
+* Adds the first @param size bytes of the payload written where aesd_circular_buffer_reserve() said
+* as an entry of @param buffer.  Sizes past the one reserved are cut down to it.
+* @return the buffptr of the new entry
+*/
+const char *aesd_circular_buffer_commit(struct aesd_circular_buffer *buffer, size_t size)
+{
+    struct aesd_buffer_entry entry = {
+        .buffptr = buffer->arena + buffer->arena_reserved,
+        .size = size < buffer->arena_reserved_size ? size : buffer->arena_reserved_size,
+    };
+
+    /* The end of the ring skipped, if any, counts as long as payloads come before it */
+    size_t skipped = buffer->arena_reserved < buffer->arena_head ? buffer->arena_size - buffer->arena_head : 0;
+
+    aesd_circular_buffer_add_entry(buffer, &entry);
+
+    if (entry_count(buffer) == 1) {
+        buffer->arena_used = entry.size;
+    } else {
+        buffer->arena_used += skipped + entry.size;
+    }
+
+    buffer->arena_head = buffer->arena_reserved + entry.size;
+
+    if (buffer->arena_head == buffer->arena_size) {
+        buffer->arena_head = 0;
+    }
+    return entry.buffptr;
+}
+
+/**
+* Copies @param size bytes from @param data into the arena of @param buffer and adds them as an entry,
+* dropping the oldest entries as needed.
+* @return the buffptr of the new entry, NULL if the payload does not fit in the arena
+*/
+const char *aesd_circular_buffer_add_copy(struct aesd_circular_buffer *buffer, const char *data, size_t size)
+{
+    char *payload = aesd_circular_buffer_reserve(buffer, size);
+
+    if (!payload) {
+        return NULL;
+    }
+
+    memcpy(payload, data, size);
+    return aesd_circular_buffer_commit(buffer, size);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct keeping
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its embedded storage
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->embedded_entry;
+    buffer->entry_end = buffer->embedded_end;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct keeping
+* @param capacity entries in caller allocated storage: @param entries and @param entry_ends
+* are arrays of capacity elements.
+* @return false, leaving the buffer untouched, if capacity is 0
+*/
+bool aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            size_t *entry_ends, uint32_t capacity)
+{
+    if (capacity == 0) {
+        return false;
+    }
+
+    aesd_circular_buffer_init(buffer);
+    memset(entries,0,sizeof(struct aesd_buffer_entry) * capacity);
+    buffer->entry = entries;
+    buffer->entry_end = entry_ends;
+    buffer->capacity = capacity;
+    return true;
+}
+
+/**
+* Hands the payloads of @param buffer, which must hold no entry, over to @param arena_size bytes at
+* @param arena.  Entries are then dropped once their payloads would not leave room for a new one, as
+* well as once capacity entries are held, and none needs to be freed.
+*/
+void aesd_circular_buffer_init_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size)
+{
+    buffer->arena = arena;
+    buffer->arena_size = arena_size;
+    buffer->arena_head = 0;
+    buffer->arena_used = 0;
+    buffer->arena_reserved = 0;
+    buffer->arena_reserved_size = 0;
 }
@@ -16,6 +16,9 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Entries kept by a buffer set up with aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -30,42 +33,98 @@ struct aesd_buffer_entry
     size_t size;
 };
 
+/**
+ * Must not be copied: after aesd_circular_buffer_init() entry and entry_end point at the embedded
+ * storage of the struct itself, which a copy would keep using.
+ */
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * capacity entries long
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Bytes added since init up to the end of the entry at the same index, wrapping
+     * around.  Entries in order have increasing ends, which fpos lookups bisect.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t *entry_end;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Number of entries in the entry structure.  Locations wrap with a compare instead of a
+     * power of two mask, since the AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries a driver
+     * keeps are no power of two and the lookup only wraps a handful of times.
+     */
+    uint32_t capacity;
+    /**
+     * Ring of arena_size bytes holding the payloads of every entry, if set up with
+     * aesd_circular_buffer_init_arena().  Payloads are contiguous; one that does not fit
+     * before the end of the ring starts over at its beginning.
+     */
+    char *arena;
+    size_t arena_size;
+    /**
+     * Offset of the next payload, bytes taken by the payloads in the buffer and by the
+     * unused ends of the ring they skipped
+     */
+    size_t arena_head;
+    size_t arena_used;
+    /**
+     * Offset handed out by the last aesd_circular_buffer_reserve() and the bytes reserved there
+     */
+    size_t arena_reserved;
+    size_t arena_reserved_size;
+    /**
+     * Storage used unless aesd_circular_buffer_init_storage() supplied some
+     */
+    struct aesd_buffer_entry embedded_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t embedded_end[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos_hint(
+            const struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn,
+            uint32_t *hint);
+
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern bool aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            size_t *entry_ends, uint32_t capacity);
+
+extern void aesd_circular_buffer_init_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size);
+
+extern char *aesd_circular_buffer_reserve(struct aesd_circular_buffer *buffer, size_t size);
+
+extern const char *aesd_circular_buffer_commit(struct aesd_circular_buffer *buffer, size_t size);
+
+extern const char *aesd_circular_buffer_add_copy(struct aesd_circular_buffer *buffer, const char *data, size_t size);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
- * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Useful when you've allocated memory for circular buffer entries and need to free it.
+ * Members not holding an entry have a NULL buffptr.
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +133,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
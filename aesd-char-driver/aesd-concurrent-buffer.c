@@ -0,0 +1,226 @@
+/**
+ * @file aesd-concurrent-buffer.c
+ * @brief A circular buffer with one writer, or several taking turns, and lock-free readers
+ *
+ * Readers snapshot the published sequence number, then read slots with the
+ * usual sequence count protocol: the count is loaded before and after the
+ * fields, and the copy is only used if both match the entry expected.  A
+ * slot overwritten or being overwritten meanwhile sends the reader back to
+ * a fresh snapshot.  Writers never wait for readers.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/compiler.h>
+#include <linux/spinlock.h>
+#include <asm/barrier.h>
+
+#define LOAD(p) READ_ONCE(*(p))
+#define STORE(p, v) WRITE_ONCE(*(p), v)
+#define LOAD_ACQUIRE(p) smp_load_acquire(p)
+#define STORE_RELEASE(p, v) smp_store_release(p, v)
+#define READ_BARRIER() smp_rmb()
+#define WRITE_BARRIER() smp_wmb()
+#else
+#include <string.h>
+#include <pthread.h>
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define READ_BARRIER() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define WRITE_BARRIER() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+#include "aesd-concurrent-buffer.h"
+
+/**
+ * Copies the entry with sequence number @param seq into @param entry and its end into @param end.
+ * @return false if the slot no longer, or not yet, holds that entry
+ */
+static bool slot_read(const struct aesd_concurrent_buffer *buffer, unsigned long seq,
+            struct aesd_buffer_entry *entry, size_t *end)
+{
+    const struct aesd_concurrent_slot *slot = &buffer->slot[seq & buffer->mask];
+    unsigned long want = 2 * seq + 2;
+
+    if (LOAD_ACQUIRE(&slot->seq) != want) {
+        return false;
+    }
+
+    entry->buffptr = LOAD(&slot->buffptr);
+    entry->size = LOAD(&slot->size);
+    *end = LOAD(&slot->end);
+
+    READ_BARRIER();
+    return LOAD(&slot->seq) == want;
+}
+
+/**
+ * @param buffer the buffer to search, safe to call while entries are added.
+ * @param char_offset the position to search for, the zero referenced character index if all
+ *      buffer strings were concatenated end to end
+ * @param entry_rtn receives a copy of the entry holding char_offset
+ * @param entry_offset_byte_rtn receives the byte of entry_rtn->buffptr corresponding to char_offset
+ * @return false if this position is not available in the buffer.
+ *
+ * The copy reflects the buffer at one point during the call.  The memory it references may be
+ * overwritten or dropped right after; the caller must keep the memory of dropped entries alive
+ * until readers are done with it, with RCU in the kernel for instance.
+ */
+bool aesd_concurrent_buffer_find_entry_offset_for_fpos(const struct aesd_concurrent_buffer *buffer,
+            size_t char_offset, struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry entry;
+    unsigned long in;
+    uint32_t count;
+    uint32_t lo;
+    uint32_t hi;
+    size_t base;
+    size_t end;
+
+retry:
+    in = LOAD_ACQUIRE(&buffer->in_offs);
+
+    /*
+     * Entries below in were all written, so count never reaches past the oldest one.  wrapped only
+     * matters once in_offs has gone around, and then stays set.
+     */
+    count = in >= buffer->capacity || LOAD(&buffer->wrapped) ? buffer->capacity : in;
+
+    if (count == 0) {
+        return false;
+    }
+
+    /* Ends are compared relative to the start of the oldest entry, so the running total may wrap */
+    if (!slot_read(buffer, in - count, &entry, &end)) {
+        goto retry;
+    }
+
+    base = end - entry.size;
+
+    if (!slot_read(buffer, in - 1, &entry, &end)) {
+        goto retry;
+    }
+
+    if (char_offset >= end - base) {
+        return false;
+    }
+
+    /* First entry ending after the offset, zero sized entries end where the next one starts */
+    lo = 0;
+    hi = count - 1;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (!slot_read(buffer, in - count + mid, &entry, &end)) {
+            goto retry;
+        }
+
+        if (end - base > char_offset) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    if (!slot_read(buffer, in - count + lo, &entry, &end)) {
+        goto retry;
+    }
+
+    *entry_rtn = entry;
+
+    if (entry_offset_byte_rtn) {
+        *entry_offset_byte_rtn = char_offset - (end - entry.size - base);
+    }
+    return true;
+}
+
+/**
+* Adds entry @param add_entry to @param buffer, dropping the oldest entry once capacity entries are held.
+* Only one writer may call this at a time, without aesd_concurrent_buffer_add_entry_mpsc() running.
+* @param overwritten_rtn if not NULL receives the entry whose slot was reused, which was already
+* dropped from the buffer, or a zeroed entry.  Readers may still hold a copy of it.
+*/
+void aesd_concurrent_buffer_add_entry(struct aesd_concurrent_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry, struct aesd_buffer_entry *overwritten_rtn)
+{
+    unsigned long seq = buffer->in_offs;
+    struct aesd_concurrent_slot *slot = &buffer->slot[seq & buffer->mask];
+    size_t end = seq != 0 || buffer->wrapped ? buffer->slot[(seq - 1) & buffer->mask].end : 0;
+
+    if (overwritten_rtn) {
+        overwritten_rtn->buffptr = slot->buffptr;
+        overwritten_rtn->size = slot->size;
+    }
+
+    /* Readers seeing the odd count, or the new one, drop whatever they copied */
+    STORE(&slot->seq, 2 * seq + 1);
+    WRITE_BARRIER();
+
+    STORE(&slot->buffptr, add_entry->buffptr);
+    STORE(&slot->size, add_entry->size);
+    STORE(&slot->end, end + add_entry->size);
+
+    STORE_RELEASE(&slot->seq, 2 * seq + 2);
+
+    if (seq + 1 == 0) {
+        STORE(&buffer->wrapped, true);
+    }
+
+    STORE_RELEASE(&buffer->in_offs, seq + 1);
+}
+
+/**
+* Like aesd_concurrent_buffer_add_entry() for any number of concurrent producers, which take turns
+* on the producer lock as writers of a kernel seqlock do.  Readers still take no lock.
+*/
+void aesd_concurrent_buffer_add_entry_mpsc(struct aesd_concurrent_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry, struct aesd_buffer_entry *overwritten_rtn)
+{
+#ifdef __KERNEL__
+    spin_lock(&buffer->producer_lock);
+    aesd_concurrent_buffer_add_entry(buffer, add_entry, overwritten_rtn);
+    spin_unlock(&buffer->producer_lock);
+#else
+    pthread_mutex_lock(&buffer->producer_lock);
+    aesd_concurrent_buffer_add_entry(buffer, add_entry, overwritten_rtn);
+    pthread_mutex_unlock(&buffer->producer_lock);
+#endif
+}
+
+/**
+* Initializes @param buffer to keep @param capacity entries in @param slot_count caller allocated
+* @param slots, the smallest power of two at least capacity being enough.
+* @return false, leaving the buffer untouched, unless slot_count is a power of two and capacity
+* between 1 and slot_count
+*/
+bool aesd_concurrent_buffer_init(struct aesd_concurrent_buffer *buffer, struct aesd_concurrent_slot *slots,
+            uint32_t slot_count, uint32_t capacity)
+{
+    uint32_t index;
+
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || capacity == 0 || capacity > slot_count) {
+        return false;
+    }
+
+    memset(buffer,0,sizeof(struct aesd_concurrent_buffer));
+    memset(slots,0,sizeof(struct aesd_concurrent_slot) * slot_count);
+
+    /* An odd count, which no reader waits for, until the slot is first written */
+    for (index = 0; index < slot_count; index++) {
+        slots[index].seq = 1;
+    }
+
+    buffer->slot = slots;
+    buffer->mask = slot_count - 1;
+    buffer->capacity = capacity;
+#ifdef __KERNEL__
+    spin_lock_init(&buffer->producer_lock);
+#else
+    pthread_mutex_init(&buffer->producer_lock, NULL);
+#endif
+    return true;
+}
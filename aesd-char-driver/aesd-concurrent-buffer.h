@@ -0,0 +1,86 @@
+/*
+ * aesd-concurrent-buffer.h
+ *
+ * A circular buffer of write operations like aesd-circular-buffer.h whose
+ * readers take no lock.  Every slot carries a sequence count, odd while the
+ * writer fills it, and readers copy what they need out of a slot and retry
+ * when the count shows it changed underneath them.
+ */
+
+#ifndef AESD_CONCURRENT_BUFFER_H
+#define AESD_CONCURRENT_BUFFER_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#include <pthread.h>
+#endif
+
+#include "aesd-circular-buffer.h"
+
+struct aesd_concurrent_slot
+{
+    /**
+     * 2 * (sequence number + 1) of the entry held, odd while it is being replaced and
+     * until it is first written.  A native word, so it is loaded and stored whole; see in_offs
+     * for how far apart two entries mapping to the same count are.
+     */
+    unsigned long seq;
+    const char *buffptr;
+    size_t size;
+    /**
+     * Bytes added since init up to the end of this entry, wrapping around
+     */
+    size_t end;
+};
+
+struct aesd_concurrent_buffer
+{
+    /**
+     * mask + 1 slots, a power of two
+     */
+    struct aesd_concurrent_slot *slot;
+    uint32_t mask;
+    /**
+     * Entries kept before the oldest one is dropped, at most mask + 1
+     */
+    uint32_t capacity;
+    /**
+     * Sequence number of the next write, published once its slot is filled.  Counts in a slot
+     * repeat every ULONG_MAX / 2 + 1 entries, so a reader stalled for that many adds could take
+     * a newer entry for the one it wanted: never in practice with 64 bit longs, after 2^31 adds
+     * with 32 bit ones, the bound a kernel seqcount_t has too.
+     */
+    unsigned long in_offs;
+    /**
+     * set once in_offs has wrapped around, from then on the oldest entry is in_offs - capacity
+     * even where in_offs is below capacity
+     */
+    bool wrapped;
+    /**
+     * Held by aesd_concurrent_buffer_add_entry_mpsc() while it adds
+     */
+#ifdef __KERNEL__
+    spinlock_t producer_lock;
+#else
+    pthread_mutex_t producer_lock;
+#endif
+};
+
+extern bool aesd_concurrent_buffer_init(struct aesd_concurrent_buffer *buffer, struct aesd_concurrent_slot *slots,
+            uint32_t slot_count, uint32_t capacity);
+
+extern void aesd_concurrent_buffer_add_entry(struct aesd_concurrent_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry, struct aesd_buffer_entry *overwritten_rtn);
+
+extern void aesd_concurrent_buffer_add_entry_mpsc(struct aesd_concurrent_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry, struct aesd_buffer_entry *overwritten_rtn);
+
+extern bool aesd_concurrent_buffer_find_entry_offset_for_fpos(const struct aesd_concurrent_buffer *buffer,
+            size_t char_offset, struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn);
+
+#endif /* AESD_CONCURRENT_BUFFER_H */
@@ -0,0 +1,208 @@
+/**
+ * @file buffer-bench.c
+ * @brief fpos lookup throughput of the buffers with a growing number of readers
+ *
+ * Every reader looks up random offsets while one writer keeps adding entries.
+ * "locked" takes a mutex around aesd-circular-buffer calls, the way a driver
+ * would, "lockfree" reads aesd-concurrent-buffer without one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-concurrent-buffer.h"
+
+struct bench_reader
+{
+    pthread_t thread_id;
+    unsigned long long lookups;
+};
+
+static struct aesd_circular_buffer circular;
+static pthread_mutex_t circular_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_concurrent_buffer concurrent;
+static volatile bool running;
+static bool lockfree;
+static const char payload[64];
+
+/**
+ * @return the bytes held by a buffer of @param capacity entries of 1 to 64 bytes, once full
+ */
+static size_t bench_span(uint32_t capacity)
+{
+    return (size_t)capacity * 32;
+}
+
+static void *reader_start(void *param)
+{
+    struct bench_reader *reader = (struct bench_reader *)param;
+    unsigned int seed = (unsigned int)(uintptr_t)param;
+    size_t span = bench_span(circular.capacity);
+
+    while (running) {
+        struct aesd_buffer_entry entry;
+        size_t entry_offset;
+        size_t offset = rand_r(&seed) % span;
+
+        if (lockfree) {
+            aesd_concurrent_buffer_find_entry_offset_for_fpos(&concurrent, offset, &entry, &entry_offset);
+        } else {
+            pthread_mutex_lock(&circular_lock);
+            aesd_circular_buffer_find_entry_offset_for_fpos(&circular, offset, &entry_offset);
+            pthread_mutex_unlock(&circular_lock);
+        }
+        reader->lookups++;
+    }
+    return param;
+}
+
+static void bench_add(const struct aesd_buffer_entry *entry)
+{
+    if (lockfree) {
+        aesd_concurrent_buffer_add_entry(&concurrent, entry, NULL);
+    } else {
+        pthread_mutex_lock(&circular_lock);
+        aesd_circular_buffer_add_entry(&circular, entry);
+        pthread_mutex_unlock(&circular_lock);
+    }
+}
+
+static void *writer_start(void *param)
+{
+    unsigned long long *adds = (unsigned long long *)param;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 10 * 1000 };
+
+    while (running) {
+        struct aesd_buffer_entry entry = { payload, 1 + *adds % 63 };
+
+        bench_add(&entry);
+        ++*adds;
+        nanosleep(&pause, NULL);
+    }
+    return param;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int reader_count, int seconds)
+{
+    struct bench_reader *readers = calloc(reader_count, sizeof(struct bench_reader));
+    pthread_t writer_id;
+    unsigned long long adds = 0;
+    unsigned long long lookups = 0;
+    double start;
+    double elapsed;
+    int i;
+
+    if (readers == NULL) {
+        return -1;
+    }
+
+    running = true;
+    start = now();
+
+    for (i = 0; i < reader_count; i++) {
+        pthread_create(&readers[i].thread_id, NULL, reader_start, &readers[i]);
+    }
+    pthread_create(&writer_id, NULL, writer_start, &adds);
+
+    sleep(seconds);
+    running = false;
+
+    for (i = 0; i < reader_count; i++) {
+        pthread_join(readers[i].thread_id, NULL);
+        lookups += readers[i].lookups;
+    }
+    pthread_join(writer_id, NULL);
+
+    elapsed = now() - start;
+    free(readers);
+
+    printf("%-9s %7d %14.1f %10.1f\n", lockfree ? "lockfree" : "locked", reader_count,
+           lookups / elapsed, adds / elapsed);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t capacity = 1024;
+    uint32_t slot_count;
+    int max_readers = 16;
+    int seconds = 2;
+    struct aesd_buffer_entry *entries;
+    size_t *entry_ends;
+    struct aesd_concurrent_slot *slots;
+    int opt;
+    int mode;
+    uint32_t i;
+
+    while ((opt = getopt(argc, argv, "n:r:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            max_readers = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n entries] [-r max readers] [-t seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (slot_count = 1; slot_count < capacity && slot_count != 0; slot_count *= 2) {
+    }
+
+    entries = malloc(sizeof(struct aesd_buffer_entry) * capacity);
+    entry_ends = malloc(sizeof(size_t) * capacity);
+    slots = malloc(sizeof(struct aesd_concurrent_slot) * slot_count);
+
+    if (!entries || !entry_ends || !slots ||
+        !aesd_circular_buffer_init_storage(&circular, entries, entry_ends, capacity) ||
+        !aesd_concurrent_buffer_init(&concurrent, slots, slot_count, capacity)) {
+        fprintf(stderr, "Cannot set up buffers of %u entries\n", capacity);
+        return 1;
+    }
+
+    printf("entries: %u\n", capacity);
+    printf("%-9s %7s %14s %10s\n", "mode", "readers", "lookups/s", "adds/s");
+
+    for (mode = 0; mode < 2; mode++) {
+        int readers;
+
+        lockfree = (mode == 1);
+
+        /* Start full, lookups then mostly land on an entry */
+        for (i = 0; i < capacity; i++) {
+            struct aesd_buffer_entry entry = { payload, 1 + i % 63 };
+
+            bench_add(&entry);
+        }
+
+        for (readers = 1; readers <= max_readers; readers *= 2) {
+            if (run(readers, seconds) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    free(entries);
+    free(entry_ends);
+    free(slots);
+    return 0;
+}
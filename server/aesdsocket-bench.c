@@ -0,0 +1,743 @@
+/*
+ * Load generator for a local aesdsocket.  Every connection sends lines of a
+ * given size, either back to back or at a fixed rate, and measures how long
+ * it takes until its own line comes back in a replay.  With a rate set, the
+ * latency is measured from the time the line was due rather than from the
+ * time it was sent, so a stalled server is not hidden by the client
+ * slowing down with it.
+ *
+ * Replies are checked against the data file as the clients have seen it so
+ * far: every reply must be a prefix of that file, the stream of a
+ * connection is a sequence of such prefixes, and every line written by the
+ * bench must carry the payload pattern it was sent with.
+ *
+ * With -b the connections use the binary framing instead and pipeline that
+ * many lines per request, only the last one asking for a replay.  With -U
+ * they connect to the server's local socket instead of the TCP port.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include "framing.h"
+
+#define BENCH_READ_SIZE (64 * 1024)
+#define BENCH_MAX_EVENTS 64
+
+struct bench_conn {
+    int fd;
+    unsigned int id;
+    bool dead;
+
+    /* Received bytes not yet forming a complete line */
+    char* rbuf;
+    size_t rlen;
+    size_t rcap;
+    /* Offset in the reference file the current reply has reached */
+    size_t pos;
+    /* Binary framing: bytes of the current reply still to come, and its length as far as received */
+    uint64_t reply_left;
+    unsigned char header[FRAMER_REPLY_HEADER];
+    size_t header_len;
+
+    /* Line in flight and when it was due */
+    unsigned int seq;
+    bool waiting;
+    uint64_t due;
+    uint64_t next_due;
+    /* End offset of the line in flight in the reference file, 0 until seen */
+    size_t wait_end;
+
+    char* wbuf;
+    size_t wlen;
+    size_t woff;
+    bool want_out;
+};
+
+struct bench_thread {
+    pthread_t thread_id;
+    int epfd;
+    struct bench_conn* conns;
+    int conn_count;
+
+    uint64_t* latencies;
+    size_t latency_count;
+    size_t latency_cap;
+
+    unsigned long long lines;
+    unsigned long long bytes_in;
+    unsigned long long errors;
+};
+
+static struct sockaddr_in server_addr;
+static struct sockaddr_un local_addr;
+static size_t line_size = 64;
+static double rate;
+/* Lines per request with the binary framing, 0 for newline framing */
+static unsigned int batch_lines;
+/* Tells the lines of this run apart from those of earlier runs against the same server */
+static unsigned int run_id;
+static uint64_t deadline;
+
+/* The data file as reconstructed from the replies, see reference_*() */
+static pthread_rwlock_t reference_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char* reference;
+static size_t reference_len;
+static size_t reference_cap;
+static size_t reference_first;
+static unsigned long long foreign_lines;
+
+static struct bench_conn** all_conns;
+static unsigned int all_conn_count;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char pattern(unsigned int id, unsigned int seq, size_t i) {
+    return 'a' + (id + seq + i) % 26;
+}
+
+static size_t make_line(char* buf, unsigned int id, unsigned int seq) {
+    size_t len = snprintf(buf, line_size + 48, "%x:%u:%u:", run_id, id, seq);
+
+    for(size_t i = len; i + 1 < line_size; ++i) {
+        buf[i] = pattern(id, seq, i);
+    }
+
+    if(len + 1 < line_size) {
+        len = line_size - 1;
+    }
+
+    buf[len++] = '\n';
+    return len;
+}
+
+/*
+ * Checks the payload of a line written by the bench and tells its owner
+ * where the line ended up.  Lines from anyone else are counted as foreign.
+ */
+static bool check_new_line(const char* line, size_t len, size_t end) {
+    unsigned int run, id, seq;
+    int header;
+
+    if(sscanf(line, "%x:%u:%u:%n", &run, &id, &seq, &header) != 3 || run != run_id) {
+        ++foreign_lines;
+        return true;
+    }
+
+    for(size_t i = header; i + 1 < len; ++i) {
+        if(line[i] != pattern(id, seq, i)) {
+            return false;
+        }
+    }
+
+    if(id < all_conn_count) {
+        struct bench_conn* owner = all_conns[id];
+
+        if(__atomic_load_n(&owner->seq, __ATOMIC_ACQUIRE) == seq) {
+            __atomic_store_n(&owner->wait_end, end, __ATOMIC_RELEASE);
+        }
+    }
+
+    return true;
+}
+
+/* Offset of the first differing byte of a and b, or n if they are equal */
+static size_t mismatch(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+
+    while(i + sizeof(uint64_t) <= n) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if(x != y) {
+            break;
+        }
+        i += sizeof(uint64_t);
+    }
+
+    while(i < n && a[i] == b[i]) {
+        ++i;
+    }
+
+    return i;
+}
+
+/* Extends the reference file with a line nobody has seen yet, caller holds the write lock */
+static int reference_append(const char* line, size_t len) {
+    if(reference_len + len > reference_cap) {
+        size_t cap = reference_cap ? reference_cap * 2 : 1024 * 1024;
+
+        while(cap < reference_len + len) {
+            cap *= 2;
+        }
+
+        char* grown = realloc(reference, cap);
+
+        if(grown == NULL) {
+            return -1;
+        }
+
+        reference = grown;
+        reference_cap = cap;
+    }
+
+    memcpy(reference + reference_len, line, len);
+    reference_len += len;
+
+    if(reference_first == 0) {
+        reference_first = len;
+    }
+
+    return check_new_line(line, len, reference_len) ? 0 : -1;
+}
+
+static void record_latency(struct bench_thread* t, uint64_t latency) {
+    if(t->latency_count == t->latency_cap) {
+        size_t cap = t->latency_cap ? t->latency_cap * 2 : 4096;
+        uint64_t* grown = realloc(t->latencies, cap * sizeof(uint64_t));
+
+        if(grown == NULL) {
+            return;
+        }
+
+        t->latencies = grown;
+        t->latency_cap = cap;
+    }
+
+    t->latencies[t->latency_count++] = latency;
+}
+
+static void conn_check_echo(struct bench_thread* t, struct bench_conn* conn) {
+    size_t end = __atomic_load_n(&conn->wait_end, __ATOMIC_ACQUIRE);
+
+    if(conn->waiting && end != 0 && conn->pos >= end) {
+        record_latency(t, now() - conn->due);
+        conn->waiting = false;
+        t->lines += batch_lines ? batch_lines : 1;
+    }
+}
+
+/*
+ * Matches complete lines received on conn against the reference file,
+ * noting when the line in flight comes back.  Returns -1 if they cannot be
+ * part of any replay.
+ */
+static int conn_consume(struct bench_thread* t, struct bench_conn* conn, const char* data, size_t len) {
+    pthread_rwlock_rdlock(&reference_lock);
+
+    while(len > 0) {
+        /* Most of a reply is data already seen, compare it in one go */
+        size_t avail = reference_len > conn->pos ? reference_len - conn->pos : 0;
+        size_t n = len < avail ? len : avail;
+        size_t same = mismatch(reference + conn->pos, data, n);
+
+        if(same < n) {
+            const char* nl = memrchr(data, '\n', same);
+            same = nl ? (size_t)(nl - data) + 1 : 0;
+        }
+
+        if(same > 0) {
+            conn->pos += same;
+            data += same;
+            len -= same;
+            conn_check_echo(t, conn);
+            continue;
+        }
+
+        const char* nl = memchr(data, '\n', len);
+        size_t line_len = nl - data + 1;
+
+        if(line_len == reference_first && memcmp(reference, data, line_len) == 0) {
+            /* A new reply starts over from the beginning of the file */
+            conn->pos = line_len;
+        } else if(conn->pos == reference_len) {
+            pthread_rwlock_unlock(&reference_lock);
+            pthread_rwlock_wrlock(&reference_lock);
+
+            int rc = 0;
+
+            /* Someone else may have added lines in between */
+            if(conn->pos == reference_len) {
+                rc = reference_append(data, line_len);
+            } else if(conn->pos + line_len > reference_len ||
+                      memcmp(reference + conn->pos, data, line_len) != 0) {
+                rc = -1;
+            }
+
+            pthread_rwlock_unlock(&reference_lock);
+
+            if(rc != 0) {
+                return -1;
+            }
+
+            pthread_rwlock_rdlock(&reference_lock);
+            conn->pos += line_len;
+        } else {
+            pthread_rwlock_unlock(&reference_lock);
+            return -1;
+        }
+
+        data += line_len;
+        len -= line_len;
+        conn_check_echo(t, conn);
+    }
+
+    pthread_rwlock_unlock(&reference_lock);
+    return 0;
+}
+
+static void conn_fail(struct bench_thread* t, struct bench_conn* conn, const char* what) {
+    if(!conn->dead) {
+        fprintf(stderr, "connection %u: %s\n", conn->id, what);
+        ++t->errors;
+        conn->dead = true;
+        epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+}
+
+static void conn_update_events(struct bench_thread* t, struct bench_conn* conn, bool want_out) {
+    if(conn->want_out != want_out) {
+        struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = conn };
+        epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->want_out = want_out;
+    }
+}
+
+static void conn_flush(struct bench_thread* t, struct bench_conn* conn) {
+    while(conn->woff < conn->wlen) {
+        ssize_t n = write(conn->fd, conn->wbuf + conn->woff, conn->wlen - conn->woff);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_update_events(t, conn, true);
+                return;
+            }
+            conn_fail(t, conn, strerror(errno));
+            return;
+        }
+
+        conn->woff += n;
+    }
+
+    conn_update_events(t, conn, false);
+}
+
+/* Appends the line seq as a binary record */
+static size_t make_record(char* buf, unsigned int id, unsigned int seq, bool replay) {
+    size_t len = make_line(buf + FRAMER_RECORD_HEADER, id, seq);
+    uint32_t header = htonl(len | (replay ? FRAMER_RECORD_REPLAY : 0));
+
+    memcpy(buf, &header, sizeof(header));
+    return FRAMER_RECORD_HEADER + len;
+}
+
+static void conn_send_next(struct bench_thread* t, struct bench_conn* conn, uint64_t when) {
+    unsigned int seq = conn->seq + 1;
+
+    if(batch_lines == 0) {
+        conn->wlen = make_line(conn->wbuf, conn->id, seq);
+    } else {
+        conn->wlen = 0;
+
+        for(unsigned int i = 1; i <= batch_lines; ++i, ++seq) {
+            conn->wlen += make_record(conn->wbuf + conn->wlen, conn->id, seq, i == batch_lines);
+        }
+        --seq;
+    }
+    conn->woff = 0;
+    conn->due = rate > 0 ? conn->next_due : when;
+    conn->waiting = true;
+
+    __atomic_store_n(&conn->wait_end, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->seq, seq, __ATOMIC_RELEASE);
+
+    if(rate > 0) {
+        conn->next_due += (uint64_t)(1e9 / rate);
+    }
+
+    conn_flush(t, conn);
+}
+
+/*
+ * Strips the reply lengths out of n bytes received with the binary framing,
+ * moving the replies themselves to the front.  Returns their length.
+ */
+static size_t conn_unframe(struct bench_conn* conn, char* data, size_t n) {
+    size_t out = 0;
+
+    for(size_t i = 0; i < n; ) {
+        if(conn->reply_left > 0) {
+            size_t len = n - i < conn->reply_left ? n - i : conn->reply_left;
+            memmove(data + out, data + i, len);
+            out += len;
+            i += len;
+            conn->reply_left -= len;
+            continue;
+        }
+
+        conn->header[conn->header_len++] = data[i++];
+
+        if(conn->header_len == FRAMER_REPLY_HEADER) {
+            for(size_t j = 0; j < FRAMER_REPLY_HEADER; ++j) {
+                conn->reply_left = conn->reply_left << 8 | conn->header[j];
+            }
+            conn->header_len = 0;
+        }
+    }
+
+    return out;
+}
+
+static void conn_read(struct bench_thread* t, struct bench_conn* conn) {
+    for(;;) {
+        if(conn->rcap - conn->rlen < BENCH_READ_SIZE) {
+            size_t cap = conn->rcap ? conn->rcap * 2 : 2 * BENCH_READ_SIZE;
+            char* grown = realloc(conn->rbuf, cap);
+
+            if(grown == NULL) {
+                conn_fail(t, conn, "out of memory");
+                return;
+            }
+
+            conn->rbuf = grown;
+            conn->rcap = cap;
+        }
+
+        ssize_t n = read(conn->fd, conn->rbuf + conn->rlen, conn->rcap - conn->rlen);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_fail(t, conn, strerror(errno));
+            }
+            return;
+        }
+
+        if(n == 0) {
+            conn_fail(t, conn, "closed by server");
+            return;
+        }
+
+        t->bytes_in += n;
+
+        if(batch_lines > 0) {
+            n = conn_unframe(conn, conn->rbuf + conn->rlen, n);
+        }
+
+        const char* nl = memrchr(conn->rbuf + conn->rlen, '\n', n);
+        conn->rlen += n;
+
+        if(nl == NULL) {
+            continue;
+        }
+
+        size_t complete = nl - conn->rbuf + 1;
+
+        if(conn_consume(t, conn, conn->rbuf, complete) != 0) {
+            conn_fail(t, conn, "reply does not match the data file");
+            return;
+        }
+
+        memmove(conn->rbuf, conn->rbuf + complete, conn->rlen - complete);
+        conn->rlen -= complete;
+    }
+}
+
+static void *thread_start(void *param) {
+    struct bench_thread* t = (struct bench_thread *)param;
+    struct epoll_event events[BENCH_MAX_EVENTS];
+
+    for(;;) {
+        uint64_t current = now();
+
+        if(current >= deadline) {
+            break;
+        }
+
+        uint64_t wake = deadline;
+
+        for(int i = 0; i < t->conn_count; ++i) {
+            struct bench_conn* conn = &t->conns[i];
+
+            if(conn->dead || conn->waiting) {
+                continue;
+            }
+
+            if(rate <= 0 || conn->next_due <= current) {
+                conn_send_next(t, conn, current);
+            } else if(conn->next_due < wake) {
+                wake = conn->next_due;
+            }
+        }
+
+        int timeout = (int)((wake - current + 999999) / 1000000);
+        int n = epoll_wait(t->epfd, events, BENCH_MAX_EVENTS, timeout);
+
+        for(int i = 0; i < n; ++i) {
+            struct bench_conn* conn = events[i].data.ptr;
+
+            if(conn->dead) {
+                continue;
+            }
+
+            if(events[i].events & EPOLLOUT) {
+                conn_flush(t, conn);
+            }
+
+            if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                conn_read(t, conn);
+            }
+        }
+    }
+
+    return param;
+}
+
+static int conn_open(struct bench_thread* t, struct bench_conn* conn, unsigned int id) {
+    bool local = local_addr.sun_path[0] != '\0';
+    struct sockaddr* addr = local ? (struct sockaddr *)&local_addr : (struct sockaddr *)&server_addr;
+    socklen_t addrlen = local ? sizeof(local_addr) : sizeof(server_addr);
+
+    conn->id = id;
+    conn->fd = socket(addr->sa_family, SOCK_STREAM, 0);
+
+    if(conn->fd < 0 || connect(conn->fd, addr, addrlen) != 0) {
+        perror("connect");
+        return -1;
+    }
+
+    int yes = 1;
+
+    if(!local) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+
+    if(batch_lines > 0 && write(conn->fd, FRAMER_BINARY_HELLO, sizeof(FRAMER_BINARY_HELLO) - 1) < 0) {
+        perror("write");
+        return -1;
+    }
+
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    conn->wbuf = malloc((line_size + 48 + FRAMER_RECORD_HEADER) * (batch_lines ? batch_lines : 1));
+
+    if(conn->wbuf == NULL) {
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+    return epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t* sorted, size_t count, double p) {
+    if(count == 0) {
+        return 0;
+    }
+
+    size_t index = (size_t)(p * (count - 1) + 0.5);
+    return sorted[index] / 1e6;
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    int port = 9000;
+    int conn_count = 16;
+    int thread_count = 4;
+    int seconds = 5;
+    const char* local_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:P:c:T:s:r:d:b:U:")) != -1) {
+        switch(opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'P':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            conn_count = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            thread_count = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            line_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        case 'd':
+            seconds = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch_lines = strtoul(optarg, NULL, 10);
+            break;
+        case 'U':
+            local_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-H host] [-P port] [-c connections] [-T threads] [-s line bytes] "
+                    "[-r lines/s per connection] [-d seconds] [-b binary lines per request] [-U local socket]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if(conn_count < 1 || thread_count < 1 || seconds < 1) {
+        fprintf(stderr, "connections, threads and seconds must be positive\n");
+        return 1;
+    }
+
+    if(thread_count > conn_count) {
+        thread_count = conn_count;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+
+    if(inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "%s: not an IPv4 address\n", host);
+        return 1;
+    }
+
+    if(local_path) {
+        if(strlen(local_path) >= sizeof(local_addr.sun_path)) {
+            fprintf(stderr, "%s: path too long\n", local_path);
+            return 1;
+        }
+
+        local_addr.sun_family = AF_UNIX;
+        strcpy(local_addr.sun_path, local_path);
+    }
+
+    struct bench_thread* threads = calloc(thread_count, sizeof(struct bench_thread));
+    struct bench_conn* conns = calloc(conn_count, sizeof(struct bench_conn));
+    all_conns = calloc(conn_count, sizeof(struct bench_conn *));
+
+    if(threads == NULL || conns == NULL || all_conns == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    all_conn_count = conn_count;
+
+    /* Connections are dealt out to the threads in contiguous blocks */
+    for(int i = 0, next = 0; i < thread_count; ++i) {
+        struct bench_thread* t = &threads[i];
+
+        t->epfd = epoll_create1(0);
+        t->conns = &conns[next];
+        t->conn_count = conn_count / thread_count + (i < conn_count % thread_count);
+
+        for(int j = 0; j < t->conn_count; ++j, ++next) {
+            all_conns[next] = &conns[next];
+
+            if(conn_open(t, &conns[next], next) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    uint64_t start = now();
+    run_id = (unsigned int)(start ^ (start >> 32) ^ ((uint64_t)getpid() << 16));
+    deadline = start + (uint64_t)seconds * 1000000000ull;
+
+    for(int i = 0; i < conn_count; ++i) {
+        conns[i].next_due = start;
+    }
+
+    for(int i = 0; i < thread_count; ++i) {
+        pthread_create(&threads[i].thread_id, NULL, thread_start, &threads[i]);
+    }
+
+    unsigned long long lines = 0;
+    unsigned long long bytes_in = 0;
+    unsigned long long errors = 0;
+    size_t latency_count = 0;
+
+    for(int i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i].thread_id, NULL);
+        lines += threads[i].lines;
+        bytes_in += threads[i].bytes_in;
+        errors += threads[i].errors;
+        latency_count += threads[i].latency_count;
+    }
+
+    double elapsed = (now() - start) / 1e9;
+    uint64_t* latencies = malloc((latency_count ? latency_count : 1) * sizeof(uint64_t));
+    size_t filled = 0;
+
+    for(int i = 0; i < thread_count; ++i) {
+        memcpy(latencies + filled, threads[i].latencies, threads[i].latency_count * sizeof(uint64_t));
+        filled += threads[i].latency_count;
+        free(threads[i].latencies);
+        close(threads[i].epfd);
+    }
+
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+
+    printf("%d connections on %d threads, %zu byte lines, ", conn_count, thread_count, line_size);
+    if(batch_lines > 0) {
+        printf("binary, %u lines per request, ", batch_lines);
+    }
+    if(rate > 0) {
+        printf("%.1f lines/s per connection, ", rate);
+    } else {
+        printf("closed loop, ");
+    }
+    printf("%.1f s\n", elapsed);
+
+    printf("lines     %llu (%.1f/s)\n", lines, lines / elapsed);
+    printf("replies   %.1f MiB (%.1f MiB/s), file %.1f MiB\n",
+           bytes_in / 1048576.0, bytes_in / 1048576.0 / elapsed, reference_len / 1048576.0);
+    printf("latency   p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+           percentile_ms(latencies, latency_count, 0.50),
+           percentile_ms(latencies, latency_count, 0.99),
+           percentile_ms(latencies, latency_count, 0.999),
+           latency_count ? latencies[latency_count - 1] / 1e6 : 0);
+    printf("errors    %llu (foreign lines %llu)\n", errors, foreign_lines);
+
+    for(int i = 0; i < conn_count; ++i) {
+        close(conns[i].fd);
+        free(conns[i].rbuf);
+        free(conns[i].wbuf);
+    }
+
+    free(latencies);
+    free(reference);
+    free(all_conns);
+    free(conns);
+    free(threads);
+
+    return errors ? 2 : 0;
+}
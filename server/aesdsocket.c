@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <syslog.h>
 #include <stdlib.h>
@@ -9,14 +10,29 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <sys/sendfile.h>
 #include <arpa/inet.h>
-#include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/queue.h>
 #include <time.h>
 
+#include "aesdsocket.h"
+#include "command.h"
+#include "commit.h"
+#include "conn.h"
+#include "evloop.h"
+#include "framing.h"
+#include "handoff.h"
+#include "log.h"
+#include "metrics.h"
+#include "sched.h"
+#include "shard.h"
+#include "shm.h"
+#include "store.h"
+#include "tail.h"
+#include "uring.h"
+
 #ifndef SLIST_FOREACH_SAFE
 #define	SLIST_FOREACH_SAFE(var, head, field, tvar)			\
 	for ((var) = SLIST_FIRST(head);				\
@@ -24,123 +40,372 @@
 	    (var) = (tvar))
 #endif
 
-static const char* out_filepath = "/var/tmp/aesdsocketdata";
-static bool caught_signal = false;
-static int server_fd = -1;
+const char* out_filepath = "/var/tmp/aesdsocketdata";
+volatile sig_atomic_t caught_signal = 0;
+static struct shards listeners = { .local_fd = -1 };
+
+/* Stack for thread mode connections, they only keep a framer and an iovec array */
+#define THREAD_STACK_SIZE (64 * 1024)
+
+enum server_mode {
+    MODE_POOL,
+    MODE_EPOLL,
+    MODE_URING,
+    MODE_THREAD,
+};
 
 struct thread_data {
     pthread_t thread_id;
-    pthread_mutex_t* out_file_mutex;
+    struct store* store;
     int client_fd;
+    /* Accepted from the Unix domain listener */
+    bool local;
     bool completed;
+    struct store_zerocopy zerocopy;
 
     SLIST_ENTRY(thread_data) threads;
 };
 
 SLIST_HEAD(slisthead, thread_data);
 
-static void *thread_start(void *thread_param) {
-    struct thread_data *data = (struct thread_data *)thread_param;
-    data->completed = false;
+/*
+ * Replay turns of thread mode, handed out first come first served to at
+ * most one thread per worker at a time.  As in the run queues of the event
+ * loops, a turn sends up to the thread's deficit and the rest of the replay
+ * queues again; waiting for room on the socket happens outside of turns.
+ */
+struct replay_turns {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long next_ticket;
+    unsigned long serving;
+    long active;
+    long slots;
+};
 
-    syslog(LOG_INFO, "Thread #%ld started working", data->thread_id);
+static struct replay_turns replay_turns = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .slots = 1,
+};
 
-    char buffer[128 * 1024];
-    char line_buffer[128 * 1024];
-    size_t linepos = 0;
+static void replay_turn_begin(void) {
+    pthread_mutex_lock(&replay_turns.lock);
+    unsigned long ticket = replay_turns.next_ticket++;
 
-    while(!caught_signal) {
-        ssize_t n = read(data->client_fd, buffer, sizeof(buffer) - 1);
+    while(ticket != replay_turns.serving || replay_turns.active == replay_turns.slots) {
+        pthread_cond_wait(&replay_turns.cond, &replay_turns.lock);
+    }
 
-        if(n < 0) {
-            int tmp_errno = errno;
-            if(tmp_errno == EINTR) {
+    ++replay_turns.serving;
+    ++replay_turns.active;
+    /* The next ticket may take another free slot */
+    pthread_cond_broadcast(&replay_turns.cond);
+    pthread_mutex_unlock(&replay_turns.lock);
+}
+
+static void replay_turn_end(void) {
+    pthread_mutex_lock(&replay_turns.lock);
+    --replay_turns.active;
+    pthread_cond_broadcast(&replay_turns.cond);
+    pthread_mutex_unlock(&replay_turns.lock);
+}
+
+/* Waits for room on the client socket, returns -1 once the replay has stalled for the stall timeout */
+static int thread_wait_writable(struct thread_data* data) {
+    struct pollfd pfd = { .fd = data->client_fd, .events = POLLOUT };
+
+    for(;;) {
+        int rc = poll(&pfd, 1, conn_limits.stall_ms > 0 ? conn_limits.stall_ms : -1);
+
+        /* Completions of zero-copy sends are queued as errors, a real one fails the next send */
+        if(rc > 0 && (pfd.revents & POLLERR) && conn_zerocopy(data->local)) {
+            if(store_zerocopy_reap(data->store, data->client_fd, &data->zerocopy) != 0) {
+                log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on zero-copy send", data->thread_id, errno,
+                        strerror(errno));
+                return -1;
+            }
+
+            if(!(pfd.revents & (POLLOUT | POLLHUP))) {
                 continue;
             }
+        }
 
-            syslog(LOG_ERR, "Thread #%ld: Error %d (%s) on read()", data->thread_id, tmp_errno, strerror(tmp_errno));
-            break;
-        } else if(n == 0) {
-            syslog(LOG_INFO, "Thread #%ld: Closed connection", data->thread_id);
-            break;
+        if(rc > 0) {
+            return 0;
         }
 
-        int rc = pthread_mutex_lock(data->out_file_mutex);
+        if(rc < 0 && errno == EINTR) {
+            continue;
+        }
 
-        if(rc != 0) {
-            syslog(LOG_ERR, "Thread #%ld: failed to lock mutex", data->thread_id);
-            break;
+        if(rc == 0) {
+            log_msg(LOG_WARNING, "Thread #%ld: Evicting connection, stalled for %d ms", data->thread_id,
+                    conn_limits.stall_ms);
+            metrics_add(METRIC_EVICTIONS, 1);
+        } else {
+            log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on poll()", data->thread_id, errno, strerror(errno));
+        }
+        return -1;
+    }
+}
+
+/*
+ * Replays the log to the client, from its start or from where a seek
+ * command points, or sends COMMAND_ERROR_REPLY for a malformed command or
+ * a seek past the log.  Returns 1 once a subscribing client belongs to the
+ * tail thread, -1 if the connection has to be closed.
+ */
+static int thread_replay(struct thread_data* data, const struct command* cmd, bool binary) {
+    bool failed = false;
+
+    struct store_snapshot snap;
+    store_snapshot(data->store, &snap);
+
+    off_t offset = snap.start;
+    metrics_add(METRIC_REPLAYS, 1);
+
+    /* The tail thread replays and follows the log from here on, with a descriptor of its own */
+    if(cmd->type == COMMAND_SUBSCRIBE) {
+        int fd = dup(data->client_fd);
+
+        if(fd < 0) {
+            log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on dup()", data->thread_id, errno, strerror(errno));
+            return -1;
+        }
+
+        if(tail_follow(fd, offset) != 0) {
+            close(fd);
+            return -1;
         }
+        return 1;
+    }
 
-        FILE * out_file = fopen(out_filepath, "a+");
+    bool error = cmd->type == COMMAND_INVALID;
 
-        if(out_file == NULL) {
-            pthread_mutex_unlock(data->out_file_mutex);
-            syslog(LOG_ERR, "Thread #%ld: failed to open file %s", data->thread_id, out_filepath);
-            break;
+    if(cmd->type == COMMAND_SEEKTO && store_seek(data->store, &snap, cmd->line, cmd->offset, &offset) != 0) {
+        log_msg(LOG_WARNING, "Thread #%ld: cannot seek to %zu,%zu", data->thread_id, cmd->line, cmd->offset);
+        error = true;
+    }
+
+    if(error) {
+        offset = snap.length;
+    }
+
+    bool corked = conn_cork(data->client_fd, data->local, snap.length - offset);
+
+    /* Sends never block inside a turn, the socket is made blocking again for reads */
+    int flags = fcntl(data->client_fd, F_GETFL, 0);
+
+    if(flags < 0 || fcntl(data->client_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on fcntl()", data->thread_id, errno, strerror(errno));
+        return -1;
+    }
+
+    /* The error, or the length with binary framing, goes out first */
+    char header[sizeof(COMMAND_ERROR_REPLY) > FRAMER_REPLY_HEADER ? sizeof(COMMAND_ERROR_REPLY) :
+                FRAMER_REPLY_HEADER];
+    size_t header_len = 0;
+    off_t deficit = 0;
+
+    if(error) {
+        header_len = sizeof(COMMAND_ERROR_REPLY) - 1;
+        memcpy(header, COMMAND_ERROR_REPLY, header_len);
+    } else if(binary) {
+        header_len = FRAMER_REPLY_HEADER;
+        framer_reply_header(header, snap.length - offset);
+    }
+
+    size_t left = header_len;
+
+    while(!failed && (left > 0 || offset < snap.length)) {
+        off_t room = conn_replay_room(data->client_fd, data->local);
+
+        if(room <= 0) {
+            metrics_add(METRIC_REPLAY_INFLIGHT_WAITS, 1);
+            failed = thread_wait_writable(data) != 0;
+            continue;
         }
 
-        for(ssize_t i = 0; i < n; ++i) {
-            char c = buffer[i];
+        replay_turn_begin();
 
-            if(c == '\n') {
-                line_buffer[linepos] = '\0';
-                fprintf(out_file, "%s\n", line_buffer);
-                syslog(LOG_DEBUG, "Thread #%ld: Appended line: %s", data->thread_id, line_buffer);
-                linepos = 0;
-            } else {
-                if(linepos < sizeof(line_buffer) - 1) {
-                    line_buffer[linepos++] = c;
+        deficit = conn_limits.replay_quantum > 0 ? deficit + conn_limits.replay_quantum : CONN_REPLAY_UNLIMITED;
+
+        bool capped = room < deficit;
+        off_t turn_end = offset + (capped ? room : deficit);
+        bool blocked = false;
+
+        if(turn_end > snap.length) {
+            turn_end = snap.length;
+        }
+
+        while(left > 0) {
+            int more = offset < snap.length ? MSG_MORE : 0;
+            ssize_t sent = send(data->client_fd, header + header_len - left, left, MSG_NOSIGNAL | more);
+
+            if(sent > 0) {
+                left -= sent;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked = true;
+                break;
+            } else if(errno != EINTR) {
+                log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on send()", data->thread_id, errno, strerror(errno));
+                failed = true;
+                break;
+            }
+        }
+
+        while(!failed && !blocked && left == 0 && offset < turn_end) {
+            uint64_t start = metrics_now();
+            ssize_t sent = conn_zerocopy(data->local) ?
+                           store_send_zerocopy(data->store, data->client_fd, &offset, turn_end, &data->zerocopy) :
+                           store_send(data->store, data->client_fd, &offset, turn_end);
+            metrics_observe(METRIC_SEND, start);
+
+            if (sent == 0) {
+                /* Retention moved the cursor past the end of this turn, the length sent up front no longer holds */
+                failed = binary;
+            } else if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blocked = true;
                 } else {
-                    syslog(LOG_ERR, "Thread #%ld: line_buffer overflow at %ld", data->thread_id, i);
+                    log_msg(LOG_ERR, "Error %d (%s) on sendfile()", errno, strerror(errno));
+                    failed = true;
                 }
+            } else {
+                deficit -= sent;
+                metrics_add(METRIC_BYTES_OUT, sent);
             }
         }
 
-        if(out_file) {
-            fflush(out_file);
-            fclose(out_file);
-            out_file = NULL;
+        replay_turn_end();
+
+        if(failed || (left == 0 && offset >= snap.length)) {
+            break;
+        }
+
+        /* Out of room waits for it outside of turns, out of deficit queues for the next turn */
+        if(blocked || capped) {
+            if(blocked && deficit > conn_limits.replay_quantum) {
+                deficit = conn_limits.replay_quantum;
+            }
+            if(capped && !blocked) {
+                metrics_add(METRIC_REPLAY_INFLIGHT_WAITS, 1);
+            }
+            failed = thread_wait_writable(data) != 0;
+        } else {
+            metrics_add(METRIC_REPLAY_YIELDS, 1);
         }
+    }
 
-        int in_fd = open(out_filepath, O_RDONLY);
+    if(fcntl(data->client_fd, F_SETFL, flags) != 0) {
+        log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on fcntl()", data->thread_id, errno, strerror(errno));
+        failed = true;
+    }
+
+    if(corked && !failed) {
+        conn_uncork(data->client_fd);
+    }
 
-        if(in_fd < 0) {
-            pthread_mutex_unlock(data->out_file_mutex);
-            syslog(LOG_ERR, "Thread #%ld: failure on in_fd = open()", data->thread_id);
+    return failed ? -1 : 0;
+}
+
+static void *thread_start(void *thread_param) {
+    struct thread_data *data = (struct thread_data *)thread_param;
+    data->completed = false;
+    memset(&data->zerocopy, 0, sizeof(data->zerocopy));
+
+    log_msg(LOG_INFO, "Thread #%ld started working", data->thread_id);
+
+    struct framer framer;
+    framer_init(&framer);
+    bool followed = false;
+
+    while(!caught_signal) {
+        size_t space;
+        char* buffer = framer_reserve(&framer, &space);
+
+        if(buffer == NULL) {
+            log_msg(LOG_ERR, "Thread #%ld: out of memory", data->thread_id);
             break;
         }
 
-        off_t offset = 0;
-        struct stat st;
+        ssize_t n = read(data->client_fd, buffer, space);
+
+        if(n < 0) {
+            int tmp_errno = errno;
+            if(tmp_errno == EINTR) {
+                continue;
+            }
 
-        if(fstat(in_fd, &st) < 0) {
-            pthread_mutex_unlock(data->out_file_mutex);
-            syslog(LOG_ERR, "Thread #%ld: Error %d (%s) on fstat()", data->thread_id, errno, strerror(errno));
-            close(in_fd);
+            log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on read()", data->thread_id, tmp_errno, strerror(tmp_errno));
+            break;
+        } else if(n == 0) {
+            log_msg(LOG_INFO, "Thread #%ld: Closed connection", data->thread_id);
             break;
         }
 
-        ssize_t sent;
-        while (offset < st.st_size) {
-            sent = sendfile(data->client_fd, in_fd, &offset, st.st_size - offset);
-            if (sent < 0) {
-                syslog(LOG_ERR, "Error %d (%s) on sendfile()", errno, strerror(errno));
-                break;
+        framer_fill(&framer, n);
+        metrics_add(METRIC_BYTES_IN, n);
+        bool failed = false;
+        bool binary = framer_binary(&framer);
+
+        /* Binary records are taken batch by batch up to the next one asking for a replay, text lines up to a command */
+        do {
+            struct command cmd = { .type = COMMAND_NONE };
+            bool replay = framer_text(&framer);
+
+            if(framer_has_lines(&framer)) {
+                struct iovec iov[COMMIT_IOV_MAX];
+                struct frame_batch batch;
+                int iovcnt = framer_take(&framer, &batch, iov, COMMIT_IOV_MAX);
+
+                /* Commands are not appended */
+                if(iovcnt >= 0 && !binary) {
+                    command_parse(iov, iovcnt, batch.len, &cmd);
+                }
+
+                if(cmd.type == COMMAND_INVALID) {
+                    log_msg(LOG_WARNING, "Thread #%ld: malformed command", data->thread_id);
+                } else if(cmd.type == COMMAND_NONE && (iovcnt < 0 || (iovcnt > 0 && commit_append(iov, iovcnt) != 0))) {
+                    log_msg(LOG_ERR, "Thread #%ld: failed to append to %s", data->thread_id, out_filepath);
+                    failed = true;
+                } else if(cmd.type == COMMAND_NONE) {
+                    log_msg(LOG_DEBUG, "Thread #%ld: Appended %zu bytes", data->thread_id, batch.data_len);
+                }
+
+                replay = batch.replay;
+                framer_release(&batch);
             }
-        }
 
-        close(in_fd);
+            if(failed || !replay) {
+                continue;
+            }
+
+            int rc = thread_replay(data, &cmd, binary);
 
-        rc = pthread_mutex_unlock(data->out_file_mutex);
+            failed = rc < 0;
+            followed = rc > 0;
+        } while(!failed && !followed && framer_has_lines(&framer));
 
-        if(rc != 0) {
-            syslog(LOG_ERR, "Thread #%ld: failed to unlock mutex", data->thread_id);
+        if(failed || followed) {
             break;
         }
     }
 
-    syslog(LOG_INFO, "Thread #%ld finished working", data->thread_id);
+    framer_destroy(&framer);
+    store_zerocopy_release(data->store, &data->zerocopy);
+
+    /* The client sees the connection go away now, the descriptor is closed once the thread is joined */
+    if(!followed) {
+        shutdown(data->client_fd, SHUT_RDWR);
+    }
+
+    log_msg(LOG_INFO, "Thread #%ld finished working", data->thread_id);
+    conn_closed();
     data->completed = true;
     return thread_param;
 }
@@ -149,102 +414,233 @@ static void signal_handler(int signal_number) {
     caught_signal = (signal_number == SIGINT || signal_number == SIGTERM);
 
     if(caught_signal) {
-        if(server_fd != -1) {
-            close(server_fd);
-            server_fd = -1;
+        if(evloop_wakeup() != 0 && uring_wakeup() != 0 && handoff_wakeup() != 0 &&
+           listeners.count > 0 && listeners.fds[0] != -1) {
+            close(listeners.fds[0]);
+            listeners.fds[0] = -1;
         }
     }
 }
 
-static void timer_handler(union sigval sv) {
-    pthread_mutex_t* out_file_mutex = (pthread_mutex_t *)sv.sival_ptr;
-
-    time_t rawtime;
-    struct tm *timeinfo;
-    char buffer[128];
-
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-
-    strftime(buffer, sizeof(buffer), "timestamp:%a, %d %b %Y %T %z", timeinfo);
-
-    pthread_mutex_lock(out_file_mutex);
-    FILE * out_file = fopen(out_filepath, "a+");
-
-    if(out_file == NULL) {
-        pthread_mutex_unlock(out_file_mutex);
-        syslog(LOG_ERR, "Failed to open file %s in timer_handler()", out_filepath);
-        return;
-    }
-
-    fprintf(out_file, "%s\n", buffer);
-    fflush(out_file);
-    fclose(out_file);
-
-    pthread_mutex_unlock(out_file_mutex);
+/* A successor takes over once the connections have drained, the listeners stay open for it */
+static void handoff_stop(void) {
+    caught_signal = 1;
+    evloop_wakeup();
+    uring_wakeup();
 }
 
-static void start_timer(pthread_mutex_t* out_file_mutex) {
-    timer_t timerid;
-    struct sigevent sev;
-    struct itimerspec its;
+/* Timestamps go through the commit queue like any client write */
+#define TIMESTAMP_INTERVAL_MS 10000
 
-    memset(&sev, 0, sizeof(struct sigevent));
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timer_handler;
-    sev.sigev_notify_attributes = NULL;
-    sev.sigev_value.sival_ptr = out_file_mutex;
+static void append_timestamp(void* arg) {
+    (void)arg;
 
-    if (timer_create(CLOCK_REALTIME, &sev, &timerid) == -1) {
-        syslog(LOG_ERR, "Failed to create timer");
+    char buffer[128];
+    size_t len = sched_strftime(buffer, sizeof(buffer) - 1, "timestamp:%a, %d %b %Y %T %z");
+
+    if(len == 0) {
         return;
     }
+    buffer[len++] = '\n';
 
-    its.it_value.tv_sec = 10;
-    its.it_value.tv_nsec = 0;
-    its.it_interval.tv_sec = 10;
-    its.it_interval.tv_nsec = 0;
+    struct iovec iov = { .iov_base = buffer, .iov_len = len };
 
-    if (timer_settime(timerid, 0, &its, NULL) == -1) {
-        syslog(LOG_ERR, "Failed to start timer");
-    } else {
-        syslog(LOG_INFO, "Started timer");
+    if(commit_append(&iov, 1) != 0) {
+        log_msg(LOG_ERR, "Failed to append a timestamp to %s", out_filepath);
     }
 }
 
 int main(int argc, char** argv) {
     int ret_code = 0;
     int daemon_mode = 0;
+    enum server_mode mode = MODE_POOL;
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    long shard_count = 1;
+    long backlog = 100;
+    bool pin = false;
+    const char* metrics_path = NULL;
+    const char* handoff_path = NULL;
+    const char* local_path = NULL;
+    const char* shm_path = NULL;
+    int handed_over = 1;
+    struct store_snapshot handed_snap;
+    struct addrinfo *servinfo = NULL;
+    long long segment_size = 0;
+    long long retain_bytes = 0;
+    bool inflight_set = false;
+    struct store store = { .path = NULL };
 
     struct slisthead thread_list_head;
     SLIST_INIT(&thread_list_head);
 
+    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+
     int opt;
-    while ((opt = getopt(argc, argv, "d")) != -1) {
-        if (opt == 'd') daemon_mode = 1;
+    int level;
+    while ((opt = getopt(argc, argv, "b:df:g:i:L:l:M:m:pq:R:r:S:s:T:U:u:w:Z:")) != -1) {
+        switch (opt) {
+        case 'b':
+            backlog = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'f':
+            if(commit_parse_durability(optarg, &commit_durability) != 0) {
+                log_msg(LOG_ERR, "Unknown durability mode %s", optarg);
+                ret_code = 1;
+                goto cleanup;
+            }
+            break;
+        case 'g':
+            segment_size = strtoll(optarg, NULL, 10);
+            break;
+        case 'i':
+            conn_limits.replay_inflight = strtoll(optarg, NULL, 10);
+            inflight_set = true;
+            break;
+        case 'L':
+            conn_limits.notsent_lowat = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            level = log_parse_level(optarg);
+
+            if(level < 0) {
+                log_msg(LOG_ERR, "Unknown log level %s", optarg);
+                ret_code = 1;
+                goto cleanup;
+            }
+            log_level = level;
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "pool") == 0) {
+                mode = MODE_POOL;
+            } else if (strcmp(optarg, "thread") == 0) {
+                mode = MODE_THREAD;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                mode = MODE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                mode = MODE_URING;
+            } else {
+                log_msg(LOG_ERR, "Unknown mode %s", optarg);
+                ret_code = 1;
+                goto cleanup;
+            }
+            break;
+        case 'p':
+            pin = true;
+            break;
+        case 'q':
+            conn_limits.replay_quantum = strtoll(optarg, NULL, 10);
+            break;
+        case 'R':
+            if(conn_parse_replay(optarg, &conn_limits.replay) != 0) {
+                log_msg(LOG_ERR, "Unknown replay strategy %s", optarg);
+                ret_code = 1;
+                goto cleanup;
+            }
+            break;
+        case 'r':
+            retain_bytes = strtoll(optarg, NULL, 10);
+            break;
+        case 'S':
+            conn_limits.sndbuf = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            shard_count = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            conn_limits.stall_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'U':
+            local_path = optarg;
+            break;
+        case 'u':
+            handoff_path = optarg;
+            break;
+        case 'w':
+            worker_count = strtol(optarg, NULL, 10);
+            break;
+        case 'Z':
+            shm_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-m pool|epoll|uring|thread] [-w workers] [-s shards] [-b backlog] [-p] [-M metrics socket]"
+                    " [-l log level] [-S sndbuf bytes] [-L unsent low watermark bytes] [-T stall timeout ms]"
+                    " [-g segment bytes] [-r retained bytes] [-f none|batch|periodic[,ms[,bytes]]]"
+                    " [-u handoff socket] [-R tiered|sendfile|zerocopy] [-q replay quantum bytes] [-i replay in-flight bytes]"
+                    " [-U local socket] [-Z shm socket]\n"
+                    "With -m uring a replay has one send of at most -q bytes in flight and takes turns by completion,"
+                    " -L only delays the retry of a blocked send and -i is not enforced\n",
+                    argv[0]);
+            ret_code = 1;
+            goto cleanup;
+        }
     }
 
-    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+    if(worker_count < 1) {
+        worker_count = 1;
+    }
+
+    if(mode == MODE_URING && !uring_supported()) {
+        log_msg(LOG_WARNING, "io_uring is not available, falling back to the worker pool");
+        mode = MODE_POOL;
+    }
+
+    /* The ring sends chunk by chunk and never looks at the socket's unsent bytes */
+    if(mode == MODE_URING && inflight_set) {
+        log_msg(LOG_WARNING, "The replay in-flight limit is not enforced with io_uring, only the quantum is");
+    }
+    if(mode == MODE_URING && conn_limits.replay == REPLAY_ZEROCOPY) {
+        log_msg(LOG_WARNING, "io_uring replays from its own buffers, zero-copy sends are not used");
+    }
+
+    /* A listener shard is only useful with an event loop or ring of its own to serve it */
+    long loop_count = (mode == MODE_EPOLL || mode == MODE_URING) ? worker_count : 1;
+
+    if(shard_count > loop_count) {
+        shard_count = loop_count;
+    }
+    if(shard_count > SHARDS_MAX) {
+        shard_count = SHARDS_MAX;
+    }
+    if(shard_count < 1) {
+        shard_count = 1;
+    }
+    if(backlog < 1) {
+        backlog = SOMAXCONN;
+    }
 
     struct sigaction new_action;
     memset(&new_action, 0, sizeof(struct sigaction));
     new_action.sa_handler = signal_handler;
 
     if(sigaction(SIGINT, &new_action, NULL) != 0) {
-        syslog(LOG_ERR, "Error %d (%s) registering for SIGINT", errno, strerror(errno));
+        log_msg(LOG_ERR, "Error %d (%s) registering for SIGINT", errno, strerror(errno));
         ret_code = 1;
         goto cleanup;
     }
 
     if(sigaction(SIGTERM, &new_action, NULL) != 0) {
-        syslog(LOG_ERR, "Error %d (%s) registering for SIGTERM", errno, strerror(errno));
+        log_msg(LOG_ERR, "Error %d (%s) registering for SIGTERM", errno, strerror(errno));
+        ret_code = 1;
+        goto cleanup;
+    }
+
+    /* A client going away mid-replay must not take the whole server down */
+    new_action.sa_handler = SIG_IGN;
+
+    if(sigaction(SIGPIPE, &new_action, NULL) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) ignoring SIGPIPE", errno, strerror(errno));
         ret_code = 1;
         goto cleanup;
     }
 
     int status;
     struct addrinfo hints;
-    struct addrinfo *servinfo = NULL;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -252,28 +648,28 @@ int main(int argc, char** argv) {
     hints.ai_flags = AI_PASSIVE;
 
     if((status = getaddrinfo(NULL, "9000", &hints, &servinfo)) != 0) {
-        syslog(LOG_ERR, "Error %d (%s) on getaddrinfo()", errno, strerror(errno));
+        log_msg(LOG_ERR, "Error %d (%s) on getaddrinfo()", errno, strerror(errno));
         ret_code = -1;
         goto cleanup;
     }
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-
-    if(server_fd == -1) {
-        syslog(LOG_ERR, "Error %d (%s) on socket()", errno, strerror(errno));
+    /* A running predecessor hands its listeners over once drained, nothing is bound then */
+    if(handoff_path && (handed_over = handoff_receive(handoff_path, &listeners, &handed_snap)) < 0) {
         ret_code = -1;
         goto cleanup;
     }
 
-    int yes = 1;
-    if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0) {
-        syslog(LOG_ERR, "Error %d (%s) on setsockopt()", errno, strerror(errno));
+    if(handed_over > 0 && shards_bind(&listeners, shard_count, servinfo->ai_addr, sizeof(struct sockaddr)) != 0) {
         ret_code = -1;
         goto cleanup;
     }
 
-    if(bind(server_fd, servinfo->ai_addr, sizeof(struct sockaddr)) != 0) {
-        syslog(LOG_ERR, "Error %d (%s) on bind()", errno, strerror(errno));
+    if(listeners.count > loop_count) {
+        log_msg(LOG_WARNING, "Took over %d listeners, only %ld are served", listeners.count, loop_count);
+    }
+
+    /* A local listener taken over is kept even without -U, nothing else would serve it */
+    if(local_path && listeners.local_fd == -1 && shards_bind_local(&listeners, local_path) != 0) {
         ret_code = -1;
         goto cleanup;
     }
@@ -282,52 +678,152 @@ int main(int argc, char** argv) {
         pid_t pid = fork();
 
         if(pid < 0) {
-            syslog(LOG_ERR, "Error %d (%s) on fork()", errno, strerror(errno));
+            log_msg(LOG_ERR, "Error %d (%s) on fork()", errno, strerror(errno));
             ret_code = -1;
             goto cleanup;
         }
 
         if(pid > 0) {
-            syslog(LOG_INFO, "The process ID of child is %d.", pid);
+            log_msg(LOG_INFO, "The process ID of child is %d.", pid);
             exit(0);
         }
     }
 
-    pthread_mutex_t out_file_mutex;
-    pthread_mutex_init(&out_file_mutex, NULL);
+    if(log_start() != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    if(store_open(&store, out_filepath, segment_size, retain_bytes) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    if(conn_limits.replay != REPLAY_SENDFILE && store_keep_hot(&store, STORE_HOT_SIZE) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    if(handed_over == 0) {
+        struct store_snapshot snap;
+        store_snapshot(&store, &snap);
+
+        if(snap.length != handed_snap.length || snap.line_count != handed_snap.line_count) {
+            log_msg(LOG_WARNING, "%s holds %lld bytes and %zu lines, the predecessor left %lld bytes and %zu lines",
+                    out_filepath, (long long)snap.length, snap.line_count,
+                    (long long)handed_snap.length, handed_snap.line_count);
+        }
+    }
+
+    if(tail_start(&store) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
 
-    start_timer(&out_file_mutex);
+    if(commit_start(&store) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
 
-    if(listen(server_fd, 100) < 0) {
-        syslog(LOG_ERR, "Error %d (%s) on listen()", errno, strerror(errno));
+    if(metrics_path && metrics_serve_start(metrics_path, &store) != 0) {
         ret_code = -1;
         goto cleanup;
     }
 
-    syslog(LOG_INFO, "Listening.");
+    if(shm_path && shm_start(shm_path, &store) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    if(sched_add("timestamp", TIMESTAMP_INTERVAL_MS, append_timestamp, NULL) != 0 || sched_start() != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    if(shards_listen(&listeners, backlog) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    log_msg(LOG_INFO, "Listening on %d shards%s.", listeners.count,
+            listeners.local_fd != -1 ? " and a local socket" : "");
+
+    if(handoff_path && handoff_serve_start(handoff_path, handoff_stop) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    if(mode == MODE_URING) {
+        if(uring_run(&listeners, worker_count, pin, &store) != 0) {
+            ret_code = -1;
+        }
+        goto cleanup;
+    }
+
+    /*
+     * pool: a fixed set of workers sharing one epoll set.
+     * epoll: one private event loop per worker.
+     */
+    if(mode != MODE_THREAD) {
+        if(evloop_run(&listeners, loop_count, worker_count, pin, &store) != 0) {
+            ret_code = -1;
+        }
+        goto cleanup;
+    }
+
+    replay_turns.slots = worker_count;
+
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setstacksize(&thread_attr, THREAD_STACK_SIZE);
 
     while(!caught_signal) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
 
-        syslog(LOG_INFO, "Waiting for connection request.");
+        log_msg(LOG_INFO, "Waiting for connection request.");
+
+        /* Connections still queued are left to a successor */
+        int listen_fd = handoff_poll(&listeners);
+
+        if(listen_fd < 0) {
+            if(handoff_draining) {
+                break;
+            }
+            continue;
+        }
 
-        int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+        bool local = listen_fd == listeners.local_fd;
+        int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
 
         if(client_fd < 0) {
             if(errno == EINTR) {
                 break;
             }
 
-            syslog(LOG_ERR, "Error %d (%s) on accept()", errno, strerror(errno));
+            log_msg(LOG_ERR, "Error %d (%s) on accept()", errno, strerror(errno));
             ret_code = -1;
             goto cleanup;
         }
 
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        char ip[INET_ADDRSTRLEN] = "local";
 
-        syslog(LOG_INFO, "Accepted connection from %s", ip);
+        if(!local) {
+            inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        }
+
+        log_msg(LOG_INFO, "Accepted connection from %s", ip);
+        metrics_add(METRIC_CONNECTIONS, 1);
+        conn_opened();
+        conn_apply_limits(client_fd, local);
+
+        if(conn_limits.stall_ms > 0) {
+            struct timeval tv = { .tv_sec = conn_limits.stall_ms / 1000, .tv_usec = conn_limits.stall_ms % 1000 * 1000 };
+
+            if(setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+                log_msg(LOG_ERR, "Error %d (%s) on setsockopt(SO_SNDTIMEO)", errno, strerror(errno));
+            }
+        }
 
         struct thread_data *data, *tmp;
 
@@ -336,75 +832,99 @@ int main(int argc, char** argv) {
                 continue;
             }
 
-            syslog(LOG_INFO, "Joining thread #%ld", data->thread_id);
+            log_msg(LOG_INFO, "Joining thread #%ld", data->thread_id);
             int join_rc = pthread_join(data->thread_id, NULL);
 
             if(join_rc != 0) {
-                syslog(LOG_ERR, "Failed to join thread #%ld", data->thread_id);
+                log_msg(LOG_ERR, "Failed to join thread #%ld", data->thread_id);
             } else {
-                syslog(LOG_INFO, "Joined thread #%ld", data->thread_id);
+                log_msg(LOG_INFO, "Joined thread #%ld", data->thread_id);
             }
 
+            close(data->client_fd);
             SLIST_REMOVE(&thread_list_head, data, thread_data, threads);
             free(data);
         }
 
         data = malloc(sizeof(struct thread_data));
         data->client_fd = client_fd;
-        data->out_file_mutex = &out_file_mutex;
+        data->local = local;
+        data->store = &store;
         data->completed = false;
         SLIST_INSERT_HEAD(&thread_list_head, data, threads);
 
-        int thread_create_rc = pthread_create(&data->thread_id, NULL, thread_start, data);
+        int thread_create_rc = pthread_create(&data->thread_id, &thread_attr, thread_start, data);
 
         if(thread_create_rc != 0) {
-            syslog(LOG_ERR, "Failed to create thread");
+            log_msg(LOG_ERR, "Failed to create thread");
+            conn_closed();
         }
     }
 
+    pthread_attr_destroy(&thread_attr);
+
+    /* Running threads finish serving their clients before the listeners are handed over */
+    handoff_wait();
+
 cleanup:
     if(caught_signal) {
-        syslog(LOG_INFO, "Caught signal, exiting");
-        remove(out_filepath);
+        log_msg(LOG_INFO, "Caught signal, exiting");
     }
 
+    sched_stop();
+
     while(!SLIST_EMPTY(&thread_list_head)) {
         struct thread_data* data = SLIST_FIRST(&thread_list_head);
 
-        if(!data->completed && data->client_fd != -1) {
-            if(close(data->client_fd) != 0) {
-                syslog(LOG_ERR, "Thread #%ld: Error %d (%s) on client_id close()", data->thread_id, errno, strerror(errno));
-            }
+        /* Wakes the thread up if it is blocked on the client, close() would not */
+        if(!data->completed && shutdown(data->client_fd, SHUT_RDWR) != 0) {
+            log_msg(LOG_ERR, "Thread #%ld: Error %d (%s) on client_id shutdown()", data->thread_id, errno, strerror(errno));
         }
 
-        syslog(LOG_INFO, "Joining thread #%ld", data->thread_id);
+        log_msg(LOG_INFO, "Joining thread #%ld", data->thread_id);
         int join_rc = pthread_join(data->thread_id, NULL);
 
         if(join_rc != 0) {
-            syslog(LOG_ERR, "Failed to join thread #%ld", data->thread_id);
+            log_msg(LOG_ERR, "Failed to join thread #%ld", data->thread_id);
         } else {
-            syslog(LOG_INFO, "Joined thread #%ld", data->thread_id);
+            log_msg(LOG_INFO, "Joined thread #%ld", data->thread_id);
         }
 
+        close(data->client_fd);
         SLIST_REMOVE_HEAD(&thread_list_head, threads);
         free(data);
     }
     SLIST_INIT(&thread_list_head);
 
-    if(server_fd != -1) {
-        if(close(server_fd) != 0) {
-            syslog(LOG_ERR, "Error %d (%s) on server_fd close()", errno, strerror(errno));
-        }
+    metrics_serve_stop();
+    shm_stop();
+    commit_stop();
+    tail_stop();
+
+    /* The successor reopens the store once it has been closed here, with its files kept */
+    struct store_snapshot snap = { .length = 0 };
+
+    if(store.path) {
+        store_snapshot(&store, &snap);
+        store_close(&store, caught_signal && !handoff_pending());
     }
 
-    pthread_mutex_destroy(&out_file_mutex);
+    bool handed_off = handoff_pending() && handoff_complete(&listeners, &snap) == 0;
+    handoff_serve_stop();
+
+    /* The successor accepts on the same socket file */
+    if(local_path && listeners.local_fd != -1 && !handed_off) {
+        unlink(local_path);
+    }
+    shards_close(&listeners);
 
     if(servinfo) {
         freeaddrinfo(servinfo);
     }
 
-    syslog(LOG_INFO, "Program finished");
+    log_msg(LOG_INFO, "Program finished");
 
+    log_stop();
     closelog();
     return ret_code;
 }
@@ -0,0 +1,9 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+
+extern const char* out_filepath;
+extern volatile sig_atomic_t caught_signal;
+
+#endif /* AESDSOCKET_H */
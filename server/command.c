@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "command.h"
+
+/* Returns a pointer to the end of line, past an optional carriage return, or NULL */
+static const char* line_end(const char* p) {
+    if(*p == '\r') {
+        ++p;
+    }
+
+    return *p == '\n' ? p : NULL;
+}
+
+static enum command_type parse_seekto(const char* p, struct command* cmd) {
+    char* end;
+
+    if(!isdigit((unsigned char)*p)) {
+        return COMMAND_INVALID;
+    }
+
+    errno = 0;
+    unsigned long long x = strtoull(p, &end, 10);
+
+    if(*end != ',' || !isdigit((unsigned char)end[1])) {
+        return COMMAND_INVALID;
+    }
+
+    unsigned long long y = strtoull(end + 1, &end, 10);
+
+    if(errno != 0 || line_end(end) == NULL) {
+        return COMMAND_INVALID;
+    }
+
+    cmd->line = x;
+    cmd->offset = y;
+    return COMMAND_SEEKTO;
+}
+
+/* Returns whether the batch holds a single line, it always ends with a newline */
+static int single_line(const struct iovec* iov, int iovcnt, size_t len) {
+    size_t pos = 0;
+
+    for(int i = 0; i < iovcnt; ++i) {
+        const char* nl = memchr(iov[i].iov_base, '\n', iov[i].iov_len);
+
+        if(nl != NULL) {
+            return pos + (size_t)(nl - (const char*)iov[i].iov_base) == len - 1;
+        }
+        pos += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+enum command_type command_parse(const struct iovec* iov, int iovcnt, size_t len, struct command* cmd) {
+    char line[COMMAND_MAX + 1];
+    size_t pos = 0;
+
+    cmd->type = COMMAND_NONE;
+
+    /* Enough of the batch to recognize a command name */
+    for(int i = 0; i < iovcnt && pos < COMMAND_MAX; ++i) {
+        size_t n = iov[i].iov_len < COMMAND_MAX - pos ? iov[i].iov_len : COMMAND_MAX - pos;
+
+        memcpy(line + pos, iov[i].iov_base, n);
+        pos += n;
+    }
+    line[pos] = '\0';
+
+    int seekto = strncmp(line, COMMAND_SEEKTO_NAME, sizeof(COMMAND_SEEKTO_NAME) - 1) == 0;
+    int subscribe = strncmp(line, COMMAND_SUBSCRIBE_LINE, sizeof(COMMAND_SUBSCRIBE_LINE) - 1) == 0;
+
+    if((!seekto && !subscribe) || !single_line(iov, iovcnt, len)) {
+        return COMMAND_NONE;
+    }
+
+    if(len > COMMAND_MAX) {
+        cmd->type = COMMAND_INVALID;
+    } else if(seekto) {
+        const char* p = line + sizeof(COMMAND_SEEKTO_NAME) - 1;
+
+        cmd->type = *p == ':' ? parse_seekto(p + 1, cmd) : COMMAND_INVALID;
+    } else {
+        cmd->type = line_end(line + sizeof(COMMAND_SUBSCRIBE_LINE) - 1) ? COMMAND_SUBSCRIBE : COMMAND_INVALID;
+    }
+
+    return cmd->type;
+}
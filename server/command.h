@@ -0,0 +1,45 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* Every command line starts with it, the framer hands such lines out one at a time */
+#define COMMAND_PREFIX "AESDCHAR_"
+#define COMMAND_SEEKTO_NAME "AESDCHAR_IOCSEEKTO"
+#define COMMAND_SUBSCRIBE_LINE "AESDCHAR_SUBSCRIBE"
+/* Longest command line recognized, including its newline */
+#define COMMAND_MAX 64
+/*
+ * Sent instead of a replay for a malformed command or a seek past what the
+ * log holds, like the -EINVAL of the driver's ioctl
+ */
+#define COMMAND_ERROR_REPLY "AESDCHAR_ERROR:EINVAL\n"
+
+enum command_type {
+    COMMAND_NONE,
+    COMMAND_INVALID,
+    /* Replay from byte offset of write command line, both counted from 0 */
+    COMMAND_SEEKTO,
+    /* Replay everything, then follow whatever is committed next */
+    COMMAND_SUBSCRIBE,
+};
+
+struct command {
+    enum command_type type;
+    size_t line;
+    size_t offset;
+};
+
+/*
+ * Recognizes a batch of complete lines made of nothing but one command
+ * line, "AESDCHAR_IOCSEEKTO:X,Y" or "AESDCHAR_SUBSCRIBE", which the server
+ * handles instead of appending it.  The framer takes lines starting with
+ * COMMAND_PREFIX on their own, so commands sent along with data lines are
+ * seen in order.  Returns COMMAND_NONE for ordinary data and
+ * COMMAND_INVALID for a malformed command: a single line starting with a
+ * command name that does not parse, whatever its length.
+ */
+extern enum command_type command_parse(const struct iovec* iov, int iovcnt, size_t len, struct command* cmd);
+
+#endif /* COMMAND_H */
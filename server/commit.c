@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include "commit.h"
+#include "conn.h"
+#include "log.h"
+#include "metrics.h"
+
+#define COMMIT_RING_SIZE 4096
+#define COMMIT_BATCH_MAX 512
+/* Defaults of the periodic durability mode */
+#define COMMIT_SYNC_INTERVAL_MS 1000
+#define COMMIT_SYNC_BYTES ((off_t)4 * 1024 * 1024)
+
+struct commit_slot {
+    size_t seq;
+    struct commit_req* req;
+};
+
+struct commit_sync {
+    struct commit_req req;
+    sem_t done;
+};
+
+static struct commit_slot ring[COMMIT_RING_SIZE];
+static size_t ring_head;
+static size_t ring_tail;
+
+struct durability commit_durability;
+
+static struct store* store;
+/* When the store was last synced, in conn_now_ms() time */
+static uint64_t synced_ms;
+static pthread_t writer_id;
+static bool writer_started = false;
+static int wake_fd = -1;
+static int writer_idle;
+static int stopping;
+static void (*listener)(void);
+
+/*
+ * Bounded MPSC ring: every slot carries a sequence number telling producers
+ * whether it is free for position pos (seq == pos) and the consumer whether
+ * it has been filled (seq == pos + 1).
+ */
+static bool ring_push(struct commit_req* req) {
+    size_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+
+    for(;;) {
+        struct commit_slot* slot = &ring[pos & (COMMIT_RING_SIZE - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->req = req;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if(diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static struct commit_req* ring_peek(void) {
+    struct commit_slot* slot = &ring[ring_tail & (COMMIT_RING_SIZE - 1)];
+
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_tail + 1) {
+        return NULL;
+    }
+
+    return slot->req;
+}
+
+static void ring_pop(void) {
+    struct commit_slot* slot = &ring[ring_tail & (COMMIT_RING_SIZE - 1)];
+
+    __atomic_store_n(&slot->seq, ring_tail + COMMIT_RING_SIZE, __ATOMIC_RELEASE);
+    ++ring_tail;
+}
+
+/* Waits for requests, or at most timeout ms unless it is negative */
+static void writer_wait(int timeout) {
+    __atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+
+    if(ring_peek() == NULL && !__atomic_load_n(&stopping, __ATOMIC_RELAXED) && poll(&pfd, 1, timeout) > 0) {
+        uint64_t count;
+        if(read(wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            log_msg(LOG_ERR, "Error %d (%s) on read() in commit writer", errno, strerror(errno));
+        }
+    }
+
+    __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+}
+
+static void writer_wakeup(void) {
+    uint64_t one = 1;
+    ssize_t rc = write(wake_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+/*
+ * Syncs the store when the durability mode calls for it, or whenever
+ * anything is left unsynced with force set.  Called with the store lock
+ * held.  Returns -1 if the sync failed.
+ */
+static int writer_sync(bool force) {
+    const struct durability* d = &commit_durability;
+    off_t unsynced = store->length - store->synced_length;
+
+    if(d->mode == DURABILITY_NONE || unsynced == 0) {
+        return 0;
+    }
+
+    if(!force && d->mode == DURABILITY_PERIODIC && unsynced < d->bytes &&
+       conn_now_ms() - synced_ms < (uint64_t)d->interval_ms) {
+        return 0;
+    }
+
+    uint64_t start = metrics_now();
+    int rc = store_sync(store);
+
+    metrics_observe(METRIC_SYNC, start);
+    synced_ms = conn_now_ms();
+
+    if(rc != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) syncing %s", errno, strerror(errno), store->path);
+    }
+    return rc;
+}
+
+/* Time left before unsynced data is due in periodic mode, -1 if nothing is waiting */
+static int writer_sync_timeout(void) {
+    if(commit_durability.mode != DURABILITY_PERIODIC || store->length == store->synced_length) {
+        return -1;
+    }
+
+    uint64_t elapsed = conn_now_ms() - synced_ms;
+    return elapsed >= (uint64_t)commit_durability.interval_ms ? 0 : commit_durability.interval_ms - (int)elapsed;
+}
+
+static void *writer_start(void *param) {
+    static struct commit_req* batch[COMMIT_BATCH_MAX];
+    static struct iovec iov[COMMIT_BATCH_MAX * 2];
+
+    log_msg(LOG_INFO, "Commit writer started working");
+
+    for(;;) {
+        int count = 0;
+        int iovcnt = 0;
+        struct commit_req* req;
+
+        while(count < COMMIT_BATCH_MAX && (req = ring_peek()) != NULL) {
+            if(iovcnt + req->iovcnt > (int)(sizeof(iov) / sizeof(iov[0]))) {
+                break;
+            }
+
+            ring_pop();
+            memcpy(&iov[iovcnt], req->iov, req->iovcnt * sizeof(struct iovec));
+            iovcnt += req->iovcnt;
+            batch[count++] = req;
+        }
+
+        if(count == 0) {
+            if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            int timeout = writer_sync_timeout();
+
+            if(timeout == 0) {
+                pthread_mutex_lock(&store->lock);
+                writer_sync(false);
+                pthread_mutex_unlock(&store->lock);
+                continue;
+            }
+
+            writer_wait(timeout);
+            continue;
+        }
+
+        uint64_t wait_start = metrics_now();
+        pthread_mutex_lock(&store->lock);
+        metrics_observe(METRIC_LOCK_WAIT, wait_start);
+
+        uint64_t hold_start = metrics_now();
+        size_t lines = store->line_count;
+        int rc = store_append(store, iov, iovcnt);
+        lines = store->line_count - lines;
+        metrics_observe(METRIC_APPEND, hold_start);
+
+        if(rc != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) appending to %s", errno, strerror(errno), store->path);
+        } else if(writer_sync(false) != 0 && commit_durability.mode == DURABILITY_BATCH) {
+            /* The lines are in the log, but the clients were promised more than that */
+            rc = -1;
+        }
+
+        pthread_mutex_unlock(&store->lock);
+        metrics_observe(METRIC_LOCK_HOLD, hold_start);
+        metrics_add(METRIC_LINES_APPENDED, lines);
+
+        if(rc == 0 && listener) {
+            listener();
+        }
+
+        for(int i = 0; i < count; ++i) {
+            batch[i]->result = rc;
+            batch[i]->complete(batch[i]);
+        }
+    }
+
+    pthread_mutex_lock(&store->lock);
+    writer_sync(true);
+    pthread_mutex_unlock(&store->lock);
+
+    log_msg(LOG_INFO, "Commit writer finished working");
+    return param;
+}
+
+void commit_set_listener(void (*committed)(void)) {
+    listener = committed;
+}
+
+int commit_parse_durability(const char* spec, struct durability* d) {
+    static const char periodic[] = "periodic";
+    char* end;
+
+    if(strcmp(spec, "none") == 0) {
+        d->mode = DURABILITY_NONE;
+        return 0;
+    }
+
+    if(strcmp(spec, "batch") == 0) {
+        d->mode = DURABILITY_BATCH;
+        return 0;
+    }
+
+    if(strncmp(spec, periodic, sizeof(periodic) - 1) != 0) {
+        return -1;
+    }
+
+    d->mode = DURABILITY_PERIODIC;
+    d->interval_ms = COMMIT_SYNC_INTERVAL_MS;
+    d->bytes = COMMIT_SYNC_BYTES;
+    spec += sizeof(periodic) - 1;
+
+    if(*spec == '\0') {
+        return 0;
+    }
+
+    long ms = *spec == ',' ? strtol(spec + 1, &end, 10) : 0;
+
+    if(ms <= 0 || ms > INT_MAX || (*end != '\0' && *end != ',')) {
+        return -1;
+    }
+    d->interval_ms = ms;
+
+    if(*end == '\0') {
+        return 0;
+    }
+
+    spec = end + 1;
+    long long bytes = strtoll(spec, &end, 10);
+
+    if(bytes <= 0 || *end != '\0') {
+        return -1;
+    }
+    d->bytes = bytes;
+    return 0;
+}
+
+int commit_start(struct store* st) {
+    store = st;
+    stopping = 0;
+    store->durable = commit_durability.mode != DURABILITY_NONE;
+    synced_ms = conn_now_ms();
+
+    for(size_t i = 0; i < COMMIT_RING_SIZE; ++i) {
+        ring[i].seq = i;
+    }
+    ring_head = 0;
+    ring_tail = 0;
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+
+    if(wake_fd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on eventfd()", errno, strerror(errno));
+        return -1;
+    }
+
+    if(pthread_create(&writer_id, NULL, writer_start, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create commit writer thread");
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    writer_started = true;
+    return 0;
+}
+
+void commit_stop(void) {
+    if(!writer_started) {
+        return;
+    }
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    writer_wakeup();
+
+    if(pthread_join(writer_id, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to join commit writer thread");
+    }
+
+    writer_started = false;
+    close(wake_fd);
+    wake_fd = -1;
+}
+
+int commit_submit(struct commit_req* req) {
+    if(req->iovcnt > COMMIT_IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while(!ring_push(req)) {
+        if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            errno = ESHUTDOWN;
+            return -1;
+        }
+        sched_yield();
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&writer_idle, __ATOMIC_RELAXED)) {
+        writer_wakeup();
+    }
+
+    return 0;
+}
+
+static void commit_sync_done(struct commit_req* req) {
+    struct commit_sync* sync = (struct commit_sync *)req;
+    sem_post(&sync->done);
+}
+
+int commit_append(const struct iovec* iov, int iovcnt) {
+    struct commit_sync sync = {
+        .req = { .iov = iov, .iovcnt = iovcnt, .complete = commit_sync_done },
+    };
+
+    if(!writer_started || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    sem_init(&sync.done, 0, 0);
+
+    if(commit_submit(&sync.req) != 0) {
+        sem_destroy(&sync.done);
+        return -1;
+    }
+
+    while(sem_wait(&sync.done) != 0 && errno == EINTR) {
+    }
+
+    sem_destroy(&sync.done);
+    return sync.req.result;
+}
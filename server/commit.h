@@ -0,0 +1,74 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <sys/uio.h>
+
+#include "store.h"
+
+#define COMMIT_IOV_MAX 32
+
+/*
+ * A batch of complete lines to append.  The iovecs must stay valid until
+ * complete() is called from the writer thread, with result set to 0 once
+ * the lines are committed to the store or -1 on failure.
+ */
+struct commit_req {
+    const struct iovec* iov;
+    int iovcnt;
+    int result;
+
+    void (*complete)(struct commit_req* req);
+    void* arg;
+
+    /* Free for use by the owner of the request once it has completed */
+    struct commit_req* next;
+};
+
+enum durability_mode {
+    /* Left to the kernel's writeback */
+    DURABILITY_NONE,
+    /* fdatasync() once interval_ms have passed or bytes are waiting, whichever comes first */
+    DURABILITY_PERIODIC,
+    /* fdatasync() after every batch, before its requests complete */
+    DURABILITY_BATCH,
+};
+
+struct durability {
+    enum durability_mode mode;
+    int interval_ms;
+    off_t bytes;
+};
+
+/* Applied by commit_start(), none by default */
+extern struct durability commit_durability;
+
+/*
+ * Parses "none", "batch" or "periodic[,ms[,bytes]]" into d.  Returns -1
+ * if spec is not valid.
+ */
+extern int commit_parse_durability(const char* spec, struct durability* d);
+
+/*
+ * Starts the writer thread which owns all appends to the store.  Requests
+ * pushed by any number of threads are drained from a bounded MPSC ring and
+ * committed together with one vectored write.
+ */
+extern int commit_start(struct store* st);
+
+/* Commits everything still queued and stops the writer thread */
+extern void commit_stop(void);
+
+/* Queues req for the writer thread, returns -1 if the pipeline is stopped */
+extern int commit_submit(struct commit_req* req);
+
+/* Queues the iovecs and waits until they are committed */
+extern int commit_append(const struct iovec* iov, int iovcnt);
+
+/*
+ * Sets a function called from the writer thread after every batch it
+ * commits, before the requests of the batch complete.  Set it before
+ * commit_start().
+ */
+extern void commit_set_listener(void (*committed)(void));
+
+#endif /* COMMIT_H */
@@ -0,0 +1,103 @@
+#include <syslog.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+#include "log.h"
+#include "store.h"
+
+struct conn_limits conn_limits = { .replay_quantum = CONN_REPLAY_QUANTUM, .replay_inflight = CONN_REPLAY_INFLIGHT };
+int conn_active;
+
+void conn_apply_limits(int fd, bool local) {
+    if(conn_limits.sndbuf > 0 &&
+       setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &conn_limits.sndbuf, sizeof(conn_limits.sndbuf)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on setsockopt(SO_SNDBUF)", errno, strerror(errno));
+    }
+
+    if(local) {
+        return;
+    }
+
+    /* EPOLLOUT only once a replay waiting for room has some */
+    int lowat = conn_limits.notsent_lowat;
+
+    if(conn_limits.replay_inflight > 0 && (lowat <= 0 || lowat > conn_limits.replay_inflight)) {
+        lowat = conn_limits.replay_inflight < INT_MAX ? (int)conn_limits.replay_inflight : INT_MAX;
+    }
+
+    if(lowat > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on setsockopt(TCP_NOTSENT_LOWAT)", errno, strerror(errno));
+    }
+
+    int on = 1;
+
+    if(conn_limits.replay != REPLAY_SENDFILE &&
+       setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on setsockopt(TCP_NODELAY)", errno, strerror(errno));
+    }
+
+    if(conn_limits.replay == REPLAY_ZEROCOPY && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on setsockopt(SO_ZEROCOPY)", errno, strerror(errno));
+    }
+}
+
+off_t conn_replay_room(int fd, bool local) {
+    int unsent;
+
+    if(local || conn_limits.replay_inflight <= 0) {
+        return CONN_REPLAY_UNLIMITED;
+    }
+
+    if(ioctl(fd, SIOCOUTQNSD, &unsent) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on ioctl(SIOCOUTQNSD)", errno, strerror(errno));
+        return CONN_REPLAY_UNLIMITED;
+    }
+
+    return conn_limits.replay_inflight - unsent;
+}
+
+int conn_parse_replay(const char* name, enum replay_strategy* replay) {
+    if(strcmp(name, "tiered") == 0) {
+        *replay = REPLAY_TIERED;
+    } else if(strcmp(name, "sendfile") == 0) {
+        *replay = REPLAY_SENDFILE;
+    } else if(strcmp(name, "zerocopy") == 0) {
+        *replay = REPLAY_ZEROCOPY;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Small replays go out with a single send() that corking would only delay */
+bool conn_cork(int fd, bool local, off_t len) {
+    int on = 1;
+
+    if(local || conn_limits.replay == REPLAY_SENDFILE || len <= STORE_HOT_SEND_MAX) {
+        return false;
+    }
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on setsockopt(TCP_CORK)", errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void conn_uncork(int fd) {
+    int off = 0;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on setsockopt(TCP_CORK)", errno, strerror(errno));
+    }
+}
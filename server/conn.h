@@ -0,0 +1,99 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * How replays are sent.  tiered keeps the end of the log in memory and
+ * copies small replays from it, sends large ones with sendfile() corked so
+ * segment boundaries do not produce short packets, and disables Nagle so
+ * small replies are not held back.  sendfile sends everything with
+ * sendfile() and leaves the socket options alone.  zerocopy is tiered with
+ * sends of STORE_ZEROCOPY_MIN bytes or more made with MSG_ZEROCOPY from the
+ * mapped segments; it is opt-in since loopback, and any other path where
+ * the kernel copies anyway, makes it slower than sendfile() (store-bench).
+ * The thread, epoll and pool modes use it, uring reads into its own buffers.
+ */
+enum replay_strategy {
+    REPLAY_TIERED,
+    REPLAY_SENDFILE,
+    REPLAY_ZEROCOPY,
+};
+
+/*
+ * Limits applied to every client connection, whatever the mode.  The send
+ * buffer is capped at sndbuf bytes and EPOLLOUT is only reported once less
+ * than notsent_lowat bytes are waiting to be sent, so a replay to a slow
+ * client neither piles up kernel memory nor wakes its loop for every few
+ * acknowledged segments.  A replay that makes no progress for stall_ms is
+ * evicted.  Replays take turns with deficit round robin: every turn adds
+ * replay_quantum bytes to what the client may send, and a TCP client never
+ * has more than replay_inflight bytes of a replay waiting to be sent, so
+ * one client asking for replays back to back, or draining slowly, cannot
+ * hold a worker.  The uring mode has no run queue: every send of at most
+ * replay_quantum bytes is a turn and replay_inflight is not enforced.  Zero
+ * leaves the kernel default or disables the limit.
+ */
+struct conn_limits {
+    int sndbuf;
+    int notsent_lowat;
+    int stall_ms;
+    off_t replay_quantum;
+    off_t replay_inflight;
+    enum replay_strategy replay;
+};
+
+#define CONN_REPLAY_QUANTUM (256 * 1024)
+#define CONN_REPLAY_INFLIGHT (1024 * 1024)
+/* Room or budget of a replay without limit */
+#define CONN_REPLAY_UNLIMITED INT64_MAX
+
+extern struct conn_limits conn_limits;
+
+/* Client connections open in any mode, not counting followers handed to the tail thread */
+extern int conn_active;
+
+static inline void conn_opened(void) {
+    __atomic_add_fetch(&conn_active, 1, __ATOMIC_RELAXED);
+}
+
+static inline void conn_closed(void) {
+    __atomic_sub_fetch(&conn_active, 1, __ATOMIC_RELAXED);
+}
+
+/* Applies conn_limits to a freshly accepted socket, local ones only get the send buffer size */
+extern void conn_apply_limits(int fd, bool local);
+
+/*
+ * Bytes a replay may still queue on fd before it has replay_inflight bytes
+ * waiting to be sent, 0 or less if it has to wait for EPOLLOUT first.
+ * Unlimited for local sockets, whose send buffer is the limit.
+ */
+extern off_t conn_replay_room(int fd, bool local);
+
+/* Whether replays to the socket use store_send_zerocopy(), which has SO_ZEROCOPY set on it */
+static inline bool conn_zerocopy(bool local) {
+    return conn_limits.replay == REPLAY_ZEROCOPY && !local;
+}
+
+/* Parses a replay strategy name, returns -1 if unknown */
+extern int conn_parse_replay(const char* name, enum replay_strategy* replay);
+
+/*
+ * Corks a TCP socket before a replay of len bytes when that is worth it,
+ * returning whether it did; uncork it with conn_uncork() once done.
+ */
+extern bool conn_cork(int fd, bool local, off_t len);
+extern void conn_uncork(int fd);
+
+/* Coarse monotonic clock for stall tracking, in milliseconds */
+static inline uint64_t conn_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif /* CONN_H */
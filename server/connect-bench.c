@@ -0,0 +1,214 @@
+/*
+ * Connection rate of aesdsocket with a growing number of listener shards.
+ * For every shard count the server is started with one pinned event loop
+ * per worker, then clients open connections as fast as they can.  Each
+ * connection is accepted, sees EOF and is closed by the server, so a
+ * completed cycle counts one full accept.  Clients reset their side once
+ * the server has closed, which keeps TIME_WAIT from exhausting local ports.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+struct bench_client {
+    pthread_t thread_id;
+    unsigned long long connects;
+    unsigned long long failures;
+};
+
+static struct sockaddr_in server_addr;
+static volatile bool running;
+
+static int connect_once(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    int rc = -1;
+
+    if(connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0 &&
+       shutdown(fd, SHUT_WR) == 0) {
+        char c;
+        ssize_t n;
+
+        while((n = read(fd, &c, 1)) < 0 && errno == EINTR) {
+        }
+        rc = n == 0 ? 0 : -1;
+    }
+
+    struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    close(fd);
+    return rc;
+}
+
+static void *client_start(void *param) {
+    struct bench_client* client = (struct bench_client *)param;
+
+    while(running) {
+        if(connect_once() == 0) {
+            client->connects++;
+        } else {
+            client->failures++;
+        }
+    }
+
+    return param;
+}
+
+static pid_t start_server(const char* server, const char* mode, int workers, int shards, bool pin) {
+    char workers_arg[16];
+    char shards_arg[16];
+
+    snprintf(workers_arg, sizeof(workers_arg), "%d", workers);
+    snprintf(shards_arg, sizeof(shards_arg), "%d", shards);
+
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        if(pin) {
+            execl(server, server, "-m", mode, "-w", workers_arg, "-s", shards_arg, "-b", "4096", "-p", (char *)NULL);
+        } else {
+            execl(server, server, "-m", mode, "-w", workers_arg, "-s", shards_arg, "-b", "4096", (char *)NULL);
+        }
+        perror(server);
+        _exit(127);
+    }
+
+    if(pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    /* Wait for the listeners to come up */
+    for(int i = 0; i < 500; ++i) {
+        if(connect_once() == 0) {
+            return pid;
+        }
+        usleep(10 * 1000);
+    }
+
+    fprintf(stderr, "%s did not start listening\n", server);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static double run(int clients, int seconds, unsigned long long* failures) {
+    struct bench_client* client = calloc(clients, sizeof(struct bench_client));
+    struct timespec start, end;
+
+    running = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(int i = 0; i < clients; ++i) {
+        pthread_create(&client[i].thread_id, NULL, client_start, &client[i]);
+    }
+
+    sleep(seconds);
+    running = false;
+
+    unsigned long long connects = 0;
+    *failures = 0;
+
+    for(int i = 0; i < clients; ++i) {
+        pthread_join(client[i].thread_id, NULL);
+        connects += client[i].connects;
+        *failures += client[i].failures;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(client);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return connects / elapsed;
+}
+
+int main(int argc, char** argv) {
+    const char* server = "./aesdsocket";
+    const char* mode = "epoll";
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int clients = 32;
+    int seconds = 2;
+    bool pin = true;
+
+    int opt;
+    while((opt = getopt(argc, argv, "x:m:w:c:t:n")) != -1) {
+        switch(opt) {
+        case 'x':
+            server = optarg;
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'w':
+            workers = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            clients = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            pin = false;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-x server] [-m epoll|uring] [-w workers] [-c clients] [-t seconds] [-n]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if(workers < 1) {
+        workers = 1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(9000);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    printf("%s mode, %ld workers, %d clients%s\n", mode, workers, clients, pin ? ", pinned" : "");
+    printf("%7s %12s %9s %9s\n", "shards", "accepts/s", "speedup", "failed");
+
+    double base = 0;
+
+    for(int shards = 1; shards <= workers; shards *= 2) {
+        pid_t pid = start_server(server, mode, workers, shards, pin);
+
+        if(pid < 0) {
+            return 1;
+        }
+
+        unsigned long long failures;
+        double rate = run(clients, seconds, &failures);
+
+        stop_server(pid);
+
+        if(base == 0) {
+            base = rate;
+        }
+
+        printf("%7d %12.0f %8.2fx %9llu\n", shards, rate, rate / base, failures);
+    }
+
+    return 0;
+}
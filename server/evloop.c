@@ -0,0 +1,1050 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/queue.h>
+#include <poll.h>
+
+#include "aesdsocket.h"
+#include "command.h"
+#include "commit.h"
+#include "conn.h"
+#include "evloop.h"
+#include "framing.h"
+#include "handoff.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "shard.h"
+#include "store.h"
+#include "tail.h"
+
+#define EVLOOP_MAX_EVENTS 64
+
+enum conn_state {
+    CONN_READING,
+    CONN_COMMITTING,
+    CONN_REPLAYING,
+};
+
+struct ev_loop;
+
+struct ev_conn {
+    int fd;
+    /* Accepted from the Unix domain listener */
+    bool local;
+    enum conn_state state;
+    /* Events registered with epoll and the ones wanted by the state machine */
+    uint32_t events;
+    uint32_t want;
+    struct ev_loop* loop;
+
+    struct framer framer;
+
+    struct commit_req commit;
+    struct frame_batch batch;
+    struct iovec commit_iov[COMMIT_IOV_MAX];
+
+    /* Output cursor into the store, and when it last moved */
+    off_t replay_offset;
+    off_t replay_end;
+    uint64_t progress_ms;
+    /* Bytes the replay may still send in its turns, and its place in the run queue */
+    off_t deficit;
+    bool queued;
+    TAILQ_ENTRY(ev_conn) replays;
+    bool corked;
+    struct store_zerocopy zerocopy;
+    /*
+     * Sent ahead of the replay, and how much of it is left: the length with binary framing,
+     * or COMMAND_ERROR_REPLY instead of a replay
+     */
+    char reply_header[sizeof(COMMAND_ERROR_REPLY) > FRAMER_REPLY_HEADER ? sizeof(COMMAND_ERROR_REPLY) :
+                      FRAMER_REPLY_HEADER];
+    size_t header_len;
+    size_t header_left;
+
+    LIST_ENTRY(ev_conn) conns;
+};
+
+LIST_HEAD(conn_list, ev_conn);
+TAILQ_HEAD(replay_queue, ev_conn);
+
+/*
+ * An epoll set with the connections registered in it.  A loop served by
+ * several workers is shared: every registration is EPOLLONESHOT so each
+ * event is handled by exactly one worker, which re-arms the descriptor
+ * when it is done with it.
+ *
+ * Replays able to send wait in the run queue instead of on EPOLLOUT, with
+ * no event armed but hang ups, and workers give each of them a turn after
+ * every batch of events.  Whoever takes a connection off the queue owns
+ * it until it is queued or armed again.
+ */
+struct ev_loop {
+    int index;
+    int epfd;
+    bool shared;
+    /* Listening socket of the shard this loop accepts from, and the local one or -1 */
+    int listen_fd;
+    int local_fd;
+
+    pthread_mutex_t lock;
+    struct conn_list conns;
+    struct replay_queue replays;
+    size_t replay_count;
+
+    /* Signalled by the commit writer when completed is no longer empty */
+    int wake_fd;
+    struct commit_req* completed;
+    size_t pending_commits;
+
+    /* Ticks while a stall timeout is configured, to evict stalled replays */
+    int timer_fd;
+};
+
+struct ev_worker {
+    pthread_t thread_id;
+    int index;
+    struct ev_loop* loop;
+};
+
+static int shutdown_fd = -1;
+static struct store* store;
+static struct obj_pool conn_pool;
+
+static void conn_close(struct ev_loop* loop, struct ev_conn* conn) {
+    /* Unlinked first, loop_evict_stalled() must not shut down a descriptor number reused by an accept */
+    pthread_mutex_lock(&loop->lock);
+    LIST_REMOVE(conn, conns);
+
+    if(conn->queued) {
+        TAILQ_REMOVE(&loop->replays, conn, replays);
+        __atomic_sub_fetch(&loop->replay_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    /* A follower's socket belongs to the tail thread now */
+    if(conn->fd != -1) {
+        log_msg(LOG_INFO, "Loop #%d: Closed connection %d", loop->index, conn->fd);
+        close(conn->fd);
+    }
+
+    framer_release(&conn->batch);
+    framer_destroy(&conn->framer);
+    store_zerocopy_release(store, &conn->zerocopy);
+    obj_pool_free(&conn_pool, conn);
+    conn_closed();
+}
+
+static int loop_rearm(struct ev_loop* loop, int fd, void* ptr) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = ptr };
+
+    if(loop->shared && epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+        log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on epoll_ctl()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Registers conn->want with epoll.  Shared loops always re-arm since the
+ * event that was just handled disabled the descriptor.  Without any wanted
+ * event (while committing) at most one hang up is reported.
+ */
+static int conn_arm(struct ev_loop* loop, struct ev_conn* conn) {
+    uint32_t events = conn->want;
+
+    if(loop->shared) {
+        if(events == 0) {
+            return 0;
+        }
+        events |= EPOLLONESHOT;
+    } else {
+        if(events == 0) {
+            events = EPOLLONESHOT;
+        }
+        if(conn->events == events) {
+            return 0;
+        }
+    }
+
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on epoll_ctl()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    conn->events = events;
+    return 0;
+}
+
+/*
+ * Last step of whoever handled the connection: registers conn->want, and
+ * puts a replay that can send, wanting no event, at the end of the run queue.
+ */
+static int conn_release(struct ev_loop* loop, struct ev_conn* conn) {
+    if(conn_arm(loop, conn) != 0) {
+        return -1;
+    }
+
+    if(conn->state == CONN_REPLAYING && conn->want == 0) {
+        /* Waiting for its turn is no stall, the clock restarts once it has to wait for EPOLLOUT */
+        __atomic_store_n(&conn->progress_ms, conn_now_ms(), __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&loop->lock);
+        TAILQ_INSERT_TAIL(&loop->replays, conn, replays);
+        conn->queued = true;
+        __atomic_add_fetch(&loop->replay_count, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&loop->lock);
+    }
+
+    return 0;
+}
+
+/*
+ * One turn of deficit round robin: adds the quantum to the bytes the replay
+ * may send and sends up to that, without queueing more than the in-flight
+ * limit on the socket.  Returns 1 when the replay has to continue, queued
+ * again for its next turn with want cleared or waiting for EPOLLOUT, 0 once
+ * the whole snapshot has been sent and -1 on error.  The deficit left by a
+ * turn carries over; a connection that goes idle starts from nothing.
+ */
+static int conn_replay(struct ev_conn* conn) {
+    off_t room = conn_replay_room(conn->fd, conn->local);
+
+    if(room <= 0) {
+        metrics_add(METRIC_REPLAY_INFLIGHT_WAITS, 1);
+        conn->want = EPOLLOUT;
+        return 1;
+    }
+
+    if(conn_limits.replay_quantum > 0) {
+        conn->deficit += conn_limits.replay_quantum;
+    } else {
+        conn->deficit = CONN_REPLAY_UNLIMITED;
+    }
+
+    bool capped = room < conn->deficit;
+    off_t budget = capped ? room : conn->deficit;
+
+    while(conn->header_left > 0) {
+        int more = conn->replay_offset < conn->replay_end ? MSG_MORE : 0;
+        ssize_t sent = send(conn->fd, conn->reply_header + conn->header_len - conn->header_left,
+                            conn->header_left, MSG_NOSIGNAL | more);
+
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->want = EPOLLOUT;
+                return 1;
+            }
+
+            log_msg(LOG_ERR, "Error %d (%s) on send()", errno, strerror(errno));
+            return -1;
+        }
+
+        conn->header_left -= sent;
+    }
+
+    off_t turn_end = conn->replay_end;
+
+    if(turn_end - conn->replay_offset > budget) {
+        turn_end = conn->replay_offset + budget;
+    }
+
+    while(conn->replay_offset < conn->replay_end) {
+        if(conn->replay_offset >= turn_end) {
+            /* Out of room waits for EPOLLOUT, out of deficit for the next turn */
+            if(capped) {
+                metrics_add(METRIC_REPLAY_INFLIGHT_WAITS, 1);
+                conn->want = EPOLLOUT;
+            } else {
+                metrics_add(METRIC_REPLAY_YIELDS, 1);
+                conn->want = 0;
+            }
+            return 1;
+        }
+
+        uint64_t start = metrics_now();
+        ssize_t sent = conn_zerocopy(conn->local) ?
+                       store_send_zerocopy(store, conn->fd, &conn->replay_offset, turn_end, &conn->zerocopy) :
+                       store_send(store, conn->fd, &conn->replay_offset, turn_end);
+        metrics_observe(METRIC_SEND, start);
+
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Blocked rather than served, one quantum is all it keeps */
+                if(conn->deficit > conn_limits.replay_quantum) {
+                    conn->deficit = conn_limits.replay_quantum;
+                }
+                conn->want = EPOLLOUT;
+                return 1;
+            }
+
+            log_msg(LOG_ERR, "Error %d (%s) on sendfile()", errno, strerror(errno));
+            return -1;
+        }
+
+        if(sent == 0) {
+            /* The length sent up front no longer holds */
+            if(framer_binary(&conn->framer)) {
+                log_msg(LOG_WARNING, "Connection %d: replay cut short by retention", conn->fd);
+                return -1;
+            }
+            /* Retention moved the cursor past the end of this turn only */
+            if(conn->replay_offset < conn->replay_end) {
+                continue;
+            }
+            break;
+        }
+
+        conn->deficit -= sent;
+        metrics_add(METRIC_BYTES_OUT, sent);
+        __atomic_store_n(&conn->progress_ms, conn_now_ms(), __ATOMIC_RELAXED);
+    }
+
+    if(conn->corked) {
+        conn_uncork(conn->fd);
+        conn->corked = false;
+    }
+
+    conn->deficit = 0;
+    conn->state = CONN_READING;
+    conn->want = EPOLLIN;
+    return 0;
+}
+
+/*
+ * Replays the whole log, or from the position of a seek command to its end.
+ * A malformed command or a seek past the log gets COMMAND_ERROR_REPLY instead.
+ */
+static int conn_start_replay(struct ev_conn* conn, const struct command* cmd) {
+    struct store_snapshot snap;
+    store_snapshot(store, &snap);
+
+    conn->state = CONN_REPLAYING;
+    conn->replay_offset = snap.start;
+    conn->replay_end = snap.length;
+
+    bool error = cmd && cmd->type == COMMAND_INVALID;
+
+    if(cmd && cmd->type == COMMAND_SEEKTO &&
+       store_seek(store, &snap, cmd->line, cmd->offset, &conn->replay_offset) != 0) {
+        log_msg(LOG_WARNING, "Connection %d: cannot seek to %zu,%zu", conn->fd, cmd->line, cmd->offset);
+        error = true;
+    }
+
+    if(error) {
+        conn->replay_offset = snap.length;
+        conn->header_len = conn->header_left = sizeof(COMMAND_ERROR_REPLY) - 1;
+        memcpy(conn->reply_header, COMMAND_ERROR_REPLY, conn->header_len);
+    } else if(framer_binary(&conn->framer)) {
+        framer_reply_header(conn->reply_header, conn->replay_end - conn->replay_offset);
+        conn->header_len = conn->header_left = FRAMER_REPLY_HEADER;
+    }
+
+    __atomic_store_n(&conn->progress_ms, conn_now_ms(), __ATOMIC_RELAXED);
+    metrics_add(METRIC_REPLAYS, 1);
+    conn->corked = conn_cork(conn->fd, conn->local, conn->replay_end - conn->replay_offset);
+
+    /* Sent in turns, queued once the caller releases the connection */
+    conn->deficit = 0;
+    conn->want = 0;
+    return 1;
+}
+
+/* Hands the connection over to the tail thread, which replays the log from its start */
+static int conn_follow(struct ev_loop* loop, struct ev_conn* conn) {
+    struct store_snapshot snap;
+    store_snapshot(store, &snap);
+
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL) != 0) {
+        log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on epoll_ctl()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    if(tail_follow(conn->fd, snap.start) != 0) {
+        return -1;
+    }
+
+    metrics_add(METRIC_REPLAYS, 1);
+    conn->fd = -1;
+    return -1;
+}
+
+/* Called from the commit writer thread */
+static void conn_commit_done(struct commit_req* req) {
+    struct ev_conn* conn = (struct ev_conn *)req->arg;
+    struct ev_loop* loop = conn->loop;
+    struct commit_req* head = __atomic_load_n(&loop->completed, __ATOMIC_RELAXED);
+
+    do {
+        req->next = head;
+    } while(!__atomic_compare_exchange_n(&loop->completed, &head, req, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(head == NULL) {
+        uint64_t one = 1;
+        ssize_t rc = write(loop->wake_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+/*
+ * Hands the complete lines received so far to the commit writer; the replay
+ * starts once they are committed, so it covers at least everything up to
+ * and including this chunk.  Chunks without a newline are replayed right away.
+ * Binary records are taken batch by batch up to the next one asking for a
+ * replay, and nothing is replayed until one does; text lines up to the next
+ * command, which is handled once they are.  Returns 1 once the connection
+ * belongs to the commit writer.
+ */
+static int conn_process(struct ev_loop* loop, struct ev_conn* conn) {
+    bool binary = framer_binary(&conn->framer);
+
+    if(!framer_has_lines(&conn->framer)) {
+        return !framer_text(&conn->framer) || conn_start_replay(conn, NULL) >= 0 ? 0 : -1;
+    }
+
+    int iovcnt = framer_take(&conn->framer, &conn->batch, conn->commit_iov, COMMIT_IOV_MAX);
+
+    if(iovcnt < 0) {
+        log_msg(LOG_ERR, "Connection %d: Error %d (%s) framing lines", conn->fd, errno, strerror(errno));
+        return -1;
+    }
+
+    /* Commands are not appended */
+    struct command cmd = { .type = COMMAND_NONE };
+
+    if(!binary) {
+        command_parse(conn->commit_iov, iovcnt, conn->batch.len, &cmd);
+    }
+
+    switch(cmd.type) {
+    case COMMAND_NONE:
+        break;
+    case COMMAND_INVALID:
+        log_msg(LOG_WARNING, "Connection %d: malformed command", conn->fd);
+        /* fall through */
+    case COMMAND_SEEKTO:
+        framer_release(&conn->batch);
+        return conn_start_replay(conn, &cmd) < 0 ? -1 : 0;
+    case COMMAND_SUBSCRIBE:
+        framer_release(&conn->batch);
+        return conn_follow(loop, conn);
+    }
+
+    /* Empty records, at most asking for a replay */
+    if(iovcnt == 0) {
+        bool replay = conn->batch.replay;
+        framer_release(&conn->batch);
+
+        int rc = replay ? conn_start_replay(conn, NULL) : 0;
+
+        if(rc == 0 && framer_has_lines(&conn->framer)) {
+            return conn_process(loop, conn);
+        }
+        return rc < 0 ? -1 : 0;
+    }
+
+    conn->commit.iov = conn->commit_iov;
+    conn->commit.iovcnt = iovcnt;
+    conn->commit.complete = conn_commit_done;
+    conn->commit.arg = conn;
+
+    /* The connection must not be touched by anyone but the writer until the commit completes */
+    conn->state = CONN_COMMITTING;
+    conn->want = 0;
+
+    if(conn_arm(loop, conn) != 0) {
+        return -1;
+    }
+
+    __atomic_add_fetch(&loop->pending_commits, 1, __ATOMIC_RELAXED);
+
+    if(commit_submit(&conn->commit) != 0) {
+        log_msg(LOG_ERR, "Connection %d: failed to append to %s", conn->fd, out_filepath);
+        __atomic_sub_fetch(&loop->pending_commits, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 1;
+}
+
+static void conn_committed(struct ev_loop* loop, struct ev_conn* conn) {
+    __atomic_sub_fetch(&loop->pending_commits, 1, __ATOMIC_RELAXED);
+
+    bool replay = conn->batch.replay;
+    framer_release(&conn->batch);
+
+    if(conn->commit.result != 0 || caught_signal) {
+        conn_close(loop, conn);
+        return;
+    }
+
+    int rc = 0;
+
+    if(replay) {
+        rc = conn_start_replay(conn, NULL);
+    } else {
+        conn->state = CONN_READING;
+        conn->want = EPOLLIN;
+    }
+
+    /* Records left behind by a replay request or too many for one commit, lines after a command */
+    if(rc == 0 && framer_has_lines(&conn->framer)) {
+        rc = conn_process(loop, conn);
+
+        if(rc > 0) {
+            return;
+        }
+    }
+
+    if(rc < 0 || conn_release(loop, conn) != 0) {
+        conn_close(loop, conn);
+    }
+}
+
+static void loop_handle_completions(struct ev_loop* loop) {
+    uint64_t count;
+    ssize_t rc = read(loop->wake_fd, &count, sizeof(count));
+    (void)rc;
+
+    struct commit_req* req = __atomic_exchange_n(&loop->completed, NULL, __ATOMIC_ACQUIRE);
+
+    while(req) {
+        struct commit_req* next = req->next;
+        conn_committed(loop, (struct ev_conn *)req->arg);
+        req = next;
+    }
+}
+
+/* Reads what the client sent and processes it, returns 1 once the connection belongs to the commit writer */
+static int conn_read(struct ev_loop* loop, struct ev_conn* conn) {
+    size_t space;
+    char* buffer = framer_reserve(&conn->framer, &space);
+
+    if(buffer == NULL) {
+        log_msg(LOG_ERR, "Connection %d: out of memory", conn->fd);
+        return -1;
+    }
+
+    ssize_t n = read(conn->fd, buffer, space);
+
+    if(n < 0) {
+        if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        log_msg(LOG_ERR, "Connection %d: Error %d (%s) on read()", conn->fd, errno, strerror(errno));
+        return -1;
+    }
+
+    if(n == 0) {
+        return -1;
+    }
+
+    framer_fill(&conn->framer, n);
+    metrics_add(METRIC_BYTES_IN, n);
+
+    return conn_process(loop, conn);
+}
+
+/*
+ * Evicts every connection whose replay has been waiting for EPOLLOUT without
+ * sending a byte for longer than the stall timeout.  Replays in the run queue
+ * are only waiting for their turn and are left alone.  On a shared loop the
+ * connection may be handled by another worker at the same time, so it is
+ * only shut down here; the resulting hang up closes it as usual.
+ */
+static void loop_evict_stalled(struct ev_loop* loop) {
+    uint64_t count;
+    ssize_t rc = read(loop->timer_fd, &count, sizeof(count));
+    (void)rc;
+
+    uint64_t now = conn_now_ms();
+    struct ev_conn* conn;
+
+    pthread_mutex_lock(&loop->lock);
+    LIST_FOREACH(conn, &loop->conns, conns) {
+        if(__atomic_load_n(&conn->state, __ATOMIC_RELAXED) != CONN_REPLAYING || conn->queued ||
+           now - __atomic_load_n(&conn->progress_ms, __ATOMIC_RELAXED) <= (uint64_t)conn_limits.stall_ms) {
+            continue;
+        }
+
+        log_msg(LOG_WARNING, "Loop #%d: Evicting connection %d, stalled for %d ms", loop->index, conn->fd,
+                conn_limits.stall_ms);
+        metrics_add(METRIC_EVICTIONS, 1);
+        shutdown(conn->fd, SHUT_RDWR);
+        /* Not evicted again before the hang up has been handled */
+        __atomic_store_n(&conn->progress_ms, now, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&loop->lock);
+}
+
+static void conn_handle(struct ev_loop* loop, struct ev_conn* conn, uint32_t events) {
+    int rc;
+
+    /* The writer still references the connection, it is closed once committed */
+    if(conn->state == CONN_COMMITTING) {
+        return;
+    }
+
+    /* Completions of zero-copy sends are queued as errors, a real one fails the next send or read */
+    if((events & EPOLLERR) && conn_zerocopy(conn->local)) {
+        if(store_zerocopy_reap(store, conn->fd, &conn->zerocopy) != 0) {
+            log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on zero-copy send", loop->index, errno, strerror(errno));
+            conn_close(loop, conn);
+            return;
+        }
+
+        events &= ~EPOLLERR;
+
+        /* Only the one shot registration of a queued replay fired, its turn arms it again */
+        if(conn->queued) {
+            conn->events = 0;
+            return;
+        }
+    }
+
+    switch(conn->state) {
+    case CONN_REPLAYING:
+        /* Room again, the replay waits for its turn at the end of the run queue */
+        rc = (events & (EPOLLERR | EPOLLHUP)) ? -1 : 0;
+        conn->want = 0;
+        break;
+    default:
+        rc = conn_read(loop, conn);
+        /* Once submitted, the connection belongs to the commit writer */
+        if(rc > 0) {
+            return;
+        }
+        break;
+    }
+
+    if(rc < 0 || conn_release(loop, conn) != 0) {
+        conn_close(loop, conn);
+    }
+}
+
+/* Gives one turn to every replay queued when the round starts */
+static void loop_run_replays(struct ev_loop* loop) {
+    size_t round = __atomic_load_n(&loop->replay_count, __ATOMIC_RELAXED);
+
+    for(size_t i = 0; i < round && !caught_signal; ++i) {
+        pthread_mutex_lock(&loop->lock);
+        struct ev_conn* conn = TAILQ_FIRST(&loop->replays);
+
+        if(conn != NULL) {
+            TAILQ_REMOVE(&loop->replays, conn, replays);
+            conn->queued = false;
+            __atomic_sub_fetch(&loop->replay_count, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        if(conn == NULL) {
+            break;
+        }
+
+        int rc = conn_replay(conn);
+
+        if(rc == 0 && framer_has_lines(&conn->framer)) {
+            rc = conn_process(loop, conn);
+
+            if(rc > 0) {
+                continue;
+            }
+        }
+
+        if(rc < 0 || conn_release(loop, conn) != 0) {
+            conn_close(loop, conn);
+        }
+    }
+}
+
+static void accept_clients(struct ev_loop* loop, int* listen_fd) {
+    bool local = listen_fd == &loop->local_fd;
+
+    for(;;) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(*listen_fd, (struct sockaddr*)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(client_fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno != EAGAIN && errno != EWOULDBLOCK && !caught_signal) {
+                log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on accept()", loop->index, errno, strerror(errno));
+            }
+            break;
+        }
+
+        char ip[INET_ADDRSTRLEN] = "local";
+
+        if(!local) {
+            inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        }
+
+        log_msg(LOG_INFO, "Loop #%d: Accepted connection from %s", loop->index, ip);
+        metrics_add(METRIC_CONNECTIONS, 1);
+
+        struct ev_conn* conn = obj_pool_alloc(&conn_pool);
+
+        if(conn == NULL) {
+            log_msg(LOG_ERR, "Loop #%d: out of memory", loop->index);
+            close(client_fd);
+            continue;
+        }
+
+        memset(conn, 0, sizeof(struct ev_conn));
+        conn_opened();
+        conn->fd = client_fd;
+        conn->local = local;
+        conn->loop = loop;
+        framer_init(&conn->framer);
+        conn->state = CONN_READING;
+        conn->want = EPOLLIN;
+        conn_apply_limits(client_fd, local);
+        conn->events = loop->shared ? EPOLLIN | EPOLLONESHOT : EPOLLIN;
+
+        pthread_mutex_lock(&loop->lock);
+        LIST_INSERT_HEAD(&loop->conns, conn, conns);
+        pthread_mutex_unlock(&loop->lock);
+
+        struct epoll_event ev = { .events = conn->events, .data.ptr = conn };
+
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+            log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on epoll_ctl()", loop->index, errno, strerror(errno));
+            conn_close(loop, conn);
+            continue;
+        }
+    }
+
+    loop_rearm(loop, *listen_fd, listen_fd);
+}
+
+static void loop_handle_event(struct ev_loop* loop, struct epoll_event* event) {
+    void* ptr = event->data.ptr;
+
+    if(ptr == &shutdown_fd) {
+        return;
+    }
+
+    if(ptr == &loop->listen_fd || ptr == &loop->local_fd) {
+        /* Queued connections are left to the successor */
+        if(handoff_draining) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, *(int *)ptr, NULL);
+            return;
+        }
+        accept_clients(loop, (int *)ptr);
+        return;
+    }
+
+    if(ptr == &loop->wake_fd) {
+        loop_handle_completions(loop);
+        loop_rearm(loop, loop->wake_fd, &loop->wake_fd);
+        return;
+    }
+
+    if(ptr == &loop->timer_fd) {
+        loop_evict_stalled(loop);
+        loop_rearm(loop, loop->timer_fd, &loop->timer_fd);
+        return;
+    }
+
+    conn_handle(loop, (struct ev_conn *)ptr, event->events);
+}
+
+static void *worker_start(void *param) {
+    struct ev_worker* worker = (struct ev_worker *)param;
+    struct ev_loop* loop = worker->loop;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+    /* Workers sharing a loop take one event at a time, so none of them sits on a backlog */
+    int max_events = loop->shared ? 1 : EVLOOP_MAX_EVENTS;
+
+    log_msg(LOG_INFO, "Worker #%d started working on loop #%d", worker->index, loop->index);
+
+    while(!caught_signal) {
+        /* Queued replays are served between batches of events, which are only polled for meanwhile */
+        int timeout = __atomic_load_n(&loop->replay_count, __ATOMIC_RELAXED) > 0 ? 0 : -1;
+        int n = epoll_wait(loop->epfd, events, max_events, timeout);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            log_msg(LOG_ERR, "Worker #%d: Error %d (%s) on epoll_wait()", worker->index, errno, strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n && !caught_signal; ++i) {
+            loop_handle_event(loop, &events[i]);
+        }
+
+        loop_run_replays(loop);
+    }
+
+    log_msg(LOG_INFO, "Worker #%d finished working", worker->index);
+    return param;
+}
+
+/* Runs once all workers have exited, nothing else touches the loop anymore */
+static void loop_drain(struct ev_loop* loop) {
+    while(__atomic_load_n(&loop->pending_commits, __ATOMIC_RELAXED) > 0) {
+        struct pollfd pfd = { .fd = loop->wake_fd, .events = POLLIN };
+
+        if(poll(&pfd, 1, -1) > 0) {
+            loop_handle_completions(loop);
+        }
+    }
+
+    while(!LIST_EMPTY(&loop->conns)) {
+        conn_close(loop, LIST_FIRST(&loop->conns));
+    }
+}
+
+static int loop_add(struct ev_loop* loop, int fd, uint32_t events, void* ptr) {
+    struct epoll_event ev = { .events = events, .data.ptr = ptr };
+
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on epoll_ctl()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int loop_init(struct ev_loop* loop, int index, bool shared, int listen_fd, int local_fd) {
+    loop->index = index;
+    loop->shared = shared;
+    loop->listen_fd = listen_fd;
+    loop->local_fd = local_fd;
+    LIST_INIT(&loop->conns);
+    TAILQ_INIT(&loop->replays);
+    pthread_mutex_init(&loop->lock, NULL);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(loop->epfd < 0 || loop->wake_fd < 0) {
+        log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on epoll_create1()", index, errno, strerror(errno));
+        return -1;
+    }
+
+    uint32_t oneshot = shared ? EPOLLONESHOT : 0;
+
+    /* Level triggered without EPOLLONESHOT, so it wakes every worker */
+    if(loop_add(loop, shutdown_fd, EPOLLIN, &shutdown_fd) != 0) {
+        return -1;
+    }
+
+    if(loop_add(loop, loop->wake_fd, EPOLLIN | oneshot, &loop->wake_fd) != 0) {
+        return -1;
+    }
+
+    if(conn_limits.stall_ms > 0) {
+        /* Stalls are detected within a quarter of the timeout */
+        long tick_ms = conn_limits.stall_ms / 4 > 10 ? conn_limits.stall_ms / 4 : 10;
+        struct itimerspec its = {
+            .it_interval = { .tv_sec = tick_ms / 1000, .tv_nsec = tick_ms % 1000 * 1000000 },
+            .it_value = { .tv_sec = tick_ms / 1000, .tv_nsec = tick_ms % 1000 * 1000000 },
+        };
+
+        loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if(loop->timer_fd < 0 || timerfd_settime(loop->timer_fd, 0, &its, NULL) != 0) {
+            log_msg(LOG_ERR, "Loop #%d: Error %d (%s) on timerfd_create()", index, errno, strerror(errno));
+            return -1;
+        }
+
+        if(loop_add(loop, loop->timer_fd, EPOLLIN | oneshot, &loop->timer_fd) != 0) {
+            return -1;
+        }
+    }
+
+    /* Only one of the loops is woken up for each incoming connection */
+    if(loop_add(loop, listen_fd, EPOLLIN | (shared ? EPOLLONESHOT : EPOLLEXCLUSIVE), &loop->listen_fd) != 0) {
+        return -1;
+    }
+
+    /* Every loop accepts local clients from the same listener */
+    if(local_fd != -1 &&
+       loop_add(loop, local_fd, EPOLLIN | (shared ? EPOLLONESHOT : EPOLLEXCLUSIVE), &loop->local_fd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int listener_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on fcntl()", errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int evloop_wakeup(void) {
+    if(shutdown_fd == -1) {
+        return -1;
+    }
+
+    uint64_t one = 1;
+    ssize_t rc = write(shutdown_fd, &one, sizeof(one));
+    (void)rc;
+    return 0;
+}
+
+int evloop_run(const struct shards* listeners, int loop_count, int worker_count, bool pin, struct store* data_store) {
+    int ret_code = 0;
+    int started = 0;
+    int efd;
+
+    if(worker_count < loop_count) {
+        worker_count = loop_count;
+    }
+
+    struct ev_loop* loops = calloc(loop_count, sizeof(struct ev_loop));
+    struct ev_worker* workers = calloc(worker_count, sizeof(struct ev_worker));
+
+    if(loops == NULL || workers == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate %d loops", loop_count);
+        free(loops);
+        free(workers);
+        return -1;
+    }
+
+    for(int i = 0; i < loop_count; ++i) {
+        loops[i].epfd = -1;
+        loops[i].wake_fd = -1;
+        loops[i].timer_fd = -1;
+    }
+
+    store = data_store;
+    obj_pool_init(&conn_pool, sizeof(struct ev_conn), 64);
+
+    for(int i = 0; i < listeners->count; ++i) {
+        if(listener_nonblock(listeners->fds[i]) != 0) {
+            ret_code = -1;
+            goto cleanup;
+        }
+    }
+
+    if(listeners->local_fd != -1 && listener_nonblock(listeners->local_fd) != 0) {
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(efd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on eventfd()", errno, strerror(errno));
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    shutdown_fd = efd;
+
+    for(int i = 0; i < loop_count; ++i) {
+        /* Workers are spread evenly, a loop with more than one of them is shared */
+        int per_loop = worker_count / loop_count + (i < worker_count % loop_count);
+
+        int listen_fd = listeners->fds[shard_for_loop(listeners, i)];
+
+        if(loop_init(&loops[i], i, per_loop > 1, listen_fd, listeners->local_fd) != 0) {
+            ret_code = -1;
+            goto cleanup;
+        }
+    }
+
+    for(; started < worker_count; ++started) {
+        workers[started].index = started;
+        workers[started].loop = &loops[started % loop_count];
+
+        int rc = pthread_create(&workers[started].thread_id, NULL, worker_start, &workers[started]);
+
+        if(rc != 0) {
+            log_msg(LOG_ERR, "Failed to create worker thread");
+            ret_code = -1;
+            break;
+        }
+
+        if(pin) {
+            shard_pin(workers[started].thread_id, started);
+        }
+    }
+
+    log_msg(LOG_INFO, "Running %d workers on %d event loops and %d listeners", started, loop_count, listeners->count);
+
+cleanup:
+    if(ret_code != 0) {
+        caught_signal = 1;
+        evloop_wakeup();
+    }
+
+    for(int i = 0; i < started; ++i) {
+        int join_rc = pthread_join(workers[i].thread_id, NULL);
+
+        if(join_rc != 0) {
+            log_msg(LOG_ERR, "Failed to join worker #%d", i);
+        }
+    }
+
+    for(int i = 0; i < loop_count; ++i) {
+        if(loops[i].wake_fd != -1) {
+            loop_drain(&loops[i]);
+            close(loops[i].wake_fd);
+        }
+        if(loops[i].timer_fd != -1) {
+            close(loops[i].timer_fd);
+        }
+        if(loops[i].epfd != -1) {
+            close(loops[i].epfd);
+        }
+        pthread_mutex_destroy(&loops[i].lock);
+    }
+    free(loops);
+    free(workers);
+
+    obj_pool_destroy(&conn_pool);
+
+    if(shutdown_fd != -1) {
+        efd = shutdown_fd;
+        shutdown_fd = -1;
+        close(efd);
+    }
+
+    return ret_code;
+}
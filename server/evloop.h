@@ -0,0 +1,27 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdbool.h>
+
+#include "shard.h"
+#include "store.h"
+
+/*
+ * Event driven server: loop_count epoll loops, each one owning the
+ * connections it accepted, served by worker_count threads in total.  One
+ * worker per loop gives independent event loops; several workers on one
+ * loop form a worker pool taking turns on the same epoll set.  Loop i
+ * accepts from shard i of listeners and every loop from the local
+ * listener, which are made non-blocking; with pin set, worker i is pinned
+ * to the i-th CPU.
+ * Blocks until caught_signal is set and all workers have exited.
+ */
+int evloop_run(const struct shards* listeners, int loop_count, int worker_count, bool pin, struct store* store);
+
+/*
+ * Wakes up every running loop so it notices caught_signal.
+ * Async-signal-safe.  Returns -1 if no loop is running.
+ */
+int evloop_wakeup(void);
+
+#endif /* EVLOOP_H */
@@ -0,0 +1,141 @@
+/*
+ * Line framing cost per receive chunk at different line lengths.  "legacy"
+ * is the byte at a time loop copying into a 128 KiB line buffer with one
+ * fprintf() per line that thread_start used to run, "framer" reads into the
+ * chained framing buffer and hands each batch of complete lines to a single
+ * writev().  Both write to /dev/null so only the framing work is compared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "framing.h"
+
+#define BENCH_READ_SIZE (128 * 1024)
+#define BENCH_IOV_MAX 32
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* make_input(size_t size, size_t line_len) {
+    char* input = malloc(size);
+
+    for(size_t i = 0; i < size; ++i) {
+        input[i] = ((i + 1) % line_len == 0) ? '\n' : 'a' + (i % 26);
+    }
+
+    return input;
+}
+
+static size_t run_legacy(const char* input, size_t size, FILE* out) {
+    static char buffer[BENCH_READ_SIZE];
+    static char line_buffer[128 * 1024];
+    size_t linepos = 0;
+    size_t lines = 0;
+
+    for(size_t pos = 0; pos < size; ) {
+        size_t n = size - pos < sizeof(buffer) - 1 ? size - pos : sizeof(buffer) - 1;
+        memcpy(buffer, input + pos, n);
+        pos += n;
+
+        for(size_t i = 0; i < n; ++i) {
+            char c = buffer[i];
+
+            if(c == '\n') {
+                line_buffer[linepos] = '\0';
+                fprintf(out, "%s\n", line_buffer);
+                linepos = 0;
+                ++lines;
+            } else if(linepos < sizeof(line_buffer) - 1) {
+                line_buffer[linepos++] = c;
+            }
+        }
+    }
+
+    fflush(out);
+    return lines;
+}
+
+static size_t run_framer(const char* input, size_t size, int out_fd) {
+    struct framer framer;
+    struct iovec iov[BENCH_IOV_MAX];
+    size_t batches = 0;
+
+    framer_init(&framer);
+
+    for(size_t pos = 0; pos < size; ) {
+        size_t space;
+        char* buffer = framer_reserve(&framer, &space);
+
+        size_t n = size - pos < space ? size - pos : space;
+        if(n > BENCH_READ_SIZE) {
+            n = BENCH_READ_SIZE;
+        }
+        memcpy(buffer, input + pos, n);
+        pos += n;
+
+        framer_fill(&framer, n);
+
+        if(framer_has_lines(&framer)) {
+            struct frame_batch batch;
+            int iovcnt = framer_take(&framer, &batch, iov, BENCH_IOV_MAX);
+
+            if(iovcnt < 0 || writev(out_fd, iov, iovcnt) < 0) {
+                perror("framer");
+                exit(1);
+            }
+
+            framer_release(&batch);
+            ++batches;
+        }
+    }
+
+    framer_destroy(&framer);
+    return batches;
+}
+
+int main(int argc, char** argv) {
+    size_t size = 64 * 1024 * 1024;
+    static const size_t line_lens[] = { 16, 64, 256, 1024, 4096, 65536, 1024 * 1024 };
+
+    if(argc > 1) {
+        size = strtoul(argv[1], NULL, 10) * 1024 * 1024;
+    }
+
+    FILE* out = fopen("/dev/null", "w");
+    int out_fd = open("/dev/null", O_WRONLY);
+
+    if(out == NULL || out_fd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    printf("input: %zu MiB per run\n", size / (1024 * 1024));
+    printf("%10s %14s %14s %9s\n", "line len", "legacy MiB/s", "framer MiB/s", "speedup");
+
+    for(size_t i = 0; i < sizeof(line_lens) / sizeof(line_lens[0]); ++i) {
+        char* input = make_input(size, line_lens[i]);
+
+        double start = now();
+        run_legacy(input, size, out);
+        double legacy = size / (now() - start) / (1024 * 1024);
+
+        start = now();
+        run_framer(input, size, out_fd);
+        double framer = size / (now() - start) / (1024 * 1024);
+
+        printf("%10zu %14.1f %14.1f %8.1fx\n", line_lens[i], legacy, framer, framer / legacy);
+        free(input);
+    }
+
+    fclose(out);
+    close(out_fd);
+    return 0;
+}
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "command.h"
+#include "framing.h"
+#include "pool.h"
+
+/* Ends a record that does not end a line, only ever read */
+static char record_newline[] = "\n";
+
+/* A position in the chain */
+struct frame_cursor {
+    struct frame_chunk* chunk;
+    size_t off;
+};
+
+static struct frame_chunk* chunk_alloc(size_t size) {
+    size_t total;
+    struct frame_chunk* chunk = buf_alloc(size, &total);
+
+    if(chunk) {
+        chunk->next = NULL;
+        chunk->len = 0;
+        chunk->cap = total - sizeof(struct frame_chunk);
+    }
+
+    return chunk;
+}
+
+static void chunk_free_list(struct frame_chunk* chunk) {
+    while(chunk) {
+        struct frame_chunk* next = chunk->next;
+        buf_free(chunk, chunk->cap + sizeof(struct frame_chunk));
+        chunk = next;
+    }
+}
+
+void framer_init(struct framer* f) {
+    memset(f, 0, sizeof(struct framer));
+    f->next_size = FRAMER_CHUNK_MIN;
+}
+
+void framer_destroy(struct framer* f) {
+    chunk_free_list(f->head);
+    framer_init(f);
+}
+
+char* framer_reserve(struct framer* f, size_t* space) {
+    struct frame_chunk* tail = f->tail;
+
+    if(tail == NULL || tail->cap - tail->len < FRAMER_READ_MIN) {
+        size_t size = f->len + sizeof(struct frame_chunk);
+        struct frame_chunk* chunk = chunk_alloc(size > f->next_size ? size : f->next_size);
+
+        if(chunk == NULL) {
+            return NULL;
+        }
+
+        if(tail) {
+            tail->next = chunk;
+        } else {
+            f->head = chunk;
+        }
+        f->tail = tail = chunk;
+    }
+
+    *space = f->reserved = tail->cap - tail->len;
+    return tail->data + tail->len;
+}
+
+/* Copies len bytes from the cursor on, which must be buffered, and moves past them */
+static void cursor_read(struct frame_cursor* c, char* out, size_t len) {
+    while(len > 0) {
+        while(c->off == c->chunk->len) {
+            c->chunk = c->chunk->next;
+            c->off = 0;
+        }
+
+        size_t n = c->chunk->len - c->off < len ? c->chunk->len - c->off : len;
+        memcpy(out, c->chunk->data + c->off, n);
+        c->off += n;
+        out += n;
+        len -= n;
+    }
+}
+
+static uint32_t cursor_header(struct frame_cursor* c) {
+    unsigned char h[FRAMER_RECORD_HEADER];
+    cursor_read(c, (char *)h, sizeof(h));
+    return (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+}
+
+static struct frame_cursor cursor_at(const struct framer* f, size_t pos) {
+    struct frame_cursor c = { .chunk = f->head, .off = pos };
+
+    while(c.off > c.chunk->len) {
+        c.off -= c.chunk->len;
+        c.chunk = c.chunk->next;
+    }
+
+    return c;
+}
+
+/* Extends complete over every record received in full */
+static void framer_scan_records(struct framer* f) {
+    while(f->len - f->complete >= FRAMER_RECORD_HEADER) {
+        struct frame_cursor c = cursor_at(f, f->complete);
+        size_t len = cursor_header(&c) & ~FRAMER_RECORD_REPLAY;
+
+        if(f->len - f->complete - FRAMER_RECORD_HEADER < len) {
+            break;
+        }
+
+        f->complete += FRAMER_RECORD_HEADER + len;
+    }
+}
+
+/* Returns false while everything received could still be the binary hello, which takes a leading NUL */
+static bool framer_probe(struct framer* f) {
+    size_t hello = sizeof(FRAMER_BINARY_HELLO) - 1;
+    size_t len = f->len < hello ? f->len : hello;
+
+    /* The first chunk is large enough to hold the hello */
+    if(memcmp(f->head->data, FRAMER_BINARY_HELLO, len) != 0) {
+        f->mode = FRAMER_TEXT;
+    } else if(len == hello) {
+        f->mode = FRAMER_BINARY;
+        f->complete = f->skip = hello;
+    }
+
+    return f->mode != FRAMER_PROBING;
+}
+
+void framer_fill(struct framer* f, size_t n) {
+    struct frame_chunk* tail = f->tail;
+    const char* data = tail->data + tail->len;
+
+    tail->len += n;
+    f->len += n;
+
+    if(f->mode == FRAMER_PROBING && !framer_probe(f)) {
+        /* No newline in there yet */
+    } else if(f->mode == FRAMER_BINARY) {
+        framer_scan_records(f);
+    } else {
+        /* Anything before this read matched the hello, which has no newline before its end */
+        const char* nl = memrchr(data, '\n', n);
+
+        if(nl) {
+            f->complete = f->len - n + (nl - data) + 1;
+        }
+    }
+
+    if(n == f->reserved && f->next_size < FRAMER_CHUNK_MAX) {
+        f->next_size *= 2;
+    }
+}
+
+/*
+ * Moves the first len bytes of the chain into batch.  They end at offset
+ * end of chunk, whatever follows there is moved to a chunk of its own.
+ */
+static int framer_detach(struct framer* f, struct frame_batch* batch, struct frame_chunk* chunk, size_t end,
+                         size_t len) {
+    size_t rest = chunk->len - end;
+    struct frame_chunk* next = chunk->next;
+
+    if(rest > 0) {
+        struct frame_chunk* copy = chunk_alloc(rest + sizeof(struct frame_chunk));
+
+        if(copy == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memcpy(copy->data, chunk->data + end, rest);
+        copy->len = rest;
+        copy->next = next;
+        next = copy;
+    }
+
+    if(next == NULL) {
+        f->tail = NULL;
+    } else if(chunk == f->tail) {
+        f->tail = next;
+    }
+
+    chunk->len = end;
+    chunk->next = NULL;
+    batch->chunks = f->head;
+    batch->len = len;
+
+    f->head = next;
+    f->len -= len;
+    f->complete -= len;
+    f->skip = 0;
+
+    return 0;
+}
+
+/* Moves the cursor past the next newline, which must be buffered, and returns how far it moved */
+static size_t cursor_skip_line(struct frame_cursor* c) {
+    size_t moved = 0;
+
+    for(;;) {
+        while(c->off == c->chunk->len) {
+            c->chunk = c->chunk->next;
+            c->off = 0;
+        }
+
+        const char* start = c->chunk->data + c->off;
+        const char* nl = memchr(start, '\n', c->chunk->len - c->off);
+
+        if(nl) {
+            c->off += nl - start + 1;
+            return moved + (nl - start + 1);
+        }
+
+        moved += c->chunk->len - c->off;
+        c->off = c->chunk->len;
+    }
+}
+
+/*
+ * Returns how many leading bytes of the complete lines go in the next batch:
+ * a line that may be a command on its own, or the lines before the next one
+ */
+static size_t framer_text_run(const struct framer* f) {
+    size_t prefix = sizeof(COMMAND_PREFIX) - 1;
+    struct frame_cursor c = { .chunk = f->head, .off = 0 };
+    size_t pos = 0;
+
+    while(pos < f->complete) {
+        char start[sizeof(COMMAND_PREFIX) - 1];
+        struct frame_cursor line = c;
+        bool command = f->complete - pos >= prefix;
+
+        if(command) {
+            cursor_read(&line, start, prefix);
+            command = memcmp(start, COMMAND_PREFIX, prefix) == 0;
+        }
+
+        if(command && pos > 0) {
+            return pos;
+        }
+
+        pos += cursor_skip_line(&c);
+
+        if(command) {
+            return pos;
+        }
+    }
+
+    return f->complete;
+}
+
+static int framer_take_lines(struct framer* f, struct frame_batch* batch, struct iovec* iov, int iov_max) {
+    size_t take = framer_text_run(f);
+    size_t remaining = take;
+    int count = 0;
+    struct frame_chunk* chunk = f->head;
+
+    /* Find the chunk holding the last newline */
+    while(remaining > chunk->len) {
+        if(count == iov_max) {
+            errno = E2BIG;
+            return -1;
+        }
+        iov[count].iov_base = chunk->data;
+        iov[count].iov_len = chunk->len;
+        ++count;
+
+        remaining -= chunk->len;
+        chunk = chunk->next;
+    }
+
+    if(count == iov_max) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    iov[count].iov_base = chunk->data;
+    iov[count].iov_len = remaining;
+    ++count;
+
+    batch->data_len = take;
+    batch->replay = true;
+
+    return framer_detach(f, batch, chunk, remaining, take) == 0 ? count : -1;
+}
+
+static int framer_take_records(struct framer* f, struct frame_batch* batch, struct iovec* iov, int iov_max) {
+    struct frame_cursor c = cursor_at(f, f->skip);
+    struct frame_cursor end = c;
+    size_t taken = f->skip;
+    int count = 0;
+
+    while(taken < f->complete && !batch->replay) {
+        uint32_t header = cursor_header(&c);
+        size_t len = header & ~FRAMER_RECORD_REPLAY;
+        size_t left = len;
+        int first = count;
+
+        while(left > 0 && count < iov_max) {
+            while(c.off == c.chunk->len) {
+                c.chunk = c.chunk->next;
+                c.off = 0;
+            }
+
+            size_t n = c.chunk->len - c.off < left ? c.chunk->len - c.off : left;
+            iov[count].iov_base = c.chunk->data + c.off;
+            iov[count].iov_len = n;
+            ++count;
+
+            c.off += n;
+            left -= n;
+        }
+
+        /* A record always ends a line */
+        if(len > 0 && left == 0 && ((char *)iov[count - 1].iov_base)[iov[count - 1].iov_len - 1] != '\n') {
+            if(count < iov_max) {
+                iov[count].iov_base = record_newline;
+                iov[count].iov_len = 1;
+                ++count;
+                batch->data_len += 1;
+            } else {
+                left = 1;
+            }
+        }
+
+        /* Out of iovecs, the record goes with the next batch */
+        if(left > 0) {
+            count = first;
+
+            if(taken == f->skip) {
+                errno = E2BIG;
+                return -1;
+            }
+            break;
+        }
+
+        end = c;
+        taken += FRAMER_RECORD_HEADER + len;
+        batch->data_len += len;
+        batch->replay = (header & FRAMER_RECORD_REPLAY) != 0;
+    }
+
+    return framer_detach(f, batch, end.chunk, end.off, taken) == 0 ? count : -1;
+}
+
+int framer_take(struct framer* f, struct frame_batch* batch, struct iovec* iov, int iov_max) {
+    batch->chunks = NULL;
+    batch->len = 0;
+    batch->data_len = 0;
+    batch->replay = false;
+
+    if(f->complete == 0) {
+        return 0;
+    }
+
+    if(f->mode == FRAMER_BINARY) {
+        return framer_take_records(f, batch, iov, iov_max);
+    }
+
+    return framer_take_lines(f, batch, iov, iov_max);
+}
+
+void framer_release(struct frame_batch* batch) {
+    chunk_free_list(batch->chunks);
+    batch->chunks = NULL;
+    batch->len = 0;
+    batch->data_len = 0;
+    batch->replay = false;
+}
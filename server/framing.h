@@ -0,0 +1,133 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define FRAMER_CHUNK_MIN (2 * 1024)
+#define FRAMER_CHUNK_MAX (64 * 1024)
+#define FRAMER_READ_MIN 256
+
+/*
+ * Binary framing, opted into by a connection that starts with
+ * FRAMER_BINARY_HELLO.  Its leading NUL never starts a text line, so any
+ * other first byte settles on text right away.  Every record is then a 32
+ * bit big endian header followed by the bytes to append: the low 31 bits
+ * hold their length and FRAMER_RECORD_REPLAY asks for a replay once this
+ * record and every one before it are committed, so a client pipelining
+ * many records gets a single replay for the lot.  A record of length 0
+ * only asks for the replay.  A record is stored as complete lines, a
+ * newline is appended to one that does not end with it, so seeks count
+ * its lines like any other and the index rebuilt from the log on restart
+ * agrees.  Each replay is sent as a 64 bit big endian length followed by
+ * that many bytes of the log.  Commands are not recognized in this mode.
+ */
+#define FRAMER_BINARY_HELLO "\0AESDCHAR_BINARY\n"
+#define FRAMER_RECORD_HEADER 4
+#define FRAMER_RECORD_REPLAY 0x80000000u
+#define FRAMER_REPLY_HEADER 8
+
+/*
+ * Receive buffer for a connection, made of a chain of chunks.  Data is read
+ * straight into the chain and complete lines are handed out as iovecs that
+ * point into it, so they are never copied.  A line that does not fit in the
+ * current chunk simply continues in the next one; every new chunk is at
+ * least as large as everything already buffered, which keeps the chain
+ * short no matter how long a line gets.
+ *
+ * Chunks come from the buffer pools.  An idle connection holds at most one
+ * small chunk with its partial line; the read size starts at
+ * FRAMER_CHUNK_MIN and doubles up to FRAMER_CHUNK_MAX while reads keep
+ * filling the whole chunk.
+ */
+struct frame_chunk {
+    struct frame_chunk* next;
+    size_t len;
+    size_t cap;
+    char data[];
+};
+
+enum framer_mode {
+    /* Nothing but a prefix of FRAMER_BINARY_HELLO received yet, starting with its NUL */
+    FRAMER_PROBING,
+    FRAMER_TEXT,
+    FRAMER_BINARY,
+};
+
+struct framer {
+    enum framer_mode mode;
+    struct frame_chunk* head;
+    struct frame_chunk* tail;
+    /* Bytes buffered in the chain */
+    size_t len;
+    /* Leading bytes of the chain that form complete lines, or records */
+    size_t complete;
+    /* Leading bytes to drop with the next batch, the binary hello */
+    size_t skip;
+    /* Size of the next chunk to allocate and the space last handed out */
+    size_t next_size;
+    size_t reserved;
+};
+
+/* Complete lines detached by framer_take(), valid until framer_release() */
+struct frame_batch {
+    struct frame_chunk* chunks;
+    size_t len;
+    /* Bytes to append, len less the binary framing plus the newlines ending records */
+    size_t data_len;
+    /* Text lines always get a replay, records only when one asks for it */
+    bool replay;
+};
+
+extern void framer_init(struct framer* f);
+
+extern void framer_destroy(struct framer* f);
+
+/*
+ * Returns the free space at the end of the chain to read into, growing the
+ * chain when needed.  Returns NULL if out of memory.
+ */
+extern char* framer_reserve(struct framer* f, size_t* space);
+
+/* Accounts for n bytes written into the reserved space */
+extern void framer_fill(struct framer* f, size_t n);
+
+static inline bool framer_has_lines(const struct framer* f) {
+    return f->complete > 0;
+}
+
+static inline bool framer_binary(const struct framer* f) {
+    return f->mode == FRAMER_BINARY;
+}
+
+/* Only text connections get a replay for a chunk without a complete line */
+static inline bool framer_text(const struct framer* f) {
+    return f->mode == FRAMER_TEXT;
+}
+
+/*
+ * Detaches every complete line into batch and describes them with at most
+ * iov_max iovecs.  The trailing partial line stays in the framer, and so do
+ * the lines after one starting with COMMAND_PREFIX, which is taken on its
+ * own, or from the first such line on if it is not the first line.  Binary
+ * records are described without their headers, followed by a newline for
+ * those that do not end with one, and taking stops after a
+ * record asking for a replay or before running out of iovecs, so the rest
+ * is left for the next call.  Returns the number of iovecs, which is 0 for
+ * a batch of empty records, or -1 with errno set.
+ */
+extern int framer_take(struct framer* f, struct frame_batch* batch, struct iovec* iov, int iov_max);
+
+extern void framer_release(struct frame_batch* batch);
+
+/* Encodes the length that precedes a binary replay */
+static inline void framer_reply_header(char* header, uint64_t len) {
+    for(int i = FRAMER_REPLY_HEADER - 1; i >= 0; --i) {
+        header[i] = (char)(len & 0xff);
+        len >>= 8;
+    }
+}
+
+#endif /* FRAMING_H */
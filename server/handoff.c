@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+#include "conn.h"
+#include "handoff.h"
+#include "log.h"
+
+#define HANDOFF_MAGIC 0x61657364
+/* How often the connection count is checked while draining */
+#define HANDOFF_POLL_MS 10
+
+/* Sent along with the listening sockets */
+struct handoff_msg {
+    uint32_t magic;
+    int32_t count;
+    /* The last descriptor is the local listener */
+    int32_t local;
+    struct store_snapshot snap;
+};
+
+volatile sig_atomic_t handoff_draining = 0;
+
+static int serve_fd = -1;
+static pthread_t serve_id;
+static bool serve_started = false;
+static const char* serve_path;
+static void (*serve_stop)(void);
+/* Signalled when a successor connects, and by handoff_wakeup() */
+static int wake_fd = -1;
+static sem_t drained;
+static int successor_fd = -1;
+static bool handed_off = false;
+
+static int handoff_addr(const char* path, struct sockaddr_un* addr) {
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        log_msg(LOG_ERR, "Handoff socket path %s is too long", path);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_receive(const char* path, struct shards* sh, struct store_snapshot* snap) {
+    struct sockaddr_un addr;
+
+    if(handoff_addr(path, &addr) != 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on socket()", errno, strerror(errno));
+        return -1;
+    }
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+
+        if(err == ENOENT || err == ECONNREFUSED) {
+            return 1;
+        }
+
+        log_msg(LOG_ERR, "Error %d (%s) connecting to %s", err, strerror(err), path);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "Waiting for the server at %s to hand its listeners over", path);
+
+    struct handoff_msg msg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (SHARDS_MAX + 1))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n;
+
+    do {
+        n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while(n < 0 && errno == EINTR);
+
+    close(fd);
+
+    /* The predecessor went away without handing anything over, the port is free again */
+    if(n == 0) {
+        log_msg(LOG_WARNING, "The server at %s exited before handing its listeners over", path);
+        return 1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    int fds[SHARDS_MAX + 1];
+    int count = 0;
+
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+
+    bool local = n == sizeof(msg) && msg.local && count > 0;
+
+    sh->count = local ? count - 1 : count;
+    sh->local_fd = local ? fds[count - 1] : -1;
+    memcpy(sh->fds, fds, sizeof(int) * sh->count);
+
+    if(n != sizeof(msg) || msg.magic != HANDOFF_MAGIC || msg.count != sh->count || sh->count == 0) {
+        log_msg(LOG_ERR, "Invalid handoff from %s", path);
+        shards_close(sh);
+        return -1;
+    }
+
+    /* File status flags are shared with the predecessor, which may have made them non-blocking */
+    for(int i = 0; i < count; ++i) {
+        int flags = fcntl(fds[i], F_GETFL);
+
+        if(flags < 0 || fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK) != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) on fcntl()", errno, strerror(errno));
+            shards_close(sh);
+            return -1;
+        }
+    }
+
+    *snap = msg.snap;
+    log_msg(LOG_INFO, "Took over %d listeners from the server at %s", count, path);
+    return 0;
+}
+
+static void *serve_start(void *param) {
+    int fd;
+
+    for(;;) {
+        fd = accept4(serve_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if(fd >= 0) {
+            break;
+        }
+        if(errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        /* shutdown() of the listener by handoff_serve_stop() */
+        return param;
+    }
+
+    __atomic_store_n(&successor_fd, fd, __ATOMIC_RELEASE);
+    handoff_draining = 1;
+    handoff_wakeup();
+
+    log_msg(LOG_INFO, "A successor connected to %s, draining %d connections", serve_path,
+            __atomic_load_n(&conn_active, __ATOMIC_RELAXED));
+
+    uint64_t deadline = conn_now_ms() + HANDOFF_DRAIN_MS;
+
+    while(__atomic_load_n(&conn_active, __ATOMIC_RELAXED) > 0 && !caught_signal && conn_now_ms() < deadline) {
+        poll(NULL, 0, HANDOFF_POLL_MS);
+    }
+
+    int remaining = __atomic_load_n(&conn_active, __ATOMIC_RELAXED);
+
+    if(remaining > 0) {
+        log_msg(LOG_WARNING, "Closing %d connections still open after %d ms", remaining, HANDOFF_DRAIN_MS);
+    }
+
+    serve_stop();
+    sem_post(&drained);
+    return param;
+}
+
+int handoff_serve_start(const char* path, void (*stop)(void)) {
+    struct sockaddr_un addr;
+
+    if(handoff_addr(path, &addr) != 0) {
+        return -1;
+    }
+
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(serve_fd < 0 || wake_fd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on socket()", errno, strerror(errno));
+        handoff_serve_stop();
+        return -1;
+    }
+
+    /* Left behind by the predecessor */
+    unlink(path);
+
+    if(bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(serve_fd, 1) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) binding handoff socket %s", errno, strerror(errno), path);
+        handoff_serve_stop();
+        return -1;
+    }
+
+    serve_path = path;
+    serve_stop = stop;
+    sem_init(&drained, 0, 0);
+
+    if(pthread_create(&serve_id, NULL, serve_start, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create handoff thread");
+        sem_destroy(&drained);
+        unlink(path);
+        handoff_serve_stop();
+        return -1;
+    }
+
+    serve_started = true;
+    log_msg(LOG_INFO, "Accepting a successor on %s", path);
+    return 0;
+}
+
+bool handoff_pending(void) {
+    return __atomic_load_n(&successor_fd, __ATOMIC_ACQUIRE) != -1;
+}
+
+int handoff_complete(const struct shards* sh, const struct store_snapshot* snap) {
+    int local = sh->local_fd != -1;
+    int count = sh->count + local;
+    struct handoff_msg msg = { .magic = HANDOFF_MAGIC, .count = sh->count, .local = local, .snap = *snap };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (SHARDS_MAX + 1))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+
+    memset(&control, 0, sizeof(control));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), sh->fds, sizeof(int) * sh->count);
+
+    if(local) {
+        memcpy(CMSG_DATA(cmsg) + sizeof(int) * sh->count, &sh->local_fd, sizeof(int));
+    }
+
+    ssize_t n;
+
+    do {
+        n = sendmsg(successor_fd, &mh, MSG_NOSIGNAL);
+    } while(n < 0 && errno == EINTR);
+
+    close(successor_fd);
+    __atomic_store_n(&successor_fd, -1, __ATOMIC_RELEASE);
+
+    if(n != sizeof(msg)) {
+        log_msg(LOG_ERR, "Error %d (%s) handing the listeners over", errno, strerror(errno));
+        return -1;
+    }
+
+    handed_off = true;
+    log_msg(LOG_INFO, "Handed %d listeners over to the successor", count);
+    return 0;
+}
+
+void handoff_serve_stop(void) {
+    if(serve_started) {
+        shutdown(serve_fd, SHUT_RDWR);
+
+        if(pthread_join(serve_id, NULL) != 0) {
+            log_msg(LOG_ERR, "Failed to join handoff thread");
+        }
+
+        /* The successor has bound the path again by now */
+        if(!handed_off) {
+            unlink(serve_path);
+        }
+
+        sem_destroy(&drained);
+        serve_started = false;
+    }
+
+    if(successor_fd != -1) {
+        close(successor_fd);
+        successor_fd = -1;
+    }
+    if(serve_fd != -1) {
+        close(serve_fd);
+        serve_fd = -1;
+    }
+    if(wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+int handoff_poll(const struct shards* sh) {
+    /* Negative descriptors are ignored by poll() */
+    struct pollfd pfds[3] = {
+        { .fd = sh->fds[0], .events = POLLIN },
+        { .fd = sh->local_fd, .events = POLLIN },
+        { .fd = wake_fd, .events = POLLIN },
+    };
+
+    if(poll(pfds, 3, -1) < 0 || (pfds[2].revents & POLLIN)) {
+        return -1;
+    }
+
+    return pfds[0].revents ? sh->fds[0] : sh->local_fd;
+}
+
+void handoff_wait(void) {
+    if(!handoff_draining) {
+        return;
+    }
+
+    while(sem_wait(&drained) != 0 && errno == EINTR) {
+    }
+    /* Anyone else waiting gets through as well */
+    sem_post(&drained);
+}
+
+int handoff_wakeup(void) {
+    if(wake_fd == -1) {
+        return -1;
+    }
+
+    uint64_t one = 1;
+    ssize_t rc = write(wake_fd, &one, sizeof(one));
+    (void)rc;
+    return 0;
+}
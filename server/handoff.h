@@ -0,0 +1,62 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <signal.h>
+#include <stdbool.h>
+
+#include "shard.h"
+#include "store.h"
+
+/*
+ * Zero-downtime restart.  A running server serves a Unix socket at the
+ * handoff path; a successor started with the same path connects to it
+ * instead of binding the port.  The running server then stops accepting,
+ * lets its open connections finish for up to HANDOFF_DRAIN_MS, closes the
+ * store and passes its listening sockets, the local one included, over
+ * with SCM_RIGHTS.  Clients connecting meanwhile wait in the accept
+ * queues, none of them is refused.
+ */
+#define HANDOFF_DRAIN_MS 5000
+
+/* Set once a successor has asked for the listeners, loops stop accepting */
+extern volatile sig_atomic_t handoff_draining;
+
+/*
+ * Takes over the listeners of the server running at path, waiting until
+ * it has drained.  snap is set to the store as the predecessor left it.
+ * Returns 1 if no server is running there, -1 on failure.
+ */
+extern int handoff_receive(const char* path, struct shards* sh, struct store_snapshot* snap);
+
+/*
+ * Serves a successor on path from a thread of its own.  stop() is called
+ * from that thread once the connections have drained; it must stop the
+ * server like a signal would, the listeners are then passed on with
+ * handoff_complete().
+ */
+extern int handoff_serve_start(const char* path, void (*stop)(void));
+
+/* Returns true if a successor is waiting for the listeners */
+extern bool handoff_pending(void);
+
+/* Passes the listeners and the state of the closed store to the successor */
+extern int handoff_complete(const struct shards* sh, const struct store_snapshot* snap);
+
+/* Stops the thread, the socket is removed unless a successor took over */
+extern void handoff_serve_stop(void);
+
+/*
+ * Thread mode: waits until the first shard or the local listener has a
+ * connection to accept and returns that listener.  Returns -1 once a
+ * successor has asked for the listeners, after handoff_wakeup() or when
+ * interrupted.
+ */
+extern int handoff_poll(const struct shards* sh);
+
+/* Blocks until the connections have drained, if a successor is waiting */
+extern void handoff_wait(void);
+
+/* Wakes up handoff_poll().  Async-signal-safe.  Returns -1 if not serving */
+extern int handoff_wakeup(void);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "conn.h"
+#include "log.h"
+#include "metrics.h"
+
+/* The flusher reports dropped messages at most this often */
+#define LOG_REPORT_MS 1000
+
+struct log_rec {
+    int level;
+    char text[LOG_MSG_MAX];
+};
+
+/*
+ * Messages of one thread.  Only the owner advances head and only the
+ * flusher advances tail, so neither side takes a lock.  The ring outlives
+ * its thread until the flusher has drained it.
+ */
+struct log_ring {
+    uint32_t head;
+    uint32_t tokens;
+    uint64_t refill_ms;
+    uint64_t dropped;
+    int retired;
+    struct log_ring* next;
+
+    /* Flusher side, on a cache line of its own */
+    uint32_t tail __attribute__((aligned(64)));
+    uint64_t reported;
+
+    struct log_rec recs[LOG_RING_SLOTS];
+};
+
+int log_level = LOG_INFO;
+
+static __thread struct log_ring* log_local;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring* registry;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static pthread_t flusher_id;
+static int running;
+static int stopping;
+/* Signalled by the first message after the flusher last looked, and by log_stop() */
+static int wake_fd = -1;
+static int notified;
+
+static const char* level_names[] = {
+    [LOG_EMERG] = "emerg",
+    [LOG_ALERT] = "alert",
+    [LOG_CRIT] = "crit",
+    [LOG_ERR] = "err",
+    [LOG_WARNING] = "warning",
+    [LOG_NOTICE] = "notice",
+    [LOG_INFO] = "info",
+    [LOG_DEBUG] = "debug",
+};
+
+/* Thread exit, the flusher frees the ring once it is empty */
+static void log_retire(void* param) {
+    struct log_ring* r = (struct log_ring *)param;
+    log_local = NULL;
+    __atomic_store_n(&r->retired, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_init(void) {
+    pthread_key_create(&log_key, log_retire);
+}
+
+static struct log_ring* log_register(void) {
+    struct log_ring* r = calloc(1, sizeof(struct log_ring));
+
+    if(r == NULL) {
+        return NULL;
+    }
+
+    r->tokens = LOG_BURST;
+    r->refill_ms = conn_now_ms();
+
+    pthread_once(&log_once, log_key_init);
+
+    pthread_mutex_lock(&registry_lock);
+    r->next = registry;
+    registry = r;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(log_key, r);
+    log_local = r;
+    return r;
+}
+
+/* Token bucket refilled at LOG_RATE per second, up to LOG_BURST */
+static bool log_take_token(struct log_ring* r) {
+    uint64_t now = conn_now_ms();
+    uint64_t refill = (now - r->refill_ms) * LOG_RATE / 1000;
+
+    if(refill > 0) {
+        r->tokens = refill >= LOG_BURST - r->tokens ? LOG_BURST : r->tokens + refill;
+        r->refill_ms = now;
+    }
+
+    if(r->tokens == 0) {
+        return false;
+    }
+
+    --r->tokens;
+    return true;
+}
+
+static void log_wakeup(void) {
+    if(__atomic_exchange_n(&notified, 1, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+
+    uint64_t one = 1;
+    ssize_t rc = write(wake_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+void log_write(int level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    struct log_ring* r = NULL;
+
+    if(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        r = log_local ? log_local : log_register();
+    }
+
+    if(r == NULL) {
+        vsyslog(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    if(!log_take_token(r) || r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        metrics_add(METRIC_LOG_DROPPED, 1);
+        va_end(ap);
+        return;
+    }
+
+    struct log_rec* rec = &r->recs[r->head % LOG_RING_SLOTS];
+    rec->level = level;
+    vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    log_wakeup();
+}
+
+int log_parse_level(const char* name) {
+    for(size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); ++i) {
+        if(strcmp(name, level_names[i]) == 0) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Forwards every queued message to syslog and frees the rings of exited
+ * threads.  Producers only ever insert at the head of the registry, so the
+ * list is walked without the lock, which is only taken to unlink a ring.
+ * Returns the messages dropped since the last call.
+ */
+static uint64_t log_flush(void) {
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&registry_lock);
+    struct log_ring* r = registry;
+    pthread_mutex_unlock(&registry_lock);
+
+    while(r) {
+        struct log_ring* next = r->next;
+        int retired = __atomic_load_n(&r->retired, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        while(r->tail != head) {
+            struct log_rec* rec = &r->recs[r->tail % LOG_RING_SLOTS];
+            syslog(rec->level, "%s", rec->text);
+            __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        uint64_t total = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        dropped += total - r->reported;
+        r->reported = total;
+
+        if(retired) {
+            pthread_mutex_lock(&registry_lock);
+
+            struct log_ring** link = &registry;
+            while(*link != r) {
+                link = &(*link)->next;
+            }
+            *link = next;
+
+            pthread_mutex_unlock(&registry_lock);
+            free(r);
+        }
+
+        r = next;
+    }
+
+    return dropped;
+}
+
+static void *flusher_start(void *param) {
+    uint64_t dropped = 0;
+    uint64_t reported_ms = conn_now_ms();
+
+    for(;;) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+
+        if(!stop && poll(&pfd, 1, LOG_REPORT_MS) > 0) {
+            uint64_t count;
+            ssize_t rc = read(wake_fd, &count, sizeof(count));
+            (void)rc;
+        }
+
+        /* Cleared before draining, so a message queued after this point signals again */
+        __atomic_exchange_n(&notified, 0, __ATOMIC_SEQ_CST);
+        dropped += log_flush();
+
+        uint64_t now = conn_now_ms();
+
+        if(dropped > 0 && (stop || now - reported_ms >= LOG_REPORT_MS)) {
+            syslog(LOG_WARNING, "Dropped %llu log messages", (unsigned long long)dropped);
+            dropped = 0;
+            reported_ms = now;
+        }
+
+        if(stop) {
+            break;
+        }
+    }
+
+    return param;
+}
+
+int log_start(void) {
+    stopping = 0;
+    notified = 0;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(wake_fd < 0) {
+        syslog(LOG_ERR, "Error %d (%s) on eventfd()", errno, strerror(errno));
+        return -1;
+    }
+
+    if(pthread_create(&flusher_id, NULL, flusher_start, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create log flusher thread");
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop(void) {
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    /* Whatever is logged from now on goes straight to syslog */
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    ssize_t rc = write(wake_fd, &one, sizeof(one));
+    (void)rc;
+
+    if(pthread_join(flusher_id, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to join log flusher thread");
+    }
+
+    close(wake_fd);
+    wake_fd = -1;
+
+    /* Every other thread is gone, the rings left are empty */
+    pthread_mutex_lock(&registry_lock);
+    while(registry) {
+        struct log_ring* r = registry;
+        registry = r->next;
+        free(r);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if(log_local) {
+        pthread_setspecific(log_key, NULL);
+        log_local = NULL;
+    }
+}
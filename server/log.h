@@ -0,0 +1,49 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>
+
+/*
+ * Levels above LOG_LEVEL_MAX are compiled out, arguments and all.  Build
+ * with CPPFLAGS=-DLOG_LEVEL_MAX=LOG_INFO to drop debug messages entirely.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
+/* Longest message kept, including its terminating NUL */
+#define LOG_MSG_MAX 256
+/* Messages a thread can have waiting for the flusher */
+#define LOG_RING_SLOTS 64
+/* Sustained messages per second and burst allowed to each thread */
+#define LOG_RATE 1000
+#define LOG_BURST 200
+
+/* Most verbose level logged at run time, LOG_INFO unless changed before log_start() */
+extern int log_level;
+
+/*
+ * Logs like syslog(), without ever blocking the caller.  The message is
+ * formatted straight into a ring of the calling thread, which the flusher
+ * thread drains into syslog.  A message is dropped and counted when its
+ * thread exceeds the rate limit or its ring is full.  Before log_start()
+ * and after log_stop() messages go to syslog directly.
+ */
+#define log_msg(level, ...) do { \
+        if((level) <= LOG_LEVEL_MAX && (level) <= log_level) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while(0)
+
+extern void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Parses a level name such as "debug" or "err", returns -1 if unknown */
+extern int log_parse_level(const char* name);
+
+/* Starts the flusher thread, after any fork() */
+extern int log_start(void);
+
+/* Flushes every pending message and stops the flusher thread */
+extern void log_stop(void);
+
+#endif /* LOG_H */
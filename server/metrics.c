@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define METRICS_REPLY_SIZE (32 * 1024)
+
+__thread struct metrics* metrics_local;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics* registry;
+static struct metrics retired;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+static const char* counter_names[METRIC_COUNTERS] = {
+    [METRIC_CONNECTIONS] = "aesdsocket_connections_total",
+    [METRIC_BYTES_IN] = "aesdsocket_received_bytes_total",
+    [METRIC_BYTES_OUT] = "aesdsocket_sent_bytes_total",
+    [METRIC_LINES_APPENDED] = "aesdsocket_lines_appended_total",
+    [METRIC_REPLAYS] = "aesdsocket_replays_total",
+    [METRIC_REPLAY_YIELDS] = "aesdsocket_replay_yields_total",
+    [METRIC_REPLAY_INFLIGHT_WAITS] = "aesdsocket_replay_inflight_waits_total",
+    [METRIC_EVICTIONS] = "aesdsocket_evicted_connections_total",
+    [METRIC_LOG_DROPPED] = "aesdsocket_log_dropped_total",
+};
+
+static const char* hist_names[METRIC_HISTOGRAMS] = {
+    [METRIC_LOCK_WAIT] = "aesdsocket_lock_wait_seconds",
+    [METRIC_LOCK_HOLD] = "aesdsocket_lock_hold_seconds",
+    [METRIC_APPEND] = "aesdsocket_append_seconds",
+    [METRIC_SEND] = "aesdsocket_send_seconds",
+    [METRIC_SYNC] = "aesdsocket_sync_seconds",
+};
+
+static int serve_fd = -1;
+static pthread_t serve_id;
+static bool serve_started = false;
+static const char* serve_path;
+static const struct store* serve_store;
+
+/* Adds every value of src to dst, reading src while its owner may still update it */
+static void metrics_merge(struct metrics* dst, struct metrics* src) {
+    for(int i = 0; i < METRIC_COUNTERS; ++i) {
+        dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+    }
+
+    for(int i = 0; i < METRIC_HISTOGRAMS; ++i) {
+        struct metric_hist* d = &dst->hists[i];
+        struct metric_hist* s = &src->hists[i];
+
+        for(int b = 0; b < METRIC_BUCKETS; ++b) {
+            d->buckets[b] += __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+        }
+        d->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        d->sum_ns += __atomic_load_n(&s->sum_ns, __ATOMIC_RELAXED);
+    }
+}
+
+static void metrics_retire(void* param) {
+    struct metrics* m = (struct metrics *)param;
+
+    pthread_mutex_lock(&registry_lock);
+
+    struct metrics** link = &registry;
+    while(*link != m) {
+        link = &(*link)->next;
+    }
+    *link = m->next;
+
+    metrics_merge(&retired, m);
+
+    pthread_mutex_unlock(&registry_lock);
+    free(m);
+}
+
+static void metrics_key_init(void) {
+    pthread_key_create(&metrics_key, metrics_retire);
+}
+
+struct metrics* metrics_register(void) {
+    struct metrics* m = calloc(1, sizeof(struct metrics));
+
+    if(m == NULL) {
+        return NULL;
+    }
+
+    pthread_once(&metrics_once, metrics_key_init);
+
+    pthread_mutex_lock(&registry_lock);
+    m->next = registry;
+    registry = m;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(metrics_key, m);
+    metrics_local = m;
+    return m;
+}
+
+void metrics_observe(enum metric_histogram hist, uint64_t start) {
+    struct metrics* m = metrics_self();
+
+    if(m == NULL) {
+        return;
+    }
+
+    uint64_t ns = metrics_now() - start;
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    if(bucket >= METRIC_BUCKETS) {
+        bucket = METRIC_BUCKETS - 1;
+    }
+
+    struct metric_hist* h = &m->hists[hist];
+
+    __atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+}
+
+static size_t append(char* buf, size_t size, size_t len, const char* fmt, ...) {
+    if(len >= size) {
+        return len;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+
+    return n < 0 ? len : len + n;
+}
+
+size_t metrics_format(const struct store* store, char* buf, size_t size) {
+    struct metrics total;
+    size_t len = 0;
+
+    memset(&total, 0, sizeof(total));
+
+    pthread_mutex_lock(&registry_lock);
+    metrics_merge(&total, &retired);
+    for(struct metrics* m = registry; m; m = m->next) {
+        metrics_merge(&total, m);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    for(int i = 0; i < METRIC_COUNTERS; ++i) {
+        len = append(buf, size, len, "# TYPE %s counter\n%s %llu\n", counter_names[i], counter_names[i],
+                     (unsigned long long)total.counters[i]);
+    }
+
+    for(int i = 0; i < METRIC_HISTOGRAMS; ++i) {
+        struct metric_hist* h = &total.hists[i];
+        uint64_t cumulative = 0;
+
+        len = append(buf, size, len, "# TYPE %s histogram\n", hist_names[i]);
+
+        for(int b = 0; b < METRIC_BUCKETS - 1; ++b) {
+            cumulative += h->buckets[b];
+            len = append(buf, size, len, "%s_bucket{le=\"%g\"} %llu\n", hist_names[i],
+                         (double)((uint64_t)1 << b) / 1e9, (unsigned long long)cumulative);
+        }
+
+        len = append(buf, size, len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                     hist_names[i], (unsigned long long)h->count,
+                     hist_names[i], h->sum_ns / 1e9,
+                     hist_names[i], (unsigned long long)h->count);
+    }
+
+    if(store) {
+        struct store_snapshot snap;
+        store_snapshot(store, &snap);
+
+        len = append(buf, size, len, "# TYPE aesdsocket_store_bytes gauge\naesdsocket_store_bytes %lld\n",
+                     (long long)(snap.length - snap.start));
+        len = append(buf, size, len, "# TYPE aesdsocket_store_lines gauge\naesdsocket_store_lines %zu\n",
+                     snap.line_count - snap.first_line);
+    }
+
+    return len < size ? len : size - 1;
+}
+
+static void *serve_start(void *param) {
+    char* reply = malloc(METRICS_REPLY_SIZE);
+
+    if(reply == NULL) {
+        log_msg(LOG_ERR, "Metrics: out of memory");
+        return param;
+    }
+
+    for(;;) {
+        int client_fd = accept(serve_fd, NULL, NULL);
+
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            /* shutdown() of the listener by metrics_serve_stop() */
+            break;
+        }
+
+        size_t len = metrics_format(serve_store, reply, METRICS_REPLY_SIZE);
+        size_t sent = 0;
+
+        while(sent < len) {
+            ssize_t n = send(client_fd, reply + sent, len - sent, MSG_NOSIGNAL);
+
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            sent += n;
+        }
+
+        close(client_fd);
+    }
+
+    free(reply);
+    return param;
+}
+
+int metrics_serve_start(const char* path, const struct store* store) {
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg(LOG_ERR, "Metrics socket path %s is too long", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(serve_fd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on socket()", errno, strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+
+    if(bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(serve_fd, 16) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) binding metrics socket %s", errno, strerror(errno), path);
+        close(serve_fd);
+        serve_fd = -1;
+        return -1;
+    }
+
+    serve_path = path;
+    serve_store = store;
+
+    if(pthread_create(&serve_id, NULL, serve_start, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create metrics thread");
+        close(serve_fd);
+        serve_fd = -1;
+        unlink(path);
+        return -1;
+    }
+
+    serve_started = true;
+    log_msg(LOG_INFO, "Serving metrics on %s", path);
+    return 0;
+}
+
+void metrics_serve_stop(void) {
+    if(!serve_started) {
+        return;
+    }
+
+    shutdown(serve_fd, SHUT_RDWR);
+
+    if(pthread_join(serve_id, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to join metrics thread");
+    }
+
+    serve_started = false;
+    close(serve_fd);
+    serve_fd = -1;
+    unlink(serve_path);
+}
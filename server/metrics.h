@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "store.h"
+
+enum metric_counter {
+    METRIC_CONNECTIONS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_LINES_APPENDED,
+    METRIC_REPLAYS,
+    METRIC_REPLAY_YIELDS,
+    METRIC_REPLAY_INFLIGHT_WAITS,
+    METRIC_EVICTIONS,
+    METRIC_LOG_DROPPED,
+    METRIC_COUNTERS,
+};
+
+enum metric_histogram {
+    METRIC_LOCK_WAIT,
+    METRIC_LOCK_HOLD,
+    METRIC_APPEND,
+    METRIC_SEND,
+    METRIC_SYNC,
+    METRIC_HISTOGRAMS,
+};
+
+/* Bucket i counts durations below 2^i ns, the last one everything else */
+#define METRIC_BUCKETS 32
+
+struct metric_hist {
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+/*
+ * Counters of one thread.  Only the owning thread writes them, with plain
+ * relaxed stores that never bounce a cache line between cores; readers
+ * merge every thread's block on demand.  Blocks of exited threads are
+ * folded into a retired total.
+ */
+struct metrics {
+    uint64_t counters[METRIC_COUNTERS];
+    struct metric_hist hists[METRIC_HISTOGRAMS];
+    struct metrics* next;
+};
+
+extern __thread struct metrics* metrics_local;
+
+/* Allocates and registers the calling thread's block, NULL if out of memory */
+extern struct metrics* metrics_register(void);
+
+static inline struct metrics* metrics_self(void) {
+    struct metrics* m = metrics_local;
+    return m ? m : metrics_register();
+}
+
+static inline void metrics_add(enum metric_counter counter, uint64_t n) {
+    struct metrics* m = metrics_self();
+
+    if(m) {
+        __atomic_store_n(&m->counters[counter], m->counters[counter] + n, __ATOMIC_RELAXED);
+    }
+}
+
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Records the time elapsed since start, as returned by metrics_now() */
+extern void metrics_observe(enum metric_histogram hist, uint64_t start);
+
+/*
+ * Writes the merged metrics of all threads, plus the size of the store, to
+ * buf in the Prometheus text format.  Returns the length written.
+ */
+extern size_t metrics_format(const struct store* store, char* buf, size_t size);
+
+/*
+ * Serves metrics_format() to every client connecting to the Unix socket at
+ * path, from a thread of its own.
+ */
+extern int metrics_serve_start(const char* path, const struct store* store);
+
+extern void metrics_serve_stop(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN 16
+#define BUF_POOL_SLAB_SIZE (256 * 1024)
+#define BUF_POOL_CLASSES (BUF_POOL_MAX_SHIFT - BUF_POOL_MIN_SHIFT + 1)
+
+/* Header in front of the objects of every slab, keeps them aligned */
+struct obj_slab {
+    struct obj_slab* next;
+    char pad[POOL_ALIGN - sizeof(struct obj_slab*)];
+};
+
+static struct obj_pool buf_pools[BUF_POOL_CLASSES];
+static pthread_once_t buf_pools_once = PTHREAD_ONCE_INIT;
+
+void obj_pool_init(struct obj_pool* pool, size_t obj_size, size_t per_slab) {
+    memset(pool, 0, sizeof(struct obj_pool));
+    pool->obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->per_slab = per_slab ? per_slab : 1;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+void obj_pool_destroy(struct obj_pool* pool) {
+    struct obj_slab* slab = pool->slabs;
+
+    while(slab) {
+        struct obj_slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->total = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static int obj_pool_grow(struct obj_pool* pool) {
+    struct obj_slab* slab = malloc(sizeof(struct obj_slab) + pool->obj_size * pool->per_slab);
+
+    if(slab == NULL) {
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    char* obj = (char *)(slab + 1);
+
+    for(size_t i = 0; i < pool->per_slab; ++i, obj += pool->obj_size) {
+        *(void **)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    pool->total += pool->per_slab;
+    return 0;
+}
+
+void* obj_pool_alloc(struct obj_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    if(pool->free_list == NULL && obj_pool_grow(pool) != 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    void* obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    pool->in_use++;
+
+    pthread_mutex_unlock(&pool->lock);
+    return obj;
+}
+
+void obj_pool_free(struct obj_pool* pool, void* obj) {
+    pthread_mutex_lock(&pool->lock);
+
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void buf_pools_init(void) {
+    for(int i = 0; i < BUF_POOL_CLASSES; ++i) {
+        size_t size = (size_t)1 << (BUF_POOL_MIN_SHIFT + i);
+        obj_pool_init(&buf_pools[i], size, BUF_POOL_SLAB_SIZE / size);
+    }
+}
+
+void* buf_alloc(size_t size, size_t* cap) {
+    if(size > BUF_POOL_MAX) {
+        *cap = size;
+        return malloc(size);
+    }
+
+    pthread_once(&buf_pools_once, buf_pools_init);
+
+    int index = 0;
+    while(((size_t)BUF_POOL_MIN << index) < size) {
+        ++index;
+    }
+
+    *cap = (size_t)BUF_POOL_MIN << index;
+    return obj_pool_alloc(&buf_pools[index]);
+}
+
+void buf_free(void* buf, size_t cap) {
+    if(buf == NULL) {
+        return;
+    }
+
+    if(cap > BUF_POOL_MAX) {
+        free(buf);
+        return;
+    }
+
+    int index = __builtin_ctzl(cap) - BUF_POOL_MIN_SHIFT;
+    obj_pool_free(&buf_pools[index], buf);
+}
@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Fixed size object allocator.  Objects are carved out of slabs holding
+ * per_slab objects each and recycled through a free list, so allocating
+ * and freeing connection state never goes back to malloc() once the pool
+ * has grown to the working set.  Thread-safe.
+ */
+struct obj_pool {
+    size_t obj_size;
+    size_t per_slab;
+    pthread_mutex_t lock;
+    void* free_list;
+    void* slabs;
+    size_t in_use;
+    size_t total;
+};
+
+extern void obj_pool_init(struct obj_pool* pool, size_t obj_size, size_t per_slab);
+
+/* Frees every slab, all objects must have been returned */
+extern void obj_pool_destroy(struct obj_pool* pool);
+
+extern void* obj_pool_alloc(struct obj_pool* pool);
+
+extern void obj_pool_free(struct obj_pool* pool, void* obj);
+
+/*
+ * I/O buffers in power of two size classes between BUF_POOL_MIN and
+ * BUF_POOL_MAX, each backed by an obj_pool.  Larger requests go straight
+ * to malloc().
+ */
+#define BUF_POOL_MIN_SHIFT 11
+#define BUF_POOL_MAX_SHIFT 16
+#define BUF_POOL_MIN (1 << BUF_POOL_MIN_SHIFT)
+#define BUF_POOL_MAX (1 << BUF_POOL_MAX_SHIFT)
+
+/* Returns a buffer of at least size bytes and stores its real size in *cap */
+extern void* buf_alloc(size_t size, size_t* cap);
+
+/* Returns buf to its pool, cap must be the value set by buf_alloc() */
+extern void buf_free(void* buf, size_t cap);
+
+#endif /* POOL_H */
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "log.h"
+#include "sched.h"
+
+#define SCHED_TIME_MAX 128
+
+struct sched_task {
+    const char* name;
+    uint64_t interval_ns;
+    uint64_t due_ns;
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+static struct sched_task tasks[SCHED_TASKS_MAX];
+static int task_count;
+
+static pthread_t sched_id;
+static bool sched_started = false;
+static int timer_fd = -1;
+/* Signalled by sched_stop() */
+static int wake_fd = -1;
+static int stopping;
+
+/* Last time formatted by this thread */
+static __thread time_t cached_sec = -1;
+static __thread const char* cached_fmt;
+static __thread char cached[SCHED_TIME_MAX];
+static __thread size_t cached_len;
+
+static uint64_t sched_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int sched_add(const char* name, int interval_ms, void (*fn)(void* arg), void* arg) {
+    if(task_count == SCHED_TASKS_MAX || interval_ms <= 0) {
+        log_msg(LOG_ERR, "Cannot schedule %s every %d ms", name, interval_ms);
+        return -1;
+    }
+
+    struct sched_task* task = &tasks[task_count++];
+    task->name = name;
+    task->interval_ns = (uint64_t)interval_ms * 1000000;
+    task->fn = fn;
+    task->arg = arg;
+    return 0;
+}
+
+/* Arms the timer for the earliest deadline */
+static int sched_arm(void) {
+    uint64_t due = UINT64_MAX;
+
+    for(int i = 0; i < task_count; ++i) {
+        if(tasks[i].due_ns < due) {
+            due = tasks[i].due_ns;
+        }
+    }
+
+    struct itimerspec its = {
+        .it_value = { .tv_sec = due / 1000000000ull, .tv_nsec = due % 1000000000ull },
+    };
+
+    if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        log_msg(LOG_ERR, "Scheduler: Error %d (%s) on timerfd_settime()", errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Runs every task that is due and moves its deadline past now */
+static void sched_run_due(void) {
+    uint64_t now = sched_now_ns();
+
+    for(int i = 0; i < task_count; ++i) {
+        struct sched_task* task = &tasks[i];
+
+        if(task->due_ns > now) {
+            continue;
+        }
+
+        task->fn(task->arg);
+
+        uint64_t missed = (now - task->due_ns) / task->interval_ns;
+
+        if(missed > 0) {
+            log_msg(LOG_WARNING, "Scheduler: %s skipped %llu runs", task->name, (unsigned long long)missed);
+        }
+
+        task->due_ns += (missed + 1) * task->interval_ns;
+    }
+}
+
+static void *sched_thread(void *param) {
+    for(;;) {
+        struct pollfd pfds[2] = {
+            { .fd = timer_fd, .events = POLLIN },
+            { .fd = wake_fd, .events = POLLIN },
+        };
+
+        if(poll(pfds, 2, -1) < 0 && errno != EINTR) {
+            log_msg(LOG_ERR, "Scheduler: Error %d (%s) on poll()", errno, strerror(errno));
+            break;
+        }
+
+        if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        if(pfds[0].revents & POLLIN) {
+            uint64_t count;
+            ssize_t rc = read(timer_fd, &count, sizeof(count));
+            (void)rc;
+
+            sched_run_due();
+
+            if(sched_arm() != 0) {
+                break;
+            }
+        }
+    }
+
+    return param;
+}
+
+int sched_start(void) {
+    stopping = 0;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(timer_fd < 0 || wake_fd < 0) {
+        log_msg(LOG_ERR, "Scheduler: Error %d (%s) creating its descriptors", errno, strerror(errno));
+        sched_stop();
+        return -1;
+    }
+
+    uint64_t now = sched_now_ns();
+
+    for(int i = 0; i < task_count; ++i) {
+        tasks[i].due_ns = now + tasks[i].interval_ns;
+    }
+
+    if(task_count > 0 && sched_arm() != 0) {
+        sched_stop();
+        return -1;
+    }
+
+    if(pthread_create(&sched_id, NULL, sched_thread, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create scheduler thread");
+        sched_stop();
+        return -1;
+    }
+
+    sched_started = true;
+    log_msg(LOG_INFO, "Started scheduler with %d tasks", task_count);
+    return 0;
+}
+
+void sched_stop(void) {
+    if(sched_started) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+
+        if(pthread_join(sched_id, NULL) != 0) {
+            log_msg(LOG_ERR, "Failed to join scheduler thread");
+        }
+        sched_started = false;
+    }
+
+    if(timer_fd != -1) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    if(wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+size_t sched_strftime(char* buf, size_t size, const char* fmt) {
+    time_t now = time(NULL);
+
+    if(now != cached_sec || fmt != cached_fmt) {
+        struct tm tm;
+
+        cached_len = localtime_r(&now, &tm) ? strftime(cached, sizeof(cached), fmt, &tm) : 0;
+        cached_sec = now;
+        cached_fmt = fmt;
+    }
+
+    if(cached_len == 0 || cached_len >= size) {
+        return 0;
+    }
+
+    memcpy(buf, cached, cached_len + 1);
+    return cached_len;
+}
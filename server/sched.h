@@ -0,0 +1,37 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+
+/* Periodic tasks the scheduler can host */
+#define SCHED_TASKS_MAX 8
+
+/*
+ * Periodic tasks run one after the other by a single scheduler thread,
+ * which sleeps on a timerfd armed for the earliest deadline.  Deadlines
+ * are kept on the monotonic clock and advance by whole intervals, so a
+ * task keeps its phase; ticks missed while a task ran late are skipped
+ * rather than run back to back.
+ *
+ * The scheduler has its own thread instead of a timerfd in the server's
+ * loops: thread mode has no loop, pool and uring mode have one per
+ * worker, and tasks block, commit_append() waits for the writer thread,
+ * which would stall the clients of whichever loop ran them.
+ */
+
+/* Registers fn to run every interval_ms, first after one interval.  Call before sched_start() */
+extern int sched_add(const char* name, int interval_ms, void (*fn)(void* arg), void* arg);
+
+extern int sched_start(void);
+
+/* Stops the thread, a task running at the time is finished first */
+extern void sched_stop(void);
+
+/*
+ * strftime() of the current local time, for any thread.  The result is
+ * cached per thread and only formatted again once the second or the
+ * format changes.  Returns the length written, 0 if it does not fit.
+ */
+extern size_t sched_strftime(char* buf, size_t size, const char* fmt);
+
+#endif /* SCHED_H */
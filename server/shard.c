@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "shard.h"
+
+int shards_bind(struct shards* sh, int count, const struct sockaddr* addr, socklen_t addrlen) {
+    int yes = 1;
+
+    for(sh->count = 0; sh->count < count; ++sh->count) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if(fd == -1) {
+            log_msg(LOG_ERR, "Error %d (%s) on socket()", errno, strerror(errno));
+            goto fail;
+        }
+
+        sh->fds[sh->count] = fd;
+
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0 ||
+           (count > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) != 0)) {
+            log_msg(LOG_ERR, "Error %d (%s) on setsockopt()", errno, strerror(errno));
+            ++sh->count;
+            goto fail;
+        }
+
+        if(bind(fd, addr, addrlen) != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) on bind()", errno, strerror(errno));
+            ++sh->count;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    shards_close(sh);
+    return -1;
+}
+
+int shards_bind_local(struct shards* sh, const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg(LOG_ERR, "Local socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd == -1) {
+        log_msg(LOG_ERR, "Error %d (%s) on socket()", errno, strerror(errno));
+        return -1;
+    }
+
+    /* Left behind by a previous run, a live server would have handed the listener over */
+    unlink(path);
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) binding local socket %s", errno, strerror(errno), path);
+        close(fd);
+        return -1;
+    }
+
+    sh->local_fd = fd;
+    return 0;
+}
+
+int shards_listen(const struct shards* sh, int backlog) {
+    for(int i = 0; i < sh->count; ++i) {
+        if(listen(sh->fds[i], backlog) < 0) {
+            log_msg(LOG_ERR, "Error %d (%s) on listen()", errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    if(sh->local_fd != -1 && listen(sh->local_fd, backlog) < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on listen()", errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void shards_close(struct shards* sh) {
+    for(int i = 0; i < sh->count; ++i) {
+        if(sh->fds[i] != -1 && close(sh->fds[i]) != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) on server_fd close()", errno, strerror(errno));
+        }
+        sh->fds[i] = -1;
+    }
+
+    if(sh->local_fd != -1 && close(sh->local_fd) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on local_fd close()", errno, strerror(errno));
+    }
+
+    sh->count = 0;
+    sh->local_fd = -1;
+}
+
+int shard_pin(pthread_t thread, int index) {
+    cpu_set_t allowed;
+    cpu_set_t cpu;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on sched_getaffinity()", errno, strerror(errno));
+        return -1;
+    }
+
+    int skip = index % CPU_COUNT(&allowed);
+
+    CPU_ZERO(&cpu);
+
+    for(int i = 0; i < CPU_SETSIZE; ++i) {
+        if(CPU_ISSET(i, &allowed) && skip-- == 0) {
+            CPU_SET(i, &cpu);
+            break;
+        }
+    }
+
+    int rc = pthread_setaffinity_np(thread, sizeof(cpu), &cpu);
+
+    if(rc != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on pthread_setaffinity_np()", rc, strerror(rc));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define SHARDS_MAX 64
+
+/*
+ * Listening sockets bound to the same address.  With more than one shard
+ * each socket is opened with SO_REUSEPORT and the kernel spreads incoming
+ * connections across their accept queues, so every event loop can own a
+ * queue of its own instead of contending on a single one.
+ */
+struct shards {
+    int fds[SHARDS_MAX];
+    int count;
+    /* Unix domain listener for clients on the same host, served alongside the shards, or -1 */
+    int local_fd;
+};
+
+/* Creates count sockets bound to addr, closing them all again on failure */
+extern int shards_bind(struct shards* sh, int count, const struct sockaddr* addr, socklen_t addrlen);
+
+/* Binds the Unix domain listener at path, replacing any socket file left behind there */
+extern int shards_bind_local(struct shards* sh, const char* path);
+
+extern int shards_listen(const struct shards* sh, int backlog);
+
+/* Closes every listener, the socket file of the local one is left to the caller */
+extern void shards_close(struct shards* sh);
+
+/*
+ * Index of the shard a loop accepts from.  Loops beyond the shard count
+ * share the shards round robin.
+ */
+static inline int shard_for_loop(const struct shards* sh, int loop_index) {
+    return loop_index % sh->count;
+}
+
+/*
+ * Pins thread to the index-th CPU, wrapping around, among the CPUs the
+ * process is allowed to run on.
+ */
+extern int shard_pin(pthread_t thread, int index);
+
+#endif /* SHARD_H */
@@ -0,0 +1,386 @@
+/*
+ * Load generator for the shared-memory sessions of a local aesdsocket.
+ * Every session writes a batch of lines of a given size into its ring,
+ * asks for a replay and maps the segments it is sent, as fast as it can.
+ * The latency is measured from the first line of a batch until the replay
+ * is mapped and its end found to hold the last line of the batch, which
+ * is comparable to aesdsocket-bench -U -b with the same batch size.  Other
+ * sessions may have appended after that line, so it is looked for in the
+ * last few batches worth of bytes rather than right at the end.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shm.h"
+
+struct bench_session {
+    pthread_t thread_id;
+    unsigned int id;
+    int fd;
+    struct shm_ring* ring;
+
+    char* batch;
+    size_t batch_len;
+    size_t last_line;
+    /* End of the latest replay */
+    char* window;
+
+    uint64_t* latencies;
+    size_t latency_count;
+    size_t latency_cap;
+
+    unsigned long long lines;
+    unsigned long long bytes_mapped;
+    unsigned long long errors;
+};
+
+static struct sockaddr_un session_addr;
+static size_t line_size = 64;
+static unsigned int batch_lines = 32;
+static size_t window_size;
+static uint64_t deadline;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Receives one message and up to SHM_REPLAY_EXTENTS descriptors, returns its type or 0 */
+static uint32_t session_recv(struct bench_session* s, struct shm_msg* msg, int* fds, int* fd_count) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_REPLAY_EXTENTS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(struct shm_msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf) };
+    ssize_t n;
+
+    while((n = recvmsg(s->fd, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+
+    *fd_count = 0;
+
+    if(n < (ssize_t)sizeof(uint32_t) * 2) {
+        return 0;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        *fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *fd_count);
+    }
+
+    return msg->type;
+}
+
+static int session_send(struct bench_session* s, uint32_t type) {
+    return send(s->fd, &type, sizeof(type), MSG_NOSIGNAL) == sizeof(type) ? 0 : -1;
+}
+
+static int session_open(struct bench_session* s) {
+    s->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    if(s->fd < 0 || connect(s->fd, (struct sockaddr *)&session_addr, sizeof(session_addr)) != 0) {
+        perror("connect");
+        return -1;
+    }
+
+    struct shm_msg msg;
+    int fds[SHM_REPLAY_EXTENTS];
+    int fd_count;
+
+    if(session_recv(s, &msg, fds, &fd_count) != SHM_MSG_RING || fd_count != 1) {
+        fprintf(stderr, "session %u: no ring\n", s->id);
+        return -1;
+    }
+
+    s->ring = mmap(NULL, sizeof(struct shm_ring) + SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+
+    if(s->ring == MAP_FAILED || s->ring->magic != SHM_MAGIC || s->ring->size != SHM_RING_SIZE) {
+        fprintf(stderr, "session %u: bad ring\n", s->id);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Copies len bytes into the ring, waiting for the server to make room */
+static int session_write(struct bench_session* s, const char* data, size_t len) {
+    struct shm_ring* ring = s->ring;
+    uint64_t head = ring->head;
+
+    while(len > 0) {
+        uint64_t space = SHM_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+
+        if(space == 0) {
+            __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+            if(SHM_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST)) == 0) {
+                struct shm_msg msg;
+                int fds[SHM_REPLAY_EXTENTS];
+                int fd_count;
+
+                if(session_recv(s, &msg, fds, &fd_count) != SHM_MSG_SPACE) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        size_t start = head % SHM_RING_SIZE;
+        size_t n = len < space ? len : space;
+
+        if(n > SHM_RING_SIZE - start) {
+            n = SHM_RING_SIZE - start;
+        }
+
+        memcpy(ring->data + start, data, n);
+        head += n;
+        data += n;
+        len -= n;
+
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        if(__atomic_exchange_n(&ring->notified, 1, __ATOMIC_SEQ_CST) == 0 && session_send(s, SHM_MSG_DATA) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Maps every extent of a replay, checking that its end holds the last line of the batch */
+static int session_replay(struct bench_session* s) {
+    size_t window_len = 0;
+
+    if(session_send(s, SHM_MSG_REPLAY) != 0) {
+        return -1;
+    }
+
+    for(;;) {
+        struct shm_msg msg;
+        int fds[SHM_REPLAY_EXTENTS];
+        int fd_count;
+        uint32_t type = session_recv(s, &msg, fds, &fd_count);
+
+        if(type == SHM_MSG_SPACE) {
+            continue;
+        }
+
+        if((type != SHM_MSG_EXTENTS && type != SHM_MSG_REPLAY_END) || (uint32_t)fd_count != msg.count) {
+            return -1;
+        }
+
+        for(int i = 0; i < fd_count; ++i) {
+            size_t end = msg.extents[i].file_offset + msg.extents[i].len;
+            char* map = mmap(NULL, end, PROT_READ, MAP_SHARED, fds[i], 0);
+
+            close(fds[i]);
+
+            if(map == MAP_FAILED) {
+                return -1;
+            }
+
+            /* Keeps the last window_size bytes seen across extents */
+            size_t take = msg.extents[i].len < window_size ? msg.extents[i].len : window_size;
+            size_t keep = window_len + take > window_size ? window_size - take : window_len;
+
+            memmove(s->window, s->window + window_len - keep, keep);
+            memcpy(s->window + keep, map + end - take, take);
+            window_len = keep + take;
+
+            s->bytes_mapped += msg.extents[i].len;
+            munmap(map, end);
+        }
+
+        if(type == SHM_MSG_REPLAY_END) {
+            break;
+        }
+    }
+
+    return memmem(s->window, window_len, s->batch + s->last_line, s->batch_len - s->last_line) ? 0 : -1;
+}
+
+static void *session_start(void *param) {
+    struct bench_session* s = (struct bench_session *)param;
+    unsigned int seq = 0;
+
+    while(now() < deadline) {
+        s->batch_len = 0;
+
+        for(unsigned int i = 0; i < batch_lines; ++i, ++seq) {
+            char* line = s->batch + s->batch_len;
+            size_t len = snprintf(line, line_size + 32, "%u:%u:", s->id, seq);
+
+            while(len + 1 < line_size) {
+                line[len] = 'a' + (s->id + seq + len) % 26;
+                ++len;
+            }
+            line[len++] = '\n';
+            s->last_line = s->batch_len;
+            s->batch_len += len;
+        }
+
+        uint64_t start = now();
+
+        if(session_write(s, s->batch, s->batch_len) != 0 || session_replay(s) != 0) {
+            ++s->errors;
+            break;
+        }
+
+        if(s->latency_count == s->latency_cap) {
+            s->latency_cap = s->latency_cap ? s->latency_cap * 2 : 1024;
+            s->latencies = realloc(s->latencies, s->latency_cap * sizeof(uint64_t));
+        }
+
+        s->latencies[s->latency_count++] = now() - start;
+        s->lines += batch_lines;
+    }
+
+    return param;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t* sorted, size_t count, double p) {
+    if(count == 0) {
+        return 0;
+    }
+
+    size_t index = (size_t)(p * (count - 1) + 0.5);
+    return sorted[index] / 1e6;
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    int session_count = 16;
+    int seconds = 5;
+
+    int opt;
+    while((opt = getopt(argc, argv, "Z:c:s:d:b:")) != -1) {
+        switch(opt) {
+        case 'Z':
+            path = optarg;
+            break;
+        case 'c':
+            session_count = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            line_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            seconds = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch_lines = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -Z shm socket [-c sessions] [-s line bytes] [-d seconds] "
+                    "[-b lines per replay]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(path == NULL || strlen(path) >= sizeof(session_addr.sun_path)) {
+        fprintf(stderr, "the shm socket path is missing or too long\n");
+        return 1;
+    }
+
+    if(session_count < 1 || seconds < 1 || batch_lines < 1 || line_size < 16) {
+        fprintf(stderr, "sessions, seconds and lines must be positive, lines at least 16 bytes\n");
+        return 1;
+    }
+
+    session_addr.sun_family = AF_UNIX;
+    strcpy(session_addr.sun_path, path);
+
+    window_size = (line_size + 32) * batch_lines * session_count * 4;
+
+    struct bench_session* sessions = calloc(session_count, sizeof(struct bench_session));
+
+    if(sessions == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for(int i = 0; i < session_count; ++i) {
+        sessions[i].id = i;
+        sessions[i].batch = malloc((line_size + 32) * batch_lines);
+        sessions[i].window = malloc(window_size);
+
+        if(sessions[i].batch == NULL || sessions[i].window == NULL || session_open(&sessions[i]) != 0) {
+            return 1;
+        }
+    }
+
+    uint64_t start = now();
+    deadline = start + (uint64_t)seconds * 1000000000ull;
+
+    for(int i = 0; i < session_count; ++i) {
+        pthread_create(&sessions[i].thread_id, NULL, session_start, &sessions[i]);
+    }
+
+    unsigned long long lines = 0;
+    unsigned long long bytes_mapped = 0;
+    unsigned long long errors = 0;
+    size_t latency_count = 0;
+
+    for(int i = 0; i < session_count; ++i) {
+        pthread_join(sessions[i].thread_id, NULL);
+        lines += sessions[i].lines;
+        bytes_mapped += sessions[i].bytes_mapped;
+        errors += sessions[i].errors;
+        latency_count += sessions[i].latency_count;
+    }
+
+    double elapsed = (now() - start) / 1e9;
+    uint64_t* latencies = malloc((latency_count ? latency_count : 1) * sizeof(uint64_t));
+    size_t filled = 0;
+
+    for(int i = 0; i < session_count; ++i) {
+        memcpy(latencies + filled, sessions[i].latencies, sessions[i].latency_count * sizeof(uint64_t));
+        filled += sessions[i].latency_count;
+        free(sessions[i].latencies);
+        free(sessions[i].batch);
+        free(sessions[i].window);
+        munmap(sessions[i].ring, sizeof(struct shm_ring) + SHM_RING_SIZE);
+        close(sessions[i].fd);
+    }
+
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+
+    printf("%d sessions, %zu byte lines, %u lines per replay, %.1f s\n", session_count, line_size, batch_lines,
+           elapsed);
+    printf("lines     %llu (%.1f/s)\n", lines, lines / elapsed);
+    printf("replays   %.1f MiB mapped (%.1f MiB/s)\n", bytes_mapped / 1048576.0, bytes_mapped / 1048576.0 / elapsed);
+    printf("latency   p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+           percentile_ms(latencies, latency_count, 0.50),
+           percentile_ms(latencies, latency_count, 0.99),
+           percentile_ms(latencies, latency_count, 0.999),
+           latency_count ? latencies[latency_count - 1] / 1e6 : 0);
+    printf("errors    %llu\n", errors);
+
+    free(latencies);
+    free(sessions);
+
+    return errors ? 2 : 0;
+}
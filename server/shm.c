@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "commit.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "shm.h"
+
+#define SHM_MAX_EVENTS 64
+#define SHM_RING_MASK ((uint64_t)SHM_RING_SIZE - 1)
+#define SHM_MAP_SIZE (sizeof(struct shm_ring) + SHM_RING_SIZE)
+
+struct shm_session {
+    int fd;
+    struct shm_ring* ring;
+
+    /* Bytes before tail are committed, only ever copied to the ring, which the client can write */
+    uint64_t tail;
+    /* Bytes before scanned were searched for newlines, lines_end follows the last one */
+    uint64_t scanned;
+    uint64_t lines_end;
+
+    /* A replay is sent once tail reaches replay_at */
+    bool replay_wanted;
+    uint64_t replay_at;
+
+    /* The writer references the session until the commit of [tail, commit_end) completes */
+    bool committing;
+    bool failed;
+    uint64_t commit_end;
+    struct commit_req commit;
+    struct iovec commit_iov[2];
+
+    LIST_ENTRY(shm_session) sessions;
+};
+
+LIST_HEAD(shm_list, shm_session);
+
+static struct store* store;
+static struct obj_pool session_pool;
+static struct shm_list sessions;
+static pthread_t shm_id;
+static bool shm_started = false;
+static const char* listen_path;
+static int listen_fd = -1;
+static int epfd = -1;
+/* Signalled by the commit writer when completed is no longer empty, and by shm_stop() */
+static int wake_fd = -1;
+static int stopping;
+static struct commit_req* completed;
+static size_t pending_commits;
+
+static void shm_close(struct shm_session* s) {
+    log_msg(LOG_INFO, "Shm: Closed session %d", s->fd);
+
+    close(s->fd);
+    munmap(s->ring, SHM_MAP_SIZE);
+    LIST_REMOVE(s, sessions);
+    obj_pool_free(&session_pool, s);
+}
+
+/* Sends msg with its count extents, passing fd_count descriptors along */
+static int shm_send(struct shm_session* s, struct shm_msg* msg, const int* fds, int fd_count) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_REPLAY_EXTENTS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = offsetof(struct shm_msg, extents) + msg->count * sizeof(struct shm_extent),
+    };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if(fd_count > 0) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    /* Messages are small, a client whose socket is full is not reading them */
+    if(sendmsg(s->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        log_msg(LOG_WARNING, "Shm: Error %d (%s) sending to session %d", errno, strerror(errno), s->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Moves lines_end past the last newline published before head */
+static void shm_scan(struct shm_session* s, uint64_t head) {
+    uint64_t pos = head;
+
+    while(pos > s->scanned) {
+        /* Contiguous bytes ending at pos, the ring wraps at most once */
+        size_t end = ((pos - 1) & SHM_RING_MASK) + 1;
+        size_t len = end < pos - s->scanned ? end : pos - s->scanned;
+        char* nl = memrchr(s->ring->data + end - len, '\n', len);
+
+        if(nl) {
+            s->lines_end = pos - (s->ring->data + end - nl) + 1;
+            break;
+        }
+
+        pos -= len;
+    }
+
+    s->scanned = head;
+}
+
+/* Called from the commit writer thread */
+static void shm_commit_done(struct commit_req* req) {
+    struct commit_req* head = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+
+    do {
+        req->next = head;
+    } while(!__atomic_compare_exchange_n(&completed, &head, req, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(head == NULL) {
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+/* Hands [tail, end) to the commit writer straight from the ring */
+static int shm_commit(struct shm_session* s, uint64_t tail, uint64_t end) {
+    size_t start = tail & SHM_RING_MASK;
+    size_t len = end - tail;
+    size_t first = len < SHM_RING_SIZE - start ? len : SHM_RING_SIZE - start;
+
+    s->commit_iov[0].iov_base = s->ring->data + start;
+    s->commit_iov[0].iov_len = first;
+    s->commit_iov[1].iov_base = s->ring->data;
+    s->commit_iov[1].iov_len = len - first;
+
+    s->commit.iov = s->commit_iov;
+    s->commit.iovcnt = len > first ? 2 : 1;
+    s->commit.complete = shm_commit_done;
+    s->commit.arg = s;
+    s->commit_end = end;
+    s->committing = true;
+    ++pending_commits;
+
+    if(commit_submit(&s->commit) != 0) {
+        log_msg(LOG_ERR, "Shm: failed to append to %s", store->path);
+        s->committing = false;
+        --pending_commits;
+        return -1;
+    }
+
+    metrics_add(METRIC_BYTES_IN, len);
+    return 0;
+}
+
+/* Answers with read-only descriptors of every segment holding the retained log */
+static int shm_replay(struct shm_session* s) {
+    struct store_snapshot snap;
+    store_snapshot(store, &snap);
+
+    struct shm_msg msg = { .type = SHM_MSG_EXTENTS };
+    int fds[SHM_REPLAY_EXTENTS];
+    off_t offset = snap.start;
+    int rc = 0;
+
+    metrics_add(METRIC_REPLAYS, 1);
+
+    for(;;) {
+        struct store_extent ext;
+        store_pin(store, offset, snap.length, &ext);
+
+        if(ext.len == 0) {
+            break;
+        }
+
+        int fd = store_reopen(&ext);
+
+        msg.extents[msg.count].file_offset = ext.file_offset;
+        msg.extents[msg.count].len = ext.len;
+        offset = ext.offset + ext.len;
+        store_unpin(store, &ext);
+
+        if(fd < 0) {
+            rc = -1;
+            break;
+        }
+
+        fds[msg.count++] = fd;
+
+        if(msg.count == SHM_REPLAY_EXTENTS) {
+            rc = shm_send(s, &msg, fds, msg.count);
+
+            for(uint32_t i = 0; i < msg.count; ++i) {
+                close(fds[i]);
+            }
+            msg.count = 0;
+
+            if(rc != 0) {
+                break;
+            }
+        }
+    }
+
+    if(rc == 0) {
+        msg.type = SHM_MSG_REPLAY_END;
+        rc = shm_send(s, &msg, fds, msg.count);
+    }
+
+    for(uint32_t i = 0; i < msg.count; ++i) {
+        close(fds[i]);
+    }
+
+    return rc;
+}
+
+/* Commits the complete lines published so far, or sends the replay once they are in */
+static int shm_pump(struct shm_session* s) {
+    if(s->committing || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    struct shm_ring* ring = s->ring;
+
+    /* Cleared before looking at head, so lines published after this point signal again */
+    __atomic_store_n(&ring->notified, 0, __ATOMIC_SEQ_CST);
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = s->tail;
+
+    if(head < s->scanned || head - tail > SHM_RING_SIZE) {
+        log_msg(LOG_WARNING, "Shm: Session %d moved its head to %llu, behind or past the ring", s->fd,
+                (unsigned long long)head);
+        return -1;
+    }
+
+    shm_scan(s, head);
+
+    /* A full ring without a newline is committed as it is, nothing else would make room */
+    if(s->lines_end == tail && head - tail == SHM_RING_SIZE) {
+        s->lines_end = head;
+    }
+
+    if(s->lines_end > tail) {
+        return shm_commit(s, tail, s->lines_end);
+    }
+
+    if(s->replay_wanted && tail >= s->replay_at) {
+        s->replay_wanted = false;
+        return shm_replay(s);
+    }
+
+    return 0;
+}
+
+static void shm_committed(struct shm_session* s) {
+    s->committing = false;
+    --pending_commits;
+
+    if(s->commit.result != 0) {
+        log_msg(LOG_ERR, "Shm: failed to append to %s", store->path);
+        s->failed = true;
+    }
+
+    if(s->failed) {
+        shm_close(s);
+        return;
+    }
+
+    s->tail = s->commit_end;
+    __atomic_store_n(&s->ring->tail, s->tail, __ATOMIC_SEQ_CST);
+
+    struct shm_msg msg = { .type = SHM_MSG_SPACE };
+
+    if(__atomic_exchange_n(&s->ring->waiting, 0, __ATOMIC_SEQ_CST) != 0 && shm_send(s, &msg, NULL, 0) != 0) {
+        shm_close(s);
+        return;
+    }
+
+    if(shm_pump(s) != 0) {
+        shm_close(s);
+    }
+}
+
+static void shm_handle_completions(void) {
+    uint64_t count;
+    ssize_t rc = read(wake_fd, &count, sizeof(count));
+    (void)rc;
+
+    struct commit_req* req = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+
+    while(req) {
+        struct commit_req* next = req->next;
+        shm_committed((struct shm_session *)req->arg);
+        req = next;
+    }
+}
+
+/* Reads the client's messages, returns -1 once the session has to be closed */
+static int shm_read(struct shm_session* s) {
+    for(;;) {
+        uint32_t type;
+        ssize_t n = recv(s->fd, &type, sizeof(type), MSG_DONTWAIT);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            log_msg(LOG_ERR, "Shm: Error %d (%s) on recv()", errno, strerror(errno));
+            return -1;
+        }
+
+        if(n == 0) {
+            return -1;
+        }
+
+        if(n != sizeof(type) || (type != SHM_MSG_DATA && type != SHM_MSG_REPLAY)) {
+            log_msg(LOG_WARNING, "Shm: Session %d sent an invalid message", s->fd);
+            return -1;
+        }
+
+        /* Everything published up to now is committed before the replay */
+        if(type == SHM_MSG_REPLAY) {
+            uint64_t head = __atomic_load_n(&s->ring->head, __ATOMIC_ACQUIRE);
+
+            if(head >= s->scanned && head - s->tail <= SHM_RING_SIZE) {
+                shm_scan(s, head);
+            }
+
+            s->replay_wanted = true;
+            s->replay_at = s->lines_end;
+        }
+    }
+
+    return shm_pump(s);
+}
+
+/* Maps a sealed memfd for the ring, so the client can neither shrink nor grow it under the server */
+static int shm_map_ring(struct shm_session* s) {
+    int fd = memfd_create("aesdsocket-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if(fd < 0) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) on memfd_create()", errno, strerror(errno));
+        return -1;
+    }
+
+    if(ftruncate(fd, SHM_MAP_SIZE) != 0 ||
+       fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) sizing the ring", errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    s->ring = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(s->ring == MAP_FAILED) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) on mmap()", errno, strerror(errno));
+        s->ring = NULL;
+        close(fd);
+        return -1;
+    }
+
+    s->ring->magic = SHM_MAGIC;
+    s->ring->size = SHM_RING_SIZE;
+
+    struct shm_msg msg = { .type = SHM_MSG_RING };
+    int rc = shm_send(s, &msg, &fd, 1);
+
+    /* The mapping keeps the ring alive */
+    close(fd);
+    return rc;
+}
+
+static void shm_accept(void) {
+    for(;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_msg(LOG_ERR, "Shm: Error %d (%s) on accept()", errno, strerror(errno));
+            }
+            return;
+        }
+
+        struct shm_session* s = obj_pool_alloc(&session_pool);
+
+        if(s == NULL) {
+            log_msg(LOG_ERR, "Shm: out of memory");
+            close(fd);
+            continue;
+        }
+
+        memset(s, 0, sizeof(struct shm_session));
+        s->fd = fd;
+
+        if(shm_map_ring(s) != 0) {
+            if(s->ring) {
+                munmap(s->ring, SHM_MAP_SIZE);
+            }
+            obj_pool_free(&session_pool, s);
+            close(fd);
+            continue;
+        }
+
+        LIST_INSERT_HEAD(&sessions, s, sessions);
+        metrics_add(METRIC_CONNECTIONS, 1);
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            log_msg(LOG_ERR, "Shm: Error %d (%s) on epoll_ctl()", errno, strerror(errno));
+            shm_close(s);
+            continue;
+        }
+
+        log_msg(LOG_INFO, "Shm: Opened session %d", fd);
+    }
+}
+
+static void *shm_thread(void *param) {
+    struct epoll_event events[SHM_MAX_EVENTS];
+
+    log_msg(LOG_INFO, "Shm thread started working");
+
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(epfd, events, SHM_MAX_EVENTS, -1);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            log_msg(LOG_ERR, "Shm: Error %d (%s) on epoll_wait()", errno, strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n; ++i) {
+            if(events[i].data.ptr == &wake_fd) {
+                shm_handle_completions();
+                continue;
+            }
+
+            if(events[i].data.ptr == &listen_fd) {
+                shm_accept();
+                continue;
+            }
+
+            struct shm_session* s = (struct shm_session *)events[i].data.ptr;
+
+            if(s->failed) {
+                continue;
+            }
+
+            if((events[i].events & (EPOLLERR | EPOLLHUP)) || shm_read(s) != 0) {
+                /* The writer still references the session until its commit completes */
+                if(s->committing) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+                    s->failed = true;
+                } else {
+                    shm_close(s);
+                }
+            }
+        }
+    }
+
+    /* Nothing new is submitted while stopping, the commits in flight complete before commit_stop() */
+    while(pending_commits > 0) {
+        struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+
+        if(poll(&pfd, 1, -1) > 0) {
+            shm_handle_completions();
+        }
+    }
+
+    while(!LIST_EMPTY(&sessions)) {
+        shm_close(LIST_FIRST(&sessions));
+    }
+
+    log_msg(LOG_INFO, "Shm thread finished working");
+    return param;
+}
+
+static int shm_listen(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg(LOG_ERR, "Shm socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(listen_fd < 0) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) on socket()", errno, strerror(errno));
+        return -1;
+    }
+
+    /* Left behind by a previous run */
+    unlink(path);
+
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) binding %s", errno, strerror(errno), path);
+        return -1;
+    }
+
+    listen_path = path;
+    return 0;
+}
+
+int shm_start(const char* path, struct store* st) {
+    store = st;
+    stopping = 0;
+    LIST_INIT(&sessions);
+    obj_pool_init(&session_pool, sizeof(struct shm_session), 16);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(epfd < 0 || wake_fd < 0) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) on epoll_create1()", errno, strerror(errno));
+        shm_stop();
+        return -1;
+    }
+
+    if(shm_listen(path) != 0) {
+        shm_stop();
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wake_fd };
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = &listen_fd };
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) != 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &lev) != 0) {
+        log_msg(LOG_ERR, "Shm: Error %d (%s) on epoll_ctl()", errno, strerror(errno));
+        shm_stop();
+        return -1;
+    }
+
+    if(pthread_create(&shm_id, NULL, shm_thread, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create shm thread");
+        shm_stop();
+        return -1;
+    }
+
+    shm_started = true;
+    log_msg(LOG_INFO, "Serving shared-memory sessions on %s", path);
+    return 0;
+}
+
+void shm_stop(void) {
+    if(shm_started) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+
+        if(pthread_join(shm_id, NULL) != 0) {
+            log_msg(LOG_ERR, "Failed to join shm thread");
+        }
+        shm_started = false;
+    }
+
+    if(listen_fd != -1) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if(listen_path) {
+        unlink(listen_path);
+        listen_path = NULL;
+    }
+    if(wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if(epfd != -1) {
+        close(epfd);
+        epfd = -1;
+    }
+    obj_pool_destroy(&session_pool);
+}
@@ -0,0 +1,84 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+
+#include "store.h"
+
+/*
+ * Shared-memory sessions for producers on the same host.  A client
+ * connects to the session socket, a SOCK_SEQPACKET Unix socket, and is
+ * sent a memfd holding a ring of SHM_RING_SIZE bytes which it maps and
+ * writes its lines into.  The session thread hands complete lines to the
+ * commit writer straight from its own mapping of the ring, so appending
+ * costs neither a socket write nor a copy into a receive buffer.
+ *
+ * A replay is answered with read-only descriptors of the segments holding
+ * the log, each with the range to read, which the client maps instead of
+ * having the bytes sent over a socket.  The replay covers every line
+ * published to the ring before it was asked for.
+ *
+ * Sessions are not handed over on restart, a client reconnects.
+ */
+#define SHM_MAGIC 0x61657368
+/* Ring capacity, a power of two */
+#define SHM_RING_SIZE (1024 * 1024)
+/* Extents, and so descriptors, in one replay message */
+#define SHM_REPLAY_EXTENTS 16
+
+/*
+ * Lines are written at head modulo SHM_RING_SIZE and published by moving
+ * head, the server consumes them by moving tail once they are committed.
+ * Each side only writes its own cursor.  A producer that moved head sets
+ * notified and sends SHM_MSG_DATA only if it was clear; the server clears
+ * it before it looks at head.  A producer out of space sets waiting, checks
+ * tail again and then waits for SHM_MSG_SPACE.
+ */
+struct shm_ring {
+    uint32_t magic;
+    uint32_t size;
+
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t notified;
+    uint32_t waiting;
+
+    uint64_t tail __attribute__((aligned(64)));
+
+    char data[] __attribute__((aligned(64)));
+};
+
+enum shm_msg_type {
+    /* Client: lines were published while notified was clear */
+    SHM_MSG_DATA = 1,
+    /* Client: asks for a replay */
+    SHM_MSG_REPLAY,
+    /* Server: carries the ring's memfd, first message of a session */
+    SHM_MSG_RING,
+    /* Server: tail moved while waiting was set */
+    SHM_MSG_SPACE,
+    /* Server: extents of a replay, more follow */
+    SHM_MSG_EXTENTS,
+    /* Server: last extents of a replay, possibly none */
+    SHM_MSG_REPLAY_END,
+};
+
+/* Bytes to read from the descriptor sent in the same position */
+struct shm_extent {
+    uint64_t file_offset;
+    uint64_t len;
+};
+
+/* Client messages are the bare type, server messages this header and count extents */
+struct shm_msg {
+    uint32_t type;
+    uint32_t count;
+    struct shm_extent extents[SHM_REPLAY_EXTENTS];
+};
+
+/* Serves sessions on the socket at path from a thread of its own, after commit_start() */
+extern int shm_start(const char* path, struct store* st);
+
+/* Waits for the commits in flight, closes every session and removes the socket */
+extern void shm_stop(void);
+
+#endif /* SHM_H */
@@ -0,0 +1,303 @@
+/*
+ * Replay throughput of the store with a growing number of concurrent
+ * clients.  Each client replays the whole committed prefix into a
+ * socketpair drained by a helper thread, while a writer keeps appending
+ * lines.  "locked" holds the store lock across the replay the way the
+ * server used to, "snapshot" replays the published prefix without it and
+ * "hot" does the same with the end of the log kept in memory.  With -n
+ * clients only replay the last bytes of the log, like a seek would.
+ *
+ * "sendfile" and "zerocopy" then replay over loopback TCP instead, with
+ * sendfile() or with MSG_ZEROCOPY sends of at least STORE_ZEROCOPY_MIN
+ * bytes; the share of zero-copy sends the kernel copied anyway is shown.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "store.h"
+
+enum bench_send {
+    SEND_STORE,
+    SEND_SENDFILE,
+    SEND_ZEROCOPY,
+};
+
+struct bench_client {
+    pthread_t thread_id;
+    pthread_t drain_id;
+    int fds[2];
+    unsigned long long replays;
+    unsigned long long bytes;
+    struct store_zerocopy zerocopy;
+};
+
+static struct store store;
+static volatile bool running;
+static bool locked;
+static off_t tail_bytes;
+static const char* mode_name;
+static enum bench_send send_mode;
+
+static void *drain_start(void *param) {
+    struct bench_client* client = (struct bench_client *)param;
+    char buffer[64 * 1024];
+
+    while(read(client->fds[1], buffer, sizeof(buffer)) > 0) {
+    }
+
+    return param;
+}
+
+static void *client_start(void *param) {
+    struct bench_client* client = (struct bench_client *)param;
+
+    while(running) {
+        if(locked) {
+            pthread_mutex_lock(&store.lock);
+        }
+
+        struct store_snapshot snap;
+        store_snapshot(&store, &snap);
+
+        off_t offset = snap.start;
+
+        if(tail_bytes > 0 && snap.length - tail_bytes > offset) {
+            offset = snap.length - tail_bytes;
+        }
+
+        off_t replayed = snap.length - offset;
+
+        while(offset < snap.length) {
+            ssize_t sent;
+
+            if(send_mode == SEND_ZEROCOPY) {
+                sent = store_send_zerocopy(&store, client->fds[0], &offset, snap.length, &client->zerocopy);
+            } else if(send_mode == SEND_SENDFILE) {
+                sent = store_sendfile(&store, client->fds[0], &offset, snap.length);
+            } else {
+                sent = store_send(&store, client->fds[0], &offset, snap.length);
+            }
+
+            if(sent <= 0 && errno != EINTR) {
+                perror("sendfile");
+                break;
+            }
+        }
+
+        if(locked) {
+            pthread_mutex_unlock(&store.lock);
+        }
+
+        client->replays++;
+        client->bytes += replayed;
+    }
+
+    return param;
+}
+
+static void *writer_start(void *param) {
+    unsigned long long* appends = (unsigned long long *)param;
+    char line[64];
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 100 * 1000 };
+
+    while(running) {
+        int len = snprintf(line, sizeof(line), "writer line %llu\n", *appends);
+        struct iovec iov = { .iov_base = line, .iov_len = len };
+
+        pthread_mutex_lock(&store.lock);
+        store_append(&store, &iov, 1);
+        pthread_mutex_unlock(&store.lock);
+
+        ++*appends;
+        nanosleep(&pause, NULL);
+    }
+
+    return param;
+}
+
+/* Connects fds over loopback TCP, with SO_ZEROCOPY on fds[0] for zero-copy sends */
+static int tcp_pair(int fds[2]) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int on = 1;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, len) != 0 || listen(listen_fd, 1) != 0 ||
+       getsockname(listen_fd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("listen");
+        return -1;
+    }
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(fds[0] < 0 || connect(fds[0], (struct sockaddr *)&addr, len) != 0 ||
+       (fds[1] = accept(listen_fd, NULL, NULL)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    close(listen_fd);
+
+    if(send_mode == SEND_ZEROCOPY && setsockopt(fds[0], SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        perror("setsockopt(SO_ZEROCOPY)");
+        return -1;
+    }
+
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int client_count, int seconds) {
+    struct bench_client* clients = calloc(client_count, sizeof(struct bench_client));
+    pthread_t writer_id;
+    unsigned long long appends = 0;
+
+    if(clients == NULL) {
+        return -1;
+    }
+
+    running = true;
+
+    for(int i = 0; i < client_count; ++i) {
+        if(send_mode == SEND_STORE ? socketpair(AF_UNIX, SOCK_STREAM, 0, clients[i].fds) != 0 :
+           tcp_pair(clients[i].fds) != 0) {
+            perror("socketpair");
+            return -1;
+        }
+        pthread_create(&clients[i].drain_id, NULL, drain_start, &clients[i]);
+    }
+
+    double start = now();
+
+    for(int i = 0; i < client_count; ++i) {
+        pthread_create(&clients[i].thread_id, NULL, client_start, &clients[i]);
+    }
+    pthread_create(&writer_id, NULL, writer_start, &appends);
+
+    sleep(seconds);
+    running = false;
+
+    unsigned long long replays = 0;
+    unsigned long long bytes = 0;
+    unsigned long completed = 0;
+    unsigned long copied = 0;
+
+    for(int i = 0; i < client_count; ++i) {
+        pthread_join(clients[i].thread_id, NULL);
+        replays += clients[i].replays;
+        bytes += clients[i].bytes;
+    }
+    pthread_join(writer_id, NULL);
+
+    double elapsed = now() - start;
+
+    for(int i = 0; i < client_count; ++i) {
+        shutdown(clients[i].fds[0], SHUT_WR);
+        pthread_join(clients[i].drain_id, NULL);
+
+        /* Everything was received, so every completion is queued by now */
+        store_zerocopy_reap(&store, clients[i].fds[0], &clients[i].zerocopy);
+        completed += clients[i].zerocopy.completed;
+        copied += clients[i].zerocopy.copied;
+        store_zerocopy_release(&store, &clients[i].zerocopy);
+
+        close(clients[i].fds[0]);
+        close(clients[i].fds[1]);
+    }
+    free(clients);
+
+    printf("%-9s %7d %12.1f %10.1f %12.1f", mode_name, client_count,
+           replays / elapsed, bytes / elapsed / (1024 * 1024), appends / elapsed);
+
+    if(completed > 0) {
+        printf(" %9.1f%%", 100.0 * copied / completed);
+    }
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* path = "/tmp/store-bench.data";
+    long size_kb = 1024;
+    int max_clients = 16;
+    int seconds = 2;
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:s:c:t:n:")) != -1) {
+        switch(opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 's':
+            size_kb = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            max_clients = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            tail_bytes = strtoll(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f file] [-s store KiB] [-c max clients] [-t seconds] [-n replayed bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if(store_open(&store, path, 0, 0) != 0) {
+        perror("store_open");
+        return 1;
+    }
+
+    char line[64];
+    memset(line, 'x', sizeof(line));
+    line[sizeof(line) - 1] = '\n';
+
+    struct iovec iov = { .iov_base = line, .iov_len = sizeof(line) };
+
+    while(store.length < size_kb * 1024) {
+        store_append(&store, &iov, 1);
+    }
+
+    printf("store: %lld bytes\n", (long long)store.length);
+    printf("%-9s %7s %12s %10s %12s %10s\n", "mode", "clients", "replays/s", "MiB/s", "appends/s", "zc copied");
+
+    static const char* modes[] = { "locked", "snapshot", "hot", "sendfile", "zerocopy" };
+
+    for(int mode = 0; mode < 5; ++mode) {
+        locked = (mode == 0);
+        mode_name = modes[mode];
+        send_mode = mode == 3 ? SEND_SENDFILE : mode == 4 ? SEND_ZEROCOPY : SEND_STORE;
+
+        if(mode == 2 && store_keep_hot(&store, STORE_HOT_SIZE) != 0) {
+            store_close(&store, true);
+            return 1;
+        }
+
+        for(int clients = 1; clients <= max_clients; clients *= 2) {
+            if(run(clients, seconds) != 0) {
+                store_close(&store, true);
+                return 1;
+            }
+        }
+    }
+
+    store_close(&store, true);
+    return 0;
+}
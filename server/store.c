@@ -0,0 +1,1122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "log.h"
+#include "store.h"
+
+#define STORE_SCAN_SIZE (64 * 1024)
+#define STORE_MANIFEST_MAGIC "aesdsocket-store 1"
+
+#define SEGMENT_SLOT(id) ((id) & (STORE_SEGMENTS_MAX - 1))
+
+#define INDEX_SLOT(chunk) ((chunk) & (STORE_INDEX_CHUNKS - 1))
+
+static int store_index_add(struct store* st, off_t offset) {
+    size_t chunk = st->line_count >> STORE_INDEX_CHUNK_SHIFT;
+    off_t** slot = &st->line_chunks[INDEX_SLOT(chunk)];
+
+    /* More retained lines than the index holds */
+    if(chunk - st->index_base >= STORE_INDEX_CHUNKS) {
+        return -1;
+    }
+
+    if(*slot == NULL) {
+        *slot = malloc(STORE_INDEX_CHUNK_LINES * sizeof(off_t));
+
+        if(*slot == NULL) {
+            return -1;
+        }
+    }
+
+    (*slot)[st->line_count & (STORE_INDEX_CHUNK_LINES - 1)] = offset;
+    st->line_count++;
+    return 0;
+}
+
+static off_t store_line_offset(const struct store* st, size_t line) {
+    return st->line_chunks[INDEX_SLOT(line >> STORE_INDEX_CHUNK_SHIFT)][line & (STORE_INDEX_CHUNK_LINES - 1)];
+}
+
+/* Frees the chunks holding no retained line, with segments_lock held for writing */
+static void store_index_trim(struct store* st, size_t first_line) {
+    size_t first_chunk = first_line >> STORE_INDEX_CHUNK_SHIFT;
+
+    for(; st->index_base < first_chunk; ++st->index_base) {
+        free(st->line_chunks[INDEX_SLOT(st->index_base)]);
+        st->line_chunks[INDEX_SLOT(st->index_base)] = NULL;
+    }
+}
+
+static void store_publish(struct store* st) {
+    struct store_segment* first = st->segments[SEGMENT_SLOT(st->first_segment)];
+
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&st->committed_start, first->base, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->committed_length, st->length, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->committed_first_line, first->first_line, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->committed_lines, st->line_count, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies what was just appended at offset into the hot tail */
+static void store_hot_append(struct store* st, off_t offset, const struct iovec* iov, int iovcnt) {
+    /* Readers of the bytes about to be overwritten see the new limit first */
+    __atomic_store_n(&st->hot_limit, st->length, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for(int i = 0; i < iovcnt; ++i) {
+        const char* data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        /* Only the last hot_size bytes of a large append survive */
+        if(len > st->hot_size) {
+            data += len - st->hot_size;
+            offset += len - st->hot_size;
+            len = st->hot_size;
+        }
+
+        size_t pos = offset % st->hot_size;
+        size_t first = len < st->hot_size - pos ? len : st->hot_size - pos;
+
+        memcpy(st->hot + pos, data, first);
+        memcpy(st->hot, data + first, len - first);
+        offset += len;
+    }
+}
+
+/* After a failed write the log and the hot tail no longer line up, start over */
+static void store_hot_reset(struct store* st) {
+    if(st->hot) {
+        __atomic_store_n(&st->hot_base, st->length, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->hot_limit, st->length, __ATOMIC_RELAXED);
+    }
+}
+
+/* Copies [offset, end) out of the hot tail, false if any of it is not there or was overwritten meanwhile */
+static bool store_hot_copy(const struct store* st, off_t offset, off_t end, char* buf) {
+    off_t size = st->hot_size;
+
+    if(offset < __atomic_load_n(&st->hot_base, __ATOMIC_RELAXED) ||
+       offset < __atomic_load_n(&st->hot_limit, __ATOMIC_RELAXED) - size) {
+        return false;
+    }
+
+    size_t len = end - offset;
+    size_t pos = offset % size;
+    size_t first = len < size - pos ? len : size - pos;
+
+    memcpy(buf, st->hot + pos, first);
+    memcpy(buf + first, st->hot, len - first);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return offset >= __atomic_load_n(&st->hot_base, __ATOMIC_RELAXED) &&
+           offset >= __atomic_load_n(&st->hot_limit, __ATOMIC_RELAXED) - size;
+}
+
+/* Records the start of every line found in data, which is stored at offset */
+static int store_index(struct store* st, off_t offset, const char* data, size_t len) {
+    size_t pos = 0;
+
+    while(pos < len) {
+        if(st->at_line_start) {
+            if(store_index_add(st, offset + pos) != 0) {
+                return -1;
+            }
+            st->at_line_start = false;
+        }
+
+        const char* nl = memchr(data + pos, '\n', len - pos);
+
+        if(nl == NULL) {
+            break;
+        }
+
+        pos = nl - data + 1;
+        st->at_line_start = true;
+    }
+
+    return 0;
+}
+
+static void segment_path(const struct store* st, unsigned int id, const char* suffix, char* path, size_t size) {
+    snprintf(path, size, "%s.%08u%s", st->path, id, suffix);
+}
+
+static struct store_segment* segment_open(struct store* st, unsigned int id, int flags) {
+    char path[PATH_MAX];
+    struct store_segment* seg = calloc(1, sizeof(struct store_segment));
+
+    if(seg == NULL) {
+        return NULL;
+    }
+
+    segment_path(st, id, "", path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_CLOEXEC | flags, 0644);
+
+    if(seg->fd < 0) {
+        free(seg);
+        return NULL;
+    }
+
+    seg->id = id;
+    seg->base = st->length;
+    seg->first_line = st->line_count;
+    seg->refs = 1;
+    return seg;
+}
+
+static void segment_unlink(const struct store* st, unsigned int id) {
+    char path[PATH_MAX];
+
+    segment_path(st, id, "", path, sizeof(path));
+    unlink(path);
+    segment_path(st, id, ".idx", path, sizeof(path));
+    unlink(path);
+}
+
+/* Indexes the segment from its current length to the end of its file */
+static int segment_scan(struct store* st, struct store_segment* seg) {
+    char* buffer = malloc(STORE_SCAN_SIZE);
+
+    if(buffer == NULL) {
+        return -1;
+    }
+
+    for(;;) {
+        ssize_t n = pread(seg->fd, buffer, STORE_SCAN_SIZE, seg->length);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return -1;
+        }
+
+        if(n == 0) {
+            break;
+        }
+
+        if(store_index(st, st->length, buffer, n) != 0) {
+            free(buffer);
+            return -1;
+        }
+        st->length += n;
+        seg->length += n;
+    }
+
+    seg->lines = st->line_count - seg->first_line;
+    free(buffer);
+    return 0;
+}
+
+/* Saves the line offsets of a sealed segment next to it */
+static int segment_save_index(struct store* st, struct store_segment* seg) {
+    char path[PATH_MAX];
+    off_t buffer[STORE_SCAN_SIZE / sizeof(off_t)];
+    size_t count = 0;
+
+    segment_path(st, seg->id, ".idx", path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    for(size_t line = seg->first_line; line < seg->first_line + seg->lines; ++line) {
+        buffer[count++] = store_line_offset(st, line);
+
+        if(count == sizeof(buffer) / sizeof(off_t) || line + 1 == seg->first_line + seg->lines) {
+            if(write(fd, buffer, count * sizeof(off_t)) != (ssize_t)(count * sizeof(off_t))) {
+                close(fd);
+                return -1;
+            }
+            count = 0;
+        }
+    }
+
+    return close(fd);
+}
+
+/*
+ * Loads the line offsets saved by segment_save_index() for a segment of
+ * known length and line count.  Returns -1 if they do not match it, with
+ * nothing indexed.
+ */
+static int segment_load_index(struct store* st, struct store_segment* seg, off_t length, size_t lines) {
+    char path[PATH_MAX];
+    off_t buffer[STORE_SCAN_SIZE / sizeof(off_t)];
+    struct stat sb;
+
+    segment_path(st, seg->id, ".idx", path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    if(fstat(fd, &sb) != 0 || (size_t)sb.st_size != lines * sizeof(off_t)) {
+        close(fd);
+        return -1;
+    }
+
+    off_t prev = seg->base - 1;
+    size_t loaded = 0;
+    int rc = 0;
+
+    while(rc == 0 && loaded < lines) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+
+        if(n <= 0 || n % sizeof(off_t) != 0) {
+            rc = -1;
+            break;
+        }
+
+        for(size_t i = 0; i < n / sizeof(off_t); ++i) {
+            /* Offsets must be increasing and inside the segment, the first one at its start */
+            if(buffer[i] <= prev || buffer[i] >= seg->base + length ||
+               (loaded == 0 && buffer[i] != seg->base) || store_index_add(st, buffer[i]) != 0) {
+                rc = -1;
+                break;
+            }
+            prev = buffer[i];
+            ++loaded;
+        }
+    }
+
+    close(fd);
+
+    if(rc != 0) {
+        st->line_count = seg->first_line;
+        return -1;
+    }
+
+    seg->length = length;
+    seg->lines = lines;
+    st->length += length;
+    return 0;
+}
+
+/* Syncs the directory holding the log, so new and renamed files survive a crash */
+static int store_sync_dir(const struct store* st) {
+    char dir_path[PATH_MAX];
+
+    snprintf(dir_path, sizeof(dir_path), "%s", st->path);
+
+    int fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/* Lists every sealed segment, replaced atomically */
+static int store_save_manifest(struct store* st) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s.manifest", st->path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.manifest.tmp", st->path);
+
+    FILE* file = fopen(tmp_path, "we");
+
+    if(file == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "%s\n", STORE_MANIFEST_MAGIC);
+
+    for(unsigned int id = st->first_segment; id != st->last_segment; ++id) {
+        struct store_segment* seg = st->segments[SEGMENT_SLOT(id)];
+
+        fprintf(file, "%u %lld %lld %zu %zu\n", seg->id, (long long)seg->base, (long long)seg->length,
+                seg->first_line, seg->lines);
+    }
+
+    if((st->durable && (fflush(file) != 0 || fdatasync(fileno(file)) != 0)) ||
+       fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the number of segments listed in the manifest, entries allocated with malloc() */
+static size_t store_load_manifest(struct store* st, struct store_segment** entries) {
+    char path[PATH_MAX];
+    char magic[32];
+    size_t count = 0;
+    size_t capacity = 0;
+
+    *entries = NULL;
+    snprintf(path, sizeof(path), "%s.manifest", st->path);
+
+    FILE* file = fopen(path, "re");
+
+    if(file == NULL) {
+        return 0;
+    }
+
+    if(fgets(magic, sizeof(magic), file) == NULL || strcmp(magic, STORE_MANIFEST_MAGIC "\n") != 0) {
+        log_msg(LOG_WARNING, "Ignoring %s, unknown format", path);
+        fclose(file);
+        return 0;
+    }
+
+    for(;;) {
+        struct store_segment entry;
+        long long base, length;
+
+        memset(&entry, 0, sizeof(entry));
+
+        if(fscanf(file, "%u %lld %lld %zu %zu", &entry.id, &base, &length, &entry.first_line, &entry.lines) != 5) {
+            break;
+        }
+        entry.base = base;
+        entry.length = length;
+
+        if(count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            struct store_segment* grown = realloc(*entries, capacity * sizeof(struct store_segment));
+
+            if(grown == NULL) {
+                break;
+            }
+            *entries = grown;
+        }
+
+        (*entries)[count++] = entry;
+    }
+
+    fclose(file);
+    return count;
+}
+
+/*
+ * Adds the segment to the table.  Readers may look it up as soon as it is
+ * there, so its base and the final length of the segment before it must
+ * be set.
+ */
+static void store_add_segment(struct store* st, struct store_segment* seg) {
+    pthread_rwlock_wrlock(&st->segments_lock);
+    st->segments[SEGMENT_SLOT(seg->id)] = seg;
+    st->last_segment = seg->id;
+    pthread_rwlock_unlock(&st->segments_lock);
+
+    st->active = seg;
+}
+
+/* Drops the oldest segments while the log is over its retention limit */
+static void store_retain(struct store* st) {
+    bool dropped = false;
+
+    while(st->retain_bytes > 0 && st->first_segment != st->last_segment) {
+        struct store_segment* seg = st->segments[SEGMENT_SLOT(st->first_segment)];
+
+        if(st->length - seg->base <= st->retain_bytes) {
+            break;
+        }
+
+        pthread_rwlock_wrlock(&st->segments_lock);
+        st->segments[SEGMENT_SLOT(seg->id)] = NULL;
+        st->first_segment++;
+        store_index_trim(st, st->segments[SEGMENT_SLOT(st->first_segment)]->first_line);
+        pthread_rwlock_unlock(&st->segments_lock);
+
+        log_msg(LOG_INFO, "Dropping segment %u of %s, %lld bytes", seg->id, st->path, (long long)seg->length);
+
+        segment_unlink(st, seg->id);
+        store_unpin(st, &(struct store_extent){ .segment = seg });
+        dropped = true;
+    }
+
+    if(dropped) {
+        store_publish(st);
+
+        if(store_save_manifest(st) != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) saving the manifest of %s", errno, strerror(errno), st->path);
+        }
+    }
+}
+
+/* Seals the active segment and starts the next one */
+static int store_roll(struct store* st) {
+    struct store_segment* sealed = st->active;
+
+    if(st->last_segment - st->first_segment + 1 >= STORE_SEGMENTS_MAX) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    /* Lines appended since the last store_sync() must not be lost with the sealed segment */
+    if(segment_save_index(st, sealed) != 0 || (st->durable && store_sync(st) != 0)) {
+        return -1;
+    }
+
+    struct store_segment* seg = segment_open(st, sealed->id + 1, O_CREAT | O_TRUNC);
+
+    if(seg == NULL) {
+        return -1;
+    }
+
+    store_add_segment(st, seg);
+
+    if(store_save_manifest(st) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) saving the manifest of %s", errno, strerror(errno), st->path);
+    }
+
+    store_retain(st);
+    return 0;
+}
+
+/* Without a manifest, the oldest segment is the lowest id found next to path */
+static unsigned int store_first_on_disk(const struct store* st) {
+    char dir_path[PATH_MAX];
+    char base_path[PATH_MAX];
+    unsigned int first = 0;
+    bool found = false;
+
+    snprintf(dir_path, sizeof(dir_path), "%s", st->path);
+    snprintf(base_path, sizeof(base_path), "%s", st->path);
+
+    const char* base = basename(base_path);
+    size_t base_len = strlen(base);
+    DIR* dir = opendir(dirname(dir_path));
+
+    if(dir == NULL) {
+        return 0;
+    }
+
+    struct dirent* entry;
+
+    while((entry = readdir(dir)) != NULL) {
+        unsigned int id;
+        int end = 0;
+
+        if(strncmp(entry->d_name, base, base_len) != 0 || entry->d_name[base_len] != '.' ||
+           sscanf(entry->d_name + base_len + 1, "%8u%n", &id, &end) != 1 || end != 8 ||
+           entry->d_name[base_len + 1 + end] != '\0') {
+            continue;
+        }
+
+        if(!found || id < first) {
+            first = id;
+            found = true;
+        }
+    }
+
+    closedir(dir);
+    return first;
+}
+
+/*
+ * Reopens the segments listed in the manifest without reading them, as
+ * long as their files and line offsets match it.  Returns the id of the
+ * first segment not covered.
+ */
+static unsigned int store_recover(struct store* st) {
+    struct store_segment* entries;
+    size_t count = store_load_manifest(st, &entries);
+    unsigned int id = count > 0 ? entries[0].id : store_first_on_disk(st);
+
+    st->first_segment = id;
+
+    for(size_t i = 0; i < count; ++i, ++id) {
+        struct store_segment* entry = &entries[i];
+        struct stat sb;
+
+        if(entry->id != id || entry->base != st->length || entry->first_line != st->line_count) {
+            break;
+        }
+
+        struct store_segment* seg = segment_open(st, id, 0);
+
+        if(seg == NULL) {
+            break;
+        }
+
+        if(fstat(seg->fd, &sb) != 0 || sb.st_size != entry->length ||
+           segment_load_index(st, seg, entry->length, entry->lines) != 0) {
+            log_msg(LOG_WARNING, "Segment %u of %s does not match the manifest, scanning it", id, st->path);
+
+            if(segment_scan(st, seg) != 0) {
+                close(seg->fd);
+                free(seg);
+                break;
+            }
+        }
+
+        store_add_segment(st, seg);
+    }
+
+    free(entries);
+    return id;
+}
+
+int store_open(struct store* st, const char* path, off_t segment_size, off_t retain_bytes) {
+    memset(st, 0, sizeof(struct store));
+    st->path = path;
+    st->segment_size = segment_size > 0 ? segment_size : STORE_SEGMENT_SIZE;
+    st->retain_bytes = retain_bytes;
+    st->at_line_start = true;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_rwlock_init(&st->segments_lock, NULL);
+
+    st->segments = calloc(STORE_SEGMENTS_MAX, sizeof(struct store_segment *));
+    st->line_chunks = calloc(STORE_INDEX_CHUNKS, sizeof(off_t *));
+
+    if(st->segments == NULL || st->line_chunks == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate the line index for %s", path);
+        return -1;
+    }
+
+    unsigned int id = store_recover(st);
+    unsigned int recovered = id - st->first_segment;
+    bool scanned = false;
+
+    /* Normally only the active segment of the last run is left, unless the manifest was lost */
+    for(;; ++id) {
+        struct store_segment* seg = segment_open(st, id, 0);
+
+        if(seg == NULL) {
+            break;
+        }
+
+        if(segment_scan(st, seg) != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) indexing segment %u of %s", errno, strerror(errno), id, path);
+            close(seg->fd);
+            free(seg);
+            return -1;
+        }
+
+        if(scanned && segment_save_index(st, st->active) != 0) {
+            log_msg(LOG_ERR, "Error %d (%s) saving the index of segment %u of %s", errno, strerror(errno),
+                    st->active->id, path);
+        }
+
+        store_add_segment(st, seg);
+        scanned = true;
+    }
+
+    if(st->active == NULL || recovered == id - st->first_segment) {
+        /* Everything found is sealed, append to a new segment */
+        struct store_segment* seg = segment_open(st, id, O_CREAT | O_TRUNC);
+
+        if(seg == NULL) {
+            log_msg(LOG_ERR, "Error %d (%s) creating segment %u of %s", errno, strerror(errno), id, path);
+            return -1;
+        }
+
+        store_add_segment(st, seg);
+    }
+
+    if(scanned && store_save_manifest(st) != 0) {
+        log_msg(LOG_ERR, "Error %d (%s) saving the manifest of %s", errno, strerror(errno), path);
+    }
+
+    store_retain(st);
+    store_publish(st);
+    st->synced_length = st->length;
+
+    log_msg(LOG_INFO, "Opened %s with %u segments (%u from the manifest), %zu lines, %lld bytes", path,
+            st->last_segment - st->first_segment + 1, recovered, st->line_count, (long long)st->length);
+    return 0;
+}
+
+void store_close(struct store* st, bool remove_files) {
+    if(st->segments) {
+        for(unsigned int id = st->first_segment; st->active; ++id) {
+            struct store_segment* seg = st->segments[SEGMENT_SLOT(id)];
+
+            if(remove_files) {
+                segment_unlink(st, id);
+            }
+            store_unpin(st, &(struct store_extent){ .segment = seg });
+
+            if(id == st->last_segment) {
+                break;
+            }
+        }
+        st->active = NULL;
+        free(st->segments);
+        st->segments = NULL;
+    }
+
+    if(remove_files) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s.manifest", st->path);
+        unlink(path);
+    }
+
+    if(st->line_chunks) {
+        for(size_t i = 0; i < STORE_INDEX_CHUNKS; ++i) {
+            free(st->line_chunks[i]);
+        }
+        free(st->line_chunks);
+        st->line_chunks = NULL;
+    }
+
+    free(st->hot);
+    st->hot = NULL;
+
+    pthread_rwlock_destroy(&st->segments_lock);
+    pthread_mutex_destroy(&st->lock);
+}
+
+static int store_write(struct store* st, struct iovec* iov, int count) {
+    struct store_segment* seg = st->active;
+
+    while(count > 0) {
+        ssize_t written = pwritev(seg->fd, iov, count, seg->length);
+
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        st->length += written;
+        seg->length += written;
+
+        while(count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Takes back an append that failed part way: the segment is truncated to
+ * where the append started, and the line index forgets what it recorded of
+ * it, so that neither holds bytes the other does not.  Nothing of the
+ * append was published yet.
+ */
+static void store_rollback(struct store* st, off_t length, size_t line_count, bool at_line_start) {
+    struct store_segment* seg = st->active;
+    off_t seg_length = seg->length - (st->length - length);
+    int saved_errno = errno;
+
+    if(ftruncate(seg->fd, seg_length) != 0) {
+        /* The next append writes over the leftover bytes, a recovery scan may still see them */
+        log_msg(LOG_ERR, "Error %d (%s) truncating %s after a failed append", errno, strerror(errno), st->path);
+    }
+
+    seg->length = seg_length;
+    st->length = length;
+    st->line_count = line_count;
+    st->at_line_start = at_line_start;
+    store_hot_reset(st);
+    errno = saved_errno;
+}
+
+int store_append(struct store* st, const struct iovec* iov, int iovcnt) {
+    struct iovec local[IOV_MAX];
+    int count = 0;
+
+    if(st->at_line_start && st->active->length >= st->segment_size && store_roll(st) != 0) {
+        /* Keep appending to the active segment */
+        log_msg(LOG_ERR, "Error %d (%s) starting a new segment of %s", errno, strerror(errno), st->path);
+    }
+
+    off_t length = st->length;
+    size_t line_count = st->line_count;
+    bool at_line_start = st->at_line_start;
+
+    for(int i = 0; i < iovcnt; ++i) {
+        if(iov[i].iov_len == 0) {
+            continue;
+        }
+
+        local[count++] = iov[i];
+
+        if(count == IOV_MAX) {
+            if(store_write(st, local, count) != 0) {
+                store_rollback(st, length, line_count, at_line_start);
+                return -1;
+            }
+            count = 0;
+        }
+    }
+
+    if(count > 0 && store_write(st, local, count) != 0) {
+        store_rollback(st, length, line_count, at_line_start);
+        return -1;
+    }
+
+    off_t offset = length;
+
+    if(st->hot) {
+        store_hot_append(st, offset, iov, iovcnt);
+    }
+
+    for(int i = 0; i < iovcnt; ++i) {
+        if(store_index(st, offset, iov[i].iov_base, iov[i].iov_len) != 0) {
+            store_rollback(st, length, line_count, at_line_start);
+            errno = ENOMEM;
+            return -1;
+        }
+        offset += iov[i].iov_len;
+    }
+
+    st->active->lines = st->line_count - st->active->first_line;
+    store_publish(st);
+    return 0;
+}
+
+int store_sync(struct store* st) {
+    if(st->synced_length == st->length) {
+        return 0;
+    }
+
+    if(fdatasync(st->active->fd) != 0) {
+        return -1;
+    }
+
+    /* Once per segment, for its directory entry and the manifest renamed along with it */
+    if(st->synced_dir_segment != st->active->id + 1) {
+        if(store_sync_dir(st) != 0) {
+            return -1;
+        }
+        st->synced_dir_segment = st->active->id + 1;
+    }
+
+    st->synced_length = st->length;
+    return 0;
+}
+
+void store_pin(struct store* st, off_t offset, off_t end, struct store_extent* ext) {
+    pthread_rwlock_rdlock(&st->segments_lock);
+
+    unsigned int lo = st->first_segment;
+    unsigned int hi = st->last_segment;
+
+    if(offset < st->segments[SEGMENT_SLOT(lo)]->base) {
+        offset = st->segments[SEGMENT_SLOT(lo)]->base;
+    }
+
+    /* Last segment starting at or before offset */
+    while(lo != hi) {
+        unsigned int mid = lo + (hi - lo + 1) / 2;
+
+        if(st->segments[SEGMENT_SLOT(mid)]->base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    struct store_segment* seg = st->segments[SEGMENT_SLOT(lo)];
+
+    /* Sealed segments have their final length, the active one is bounded by end alone */
+    if(lo != st->last_segment && seg->base + seg->length < end) {
+        end = seg->base + seg->length;
+    }
+
+    ext->offset = offset;
+
+    if(offset < end) {
+        __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+        ext->segment = seg;
+        ext->fd = seg->fd;
+        ext->file_offset = offset - seg->base;
+        ext->len = end - offset;
+    } else {
+        ext->segment = NULL;
+        ext->fd = -1;
+        ext->file_offset = 0;
+        ext->len = 0;
+    }
+
+    pthread_rwlock_unlock(&st->segments_lock);
+}
+
+void store_unpin(struct store* st, struct store_extent* ext) {
+    (void)st;
+    struct store_segment* seg = ext->segment;
+
+    if(seg == NULL) {
+        return;
+    }
+
+    ext->segment = NULL;
+
+    /* The last one out of a dropped segment closes it */
+    if(__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+int store_reopen(const struct store_extent* ext) {
+    char path[64];
+
+    /* Through /proc the file is reachable even once unlinked */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", ext->fd);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) reopening segment %u", errno, strerror(errno), ext->segment->id);
+    }
+
+    return fd;
+}
+
+int store_keep_hot(struct store* st, size_t size) {
+    st->hot = malloc(size);
+
+    if(st->hot == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate %zu bytes for the tail of %s", size, st->path);
+        return -1;
+    }
+
+    st->hot_size = size;
+    st->hot_base = st->length;
+    st->hot_limit = st->length;
+    return 0;
+}
+
+ssize_t store_send(struct store* st, int out_fd, off_t* offset, off_t end) {
+    if(st->hot && end - *offset <= STORE_HOT_SEND_MAX) {
+        char buf[STORE_HOT_SEND_MAX];
+
+        if(store_hot_copy(st, *offset, end, buf)) {
+            ssize_t sent = send(out_fd, buf, end - *offset, MSG_NOSIGNAL);
+
+            if(sent > 0) {
+                *offset += sent;
+            }
+            return sent;
+        }
+    }
+
+    return store_sendfile(st, out_fd, offset, end);
+}
+
+ssize_t store_sendfile(struct store* st, int out_fd, off_t* offset, off_t end) {
+    struct store_extent ext;
+
+    store_pin(st, *offset, end, &ext);
+    *offset = ext.offset;
+
+    if(ext.len == 0) {
+        return 0;
+    }
+
+    ssize_t sent = sendfile(out_fd, ext.fd, &ext.file_offset, ext.len);
+    int saved_errno = errno;
+
+    if(sent > 0) {
+        *offset += sent;
+    }
+
+    store_unpin(st, &ext);
+    errno = saved_errno;
+    return sent;
+}
+
+static void zerocopy_unmap(struct store* st, struct store_zerocopy_send* send) {
+    munmap(send->map, send->map_len);
+    store_unpin(st, &send->ext);
+}
+
+ssize_t store_send_zerocopy(struct store* st, int out_fd, off_t* offset, off_t end, struct store_zerocopy* zc) {
+    if(end - *offset < STORE_ZEROCOPY_MIN) {
+        return store_send(st, out_fd, offset, end);
+    }
+
+    if(zc->count == STORE_ZEROCOPY_PENDING && store_zerocopy_reap(st, out_fd, zc) != 0) {
+        return -1;
+    }
+
+    /* Completions lag behind, this part is sent without waiting for them */
+    if(zc->count == STORE_ZEROCOPY_PENDING) {
+        return store_sendfile(st, out_fd, offset, end);
+    }
+
+    struct store_zerocopy_send* send_slot = &zc->sends[(zc->head + zc->count) & (STORE_ZEROCOPY_PENDING - 1)];
+    struct store_extent* ext = &send_slot->ext;
+
+    store_pin(st, *offset, end, ext);
+    *offset = ext->offset;
+
+    if(ext->len == 0) {
+        return 0;
+    }
+
+    /* Mappings start on a page, the segment offset rarely does */
+    off_t page = ext->file_offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t skew = ext->file_offset - page;
+
+    send_slot->map_len = skew + ext->len;
+    send_slot->map = mmap(NULL, send_slot->map_len, PROT_READ, MAP_SHARED, ext->fd, page);
+
+    if(send_slot->map == MAP_FAILED) {
+        log_msg(LOG_ERR, "Error %d (%s) mapping segment %u", errno, strerror(errno), ext->segment->id);
+        store_unpin(st, ext);
+        return store_sendfile(st, out_fd, offset, end);
+    }
+
+    ssize_t sent = send(out_fd, (char *)send_slot->map + skew, ext->len, MSG_NOSIGNAL | MSG_ZEROCOPY);
+
+    if(sent < 0) {
+        int saved_errno = errno;
+        zerocopy_unmap(st, send_slot);
+
+        /* Out of the memory the kernel allows for pinned pages, copy instead */
+        if(saved_errno == ENOBUFS) {
+            return store_sendfile(st, out_fd, offset, end);
+        }
+
+        errno = saved_errno;
+        return -1;
+    }
+
+    send_slot->id = zc->next_id++;
+    send_slot->done = false;
+    ++zc->count;
+    *offset += sent;
+    return sent;
+}
+
+int store_zerocopy_reap(struct store* st, int fd, struct store_zerocopy* zc) {
+    for(;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+               !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+            if(err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                errno = err.ee_errno != 0 ? (int)err.ee_errno : EIO;
+                return -1;
+            }
+
+            /* Sends ee_info to ee_data completed, ids wrap around */
+            uint32_t range = err.ee_data - err.ee_info;
+
+            for(unsigned int i = 0; i < zc->count; ++i) {
+                struct store_zerocopy_send* send_slot = &zc->sends[(zc->head + i) & (STORE_ZEROCOPY_PENDING - 1)];
+
+                if(send_slot->id - err.ee_info <= range) {
+                    send_slot->done = true;
+                }
+            }
+
+            zc->completed += (unsigned long)range + 1;
+
+            if(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied += (unsigned long)range + 1;
+            }
+        }
+    }
+
+    while(zc->count > 0 && zc->sends[zc->head].done) {
+        zerocopy_unmap(st, &zc->sends[zc->head]);
+        zc->head = (zc->head + 1) & (STORE_ZEROCOPY_PENDING - 1);
+        --zc->count;
+    }
+
+    return 0;
+}
+
+void store_zerocopy_release(struct store* st, struct store_zerocopy* zc) {
+    while(zc->count > 0) {
+        zerocopy_unmap(st, &zc->sends[zc->head]);
+        zc->head = (zc->head + 1) & (STORE_ZEROCOPY_PENDING - 1);
+        --zc->count;
+    }
+}
+
+int store_seek(struct store* st, const struct store_snapshot* snap, size_t line, size_t line_offset,
+               off_t* offset) {
+    if(line >= snap->line_count - snap->first_line) {
+        return -1;
+    }
+
+    /* Entries up to the published line count were written before it */
+    line += snap->first_line;
+
+    /* The chunks of lines dropped since the snapshot may be gone */
+    pthread_rwlock_rdlock(&st->segments_lock);
+
+    if(line < st->segments[SEGMENT_SLOT(st->first_segment)]->first_line) {
+        pthread_rwlock_unlock(&st->segments_lock);
+        return -1;
+    }
+
+    off_t start = store_line_offset(st, line);
+    off_t end = line + 1 < snap->line_count ? store_line_offset(st, line + 1) : snap->length;
+
+    pthread_rwlock_unlock(&st->segments_lock);
+
+    if((off_t)line_offset >= end - start) {
+        return -1;
+    }
+
+    *offset = start + line_offset;
+    return 0;
+}
+
+void store_snapshot(const struct store* st, struct store_snapshot* snap) {
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+        snap->start = __atomic_load_n(&st->committed_start, __ATOMIC_RELAXED);
+        snap->length = __atomic_load_n(&st->committed_length, __ATOMIC_RELAXED);
+        snap->first_line = __atomic_load_n(&st->committed_first_line, __ATOMIC_RELAXED);
+        snap->line_count = __atomic_load_n(&st->committed_lines, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || seq != __atomic_load_n(&st->seq, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,267 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define STORE_INDEX_CHUNK_SHIFT 16
+#define STORE_INDEX_CHUNK_LINES (1 << STORE_INDEX_CHUNK_SHIFT)
+/* Chunks of retained lines indexed at the same time, a power of two */
+#define STORE_INDEX_CHUNKS (16 * 1024)
+
+/* Segments alive at the same time, a power of two */
+#define STORE_SEGMENTS_MAX (64 * 1024)
+#define STORE_SEGMENT_SIZE ((off_t)64 * 1024 * 1024)
+
+/* Bytes at the end of the log kept in memory by store_keep_hot() */
+#define STORE_HOT_SIZE (1024 * 1024)
+/* Sends up to this size are copied from the hot tail instead of using sendfile() */
+#define STORE_HOT_SEND_MAX (8 * 1024)
+/* Sends of at least this size go out with MSG_ZEROCOPY from store_send_zerocopy() */
+#define STORE_ZEROCOPY_MIN (64 * 1024)
+/* Zero-copy sends of one socket still waiting for their completion, a power of two */
+#define STORE_ZEROCOPY_PENDING 8
+
+/*
+ * One file of the log.  Segments are never rewritten: the last one is
+ * appended to until it reaches the segment size at a line boundary, then
+ * it is sealed and a new one started, so a line never spans two segments.
+ * base and first_line are the prefix sums of the bytes and lines of every
+ * segment before this one.
+ */
+struct store_segment {
+    unsigned int id;
+    int fd;
+    off_t base;
+    off_t length;
+    size_t first_line;
+    size_t lines;
+    /* One reference held by the store while the segment is live, one per pin */
+    unsigned int refs;
+};
+
+/*
+ * Append-only log kept open for the whole lifetime of the server, stored
+ * as numbered segment files "<path>.<id>".  The committed length and the
+ * start offset of every line are tracked in memory, so neither appends nor
+ * replays need to open or stat a file.  Offsets are positions in the
+ * logical stream across all segments.
+ *
+ * Sealed segments are listed in "<path>.manifest" and their line offsets
+ * saved next to them, so reopening only scans the last segment.  With a
+ * retention limit, the oldest segments are dropped once the log grows
+ * past it.
+ *
+ * Appends must be serialized by the caller using lock.  Readers never take
+ * it: store_snapshot() returns the committed range published through a
+ * sequence counter, and that range is immutable, so any number of replays
+ * can run in parallel with each other and with the writer.
+ */
+struct store {
+    const char* path;
+    pthread_mutex_t lock;
+    off_t segment_size;
+    off_t retain_bytes;
+
+    /* Writer side state, protected by lock */
+    off_t length;
+    size_t line_count;
+    /* false while the last committed line has no terminating newline yet */
+    bool at_line_start;
+    struct store_segment* active;
+    /*
+     * Set by the caller when appends are made durable with store_sync().
+     * Sealed segments, new segment files and the manifest are then synced
+     * as well.
+     */
+    bool durable;
+    off_t synced_length;
+    /* One past the id of the last segment whose directory entry was synced */
+    unsigned int synced_dir_segment;
+
+    /*
+     * Live segments by id modulo STORE_SEGMENTS_MAX, from first_segment to
+     * active.  The writer changes the table with segments_lock held for
+     * writing, readers look up segments with it held for reading.
+     */
+    pthread_rwlock_t segments_lock;
+    struct store_segment** segments;
+    unsigned int first_segment;
+    unsigned int last_segment;
+
+    /*
+     * Start offset of every retained line, in chunks of
+     * STORE_INDEX_CHUNK_LINES entries which are never moved once
+     * allocated.  Chunk n is kept at n modulo STORE_INDEX_CHUNKS, from
+     * index_base on; chunks wholly below the first retained line are
+     * freed with segments_lock held for writing when segments are dropped.
+     */
+    off_t** line_chunks;
+    size_t index_base;
+
+    /*
+     * Copy of the end of the log, hot_size bytes in a ring indexed by
+     * offset.  It holds [max(hot_base, hot_limit - hot_size), hot_limit),
+     * and hot_limit moves before the bytes it uncovers are overwritten, so
+     * a reader can tell whether what it copied was still intact.
+     */
+    char* hot;
+    size_t hot_size;
+    off_t hot_base;
+    off_t hot_limit;
+
+    /* Published state, odd seq means an update is in progress */
+    unsigned int seq;
+    off_t committed_start;
+    off_t committed_length;
+    size_t committed_first_line;
+    size_t committed_lines;
+};
+
+/* Retained range of the log, [start, length) holding lines [first_line, line_count) */
+struct store_snapshot {
+    off_t start;
+    off_t length;
+    size_t first_line;
+    size_t line_count;
+};
+
+/* Part of one segment pinned for reading */
+struct store_extent {
+    struct store_segment* segment;
+    int fd;
+    /* Logical offset, and the matching offset in the segment file */
+    off_t offset;
+    off_t file_offset;
+    size_t len;
+};
+
+/* A zero-copy send whose pages the kernel may still read */
+struct store_zerocopy_send {
+    struct store_extent ext;
+    void* map;
+    size_t map_len;
+    /* Notification id of the send, and whether its completion was reaped */
+    uint32_t id;
+    bool done;
+};
+
+/*
+ * Zero-copy sends of one socket.  Each keeps its segment pinned and its
+ * pages mapped until the completion covering its notification id has been
+ * reaped from the socket's error queue, in send order from head on.
+ */
+struct store_zerocopy {
+    struct store_zerocopy_send sends[STORE_ZEROCOPY_PENDING];
+    unsigned int head;
+    unsigned int count;
+    /* Id the kernel gives the next send that queues anything */
+    uint32_t next_id;
+    /* Sends completed, and how many of them the kernel had to copy after all */
+    unsigned long completed;
+    unsigned long copied;
+};
+
+/*
+ * Opens the log at path, recovering the segments of a previous run.  Zero
+ * segment_size uses STORE_SEGMENT_SIZE, zero retain_bytes keeps everything.
+ */
+extern int store_open(struct store* st, const char* path, off_t segment_size, off_t retain_bytes);
+
+extern void store_close(struct store* st, bool remove_files);
+
+/*
+ * Keeps the last size bytes appended from now on in memory, so small
+ * sends are served by a copy and a send() rather than pinning a segment
+ * for sendfile().  Call before the first append.
+ */
+extern int store_keep_hot(struct store* st, size_t size);
+
+/*
+ * Appends the iovecs at the end of the log with pwritev(), indexes any
+ * lines they contain and publishes the new committed length.
+ * Caller must hold lock.  Returns 0 on success, -1 with errno set otherwise,
+ * in which case the segment and the line index are back where they were.
+ */
+extern int store_append(struct store* st, const struct iovec* iov, int iovcnt);
+
+/*
+ * Makes everything appended so far durable with fdatasync() of the active
+ * segment.  Caller must hold lock.  Returns 0 on success, -1 with errno
+ * set otherwise.
+ */
+extern int store_sync(struct store* st);
+
+/*
+ * Pins the segment holding offset and describes the bytes from there to
+ * end or the end of the segment, whichever comes first.  An offset in a
+ * dropped segment moves to the first retained byte; len is 0 when nothing
+ * is left before end.  Every extent with a segment must be unpinned.
+ */
+extern void store_pin(struct store* st, off_t offset, off_t end, struct store_extent* ext);
+
+extern void store_unpin(struct store* st, struct store_extent* ext);
+
+/*
+ * Opens the segment pinned by ext again, read-only, for another process
+ * to map.  Works for a segment already dropped by retention as well.
+ * Returns the new descriptor or -1.
+ */
+extern int store_reopen(const struct store_extent* ext);
+
+/*
+ * Sends the bytes between *offset and end to out_fd, advancing *offset.
+ * Up to STORE_HOT_SEND_MAX bytes still in the hot tail go out with one
+ * send(), anything else with a single sendfile() call from the segment
+ * holding *offset.
+ */
+extern ssize_t store_send(struct store* st, int out_fd, off_t* offset, off_t end);
+
+/*
+ * Like store_send() but always with sendfile(), for senders that go over
+ * the same bytes for many sockets: the page cache is shared, a copy of the
+ * hot tail would be made per socket.
+ */
+extern ssize_t store_sendfile(struct store* st, int out_fd, off_t* offset, off_t end);
+
+/*
+ * Like store_send(), but sends of at least STORE_ZEROCOPY_MIN bytes go out
+ * with MSG_ZEROCOPY from the mapped segment, on a socket with SO_ZEROCOPY
+ * set.  Their completions are reaped when every pending slot of zc is
+ * taken, or by the caller with store_zerocopy_reap() once the socket
+ * reports an error; sendfile() takes over while the slots stay full.
+ */
+extern ssize_t store_send_zerocopy(struct store* st, int out_fd, off_t* offset, off_t end,
+                                   struct store_zerocopy* zc);
+
+/*
+ * Reads the completions queued on fd without blocking and releases the
+ * sends they cover.  Returns -1 with errno set if the error queue holds a
+ * real error rather than a completion.
+ */
+extern int store_zerocopy_reap(struct store* st, int fd, struct store_zerocopy* zc);
+
+/*
+ * Releases every send of zc, completed or not, once the socket is closed.
+ * The kernel holds its own references to pages still queued, and
+ * committed bytes are never rewritten, so nothing it sends can change.
+ */
+extern void store_zerocopy_release(struct store* st, struct store_zerocopy* zc);
+
+/*
+ * Resolves byte line_offset of line, counted from the first line of the
+ * snapshot, to an offset in the log with a lookup in the line index.
+ * Returns -1 if the snapshot holds no such line or byte.
+ */
+extern int store_seek(struct store* st, const struct store_snapshot* snap, size_t line, size_t line_offset,
+                      off_t* offset);
+
+/*
+ * Returns a consistent view of the retained range without taking the lock.
+ */
+extern void store_snapshot(const struct store* st, struct store_snapshot* snap);
+
+#endif /* STORE_H */
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+
+#include "commit.h"
+#include "conn.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "tail.h"
+
+#define TAIL_MAX_EVENTS 64
+
+struct tail_conn {
+    int fd;
+    /* Waiting for EPOLLOUT to send the rest */
+    bool blocked;
+    off_t offset;
+    uint64_t progress_ms;
+
+    /* Hand over stack, then the list of followers */
+    struct tail_conn* next;
+    LIST_ENTRY(tail_conn) conns;
+};
+
+LIST_HEAD(tail_list, tail_conn);
+
+static struct store* store;
+static struct obj_pool conn_pool;
+static struct tail_list followers;
+static pthread_t tail_id;
+static bool tail_started = false;
+static int epfd = -1;
+/* Signalled by tail_follow(), the commit listener and tail_stop() */
+static int wake_fd = -1;
+static int stopping;
+static int follower_count;
+static int notified;
+static struct tail_conn* handed_over;
+
+static void tail_close(struct tail_conn* conn) {
+    log_msg(LOG_INFO, "Tail: Closed connection %d", conn->fd);
+
+    close(conn->fd);
+    LIST_REMOVE(conn, conns);
+    obj_pool_free(&conn_pool, conn);
+    __atomic_sub_fetch(&follower_count, 1, __ATOMIC_RELAXED);
+}
+
+static int tail_arm(struct tail_conn* conn, bool blocked) {
+    if(conn->blocked == blocked) {
+        return 0;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | (blocked ? EPOLLOUT : 0), .data.ptr = conn };
+
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        log_msg(LOG_ERR, "Tail: Error %d (%s) on epoll_ctl()", errno, strerror(errno));
+        return -1;
+    }
+
+    conn->blocked = blocked;
+    return 0;
+}
+
+/* Sends everything committed past the follower's offset, until the socket is full */
+static int tail_push(struct tail_conn* conn) {
+    struct store_snapshot snap;
+    store_snapshot(store, &snap);
+
+    while(conn->offset < snap.length) {
+        /* Every follower sends the same bytes, from the page cache */
+        ssize_t sent = store_sendfile(store, conn->fd, &conn->offset, snap.length);
+
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return tail_arm(conn, true);
+            }
+
+            log_msg(LOG_ERR, "Tail: Error %d (%s) on sendfile()", errno, strerror(errno));
+            return -1;
+        }
+
+        if(sent == 0) {
+            break;
+        }
+
+        metrics_add(METRIC_BYTES_OUT, sent);
+        conn->progress_ms = conn_now_ms();
+    }
+
+    return tail_arm(conn, false);
+}
+
+/* Followers only listen, their input is dropped until they hang up */
+static int tail_drain(struct tail_conn* conn) {
+    char buffer[4096];
+
+    for(;;) {
+        ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+
+        if(n > 0) {
+            continue;
+        }
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+}
+
+static void tail_adopt(void) {
+    struct tail_conn* conn = __atomic_exchange_n(&handed_over, NULL, __ATOMIC_ACQUIRE);
+
+    while(conn) {
+        struct tail_conn* next = conn->next;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+
+        LIST_INSERT_HEAD(&followers, conn, conns);
+
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) != 0) {
+            log_msg(LOG_ERR, "Tail: Error %d (%s) on epoll_ctl()", errno, strerror(errno));
+            tail_close(conn);
+        } else if(tail_push(conn) != 0) {
+            tail_close(conn);
+        }
+
+        conn = next;
+    }
+}
+
+static void tail_handle_wake(void) {
+    uint64_t count;
+    ssize_t rc = read(wake_fd, &count, sizeof(count));
+    (void)rc;
+
+    /* Cleared before looking at the store, so a commit after this point signals again */
+    __atomic_store_n(&notified, 0, __ATOMIC_SEQ_CST);
+
+    tail_adopt();
+
+    struct tail_conn* conn = LIST_FIRST(&followers);
+
+    while(conn) {
+        struct tail_conn* next = LIST_NEXT(conn, conns);
+
+        if(!conn->blocked && tail_push(conn) != 0) {
+            tail_close(conn);
+        }
+        conn = next;
+    }
+}
+
+static void tail_evict_stalled(void) {
+    uint64_t now = conn_now_ms();
+    struct tail_conn* conn = LIST_FIRST(&followers);
+
+    while(conn) {
+        struct tail_conn* next = LIST_NEXT(conn, conns);
+
+        if(conn->blocked && now - conn->progress_ms > (uint64_t)conn_limits.stall_ms) {
+            log_msg(LOG_WARNING, "Tail: Evicting connection %d, stalled for %d ms", conn->fd, conn_limits.stall_ms);
+            metrics_add(METRIC_EVICTIONS, 1);
+            tail_close(conn);
+        }
+        conn = next;
+    }
+}
+
+static void *tail_thread(void *param) {
+    struct epoll_event events[TAIL_MAX_EVENTS];
+    int timeout = conn_limits.stall_ms > 0 ? (conn_limits.stall_ms / 4 > 10 ? conn_limits.stall_ms / 4 : 10) : -1;
+
+    log_msg(LOG_INFO, "Tail thread started working");
+
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(epfd, events, TAIL_MAX_EVENTS, timeout);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            log_msg(LOG_ERR, "Tail: Error %d (%s) on epoll_wait()", errno, strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n; ++i) {
+            if(events[i].data.ptr == &wake_fd) {
+                tail_handle_wake();
+                continue;
+            }
+
+            struct tail_conn* conn = (struct tail_conn *)events[i].data.ptr;
+            int rc = 0;
+
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                rc = -1;
+            } else if(events[i].events & EPOLLIN) {
+                rc = tail_drain(conn);
+            }
+
+            if(rc == 0 && (events[i].events & EPOLLOUT)) {
+                rc = tail_push(conn);
+            }
+
+            if(rc != 0) {
+                tail_close(conn);
+            }
+        }
+
+        if(timeout > 0) {
+            tail_evict_stalled();
+        }
+    }
+
+    tail_adopt();
+
+    while(!LIST_EMPTY(&followers)) {
+        tail_close(LIST_FIRST(&followers));
+    }
+
+    log_msg(LOG_INFO, "Tail thread finished working");
+    return param;
+}
+
+/* Commit listener, runs on the writer thread */
+static void tail_committed(void) {
+    if(__atomic_load_n(&follower_count, __ATOMIC_RELAXED) == 0 ||
+       __atomic_exchange_n(&notified, 1, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+
+    uint64_t one = 1;
+    ssize_t rc = write(wake_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+int tail_follow(int fd, off_t offset) {
+    if(!tail_started || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    /* Thread mode and io_uring sockets are blocking */
+    int flags = fcntl(fd, F_GETFL);
+
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        log_msg(LOG_ERR, "Tail: Error %d (%s) on fcntl()", errno, strerror(errno));
+        return -1;
+    }
+
+    struct tail_conn* conn = obj_pool_alloc(&conn_pool);
+
+    if(conn == NULL) {
+        log_msg(LOG_ERR, "Tail: out of memory");
+        return -1;
+    }
+
+    memset(conn, 0, sizeof(struct tail_conn));
+    conn->fd = fd;
+    conn->offset = offset;
+    conn->progress_ms = conn_now_ms();
+    __atomic_add_fetch(&follower_count, 1, __ATOMIC_RELAXED);
+
+    struct tail_conn* head = __atomic_load_n(&handed_over, __ATOMIC_RELAXED);
+
+    do {
+        conn->next = head;
+    } while(!__atomic_compare_exchange_n(&handed_over, &head, conn, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    uint64_t one = 1;
+    ssize_t rc = write(wake_fd, &one, sizeof(one));
+    (void)rc;
+
+    log_msg(LOG_INFO, "Connection %d is following %s", fd, store->path);
+    return 0;
+}
+
+int tail_start(struct store* st) {
+    store = st;
+    stopping = 0;
+    LIST_INIT(&followers);
+    obj_pool_init(&conn_pool, sizeof(struct tail_conn), 64);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(epfd < 0 || wake_fd < 0) {
+        log_msg(LOG_ERR, "Tail: Error %d (%s) on epoll_create1()", errno, strerror(errno));
+        tail_stop();
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wake_fd };
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) != 0) {
+        log_msg(LOG_ERR, "Tail: Error %d (%s) on epoll_ctl()", errno, strerror(errno));
+        tail_stop();
+        return -1;
+    }
+
+    if(pthread_create(&tail_id, NULL, tail_thread, NULL) != 0) {
+        log_msg(LOG_ERR, "Failed to create tail thread");
+        tail_stop();
+        return -1;
+    }
+
+    tail_started = true;
+    commit_set_listener(tail_committed);
+    return 0;
+}
+
+void tail_stop(void) {
+    if(tail_started) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+
+        if(pthread_join(tail_id, NULL) != 0) {
+            log_msg(LOG_ERR, "Failed to join tail thread");
+        }
+        tail_started = false;
+        commit_set_listener(NULL);
+    }
+
+    if(wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if(epfd != -1) {
+        close(epfd);
+        epfd = -1;
+    }
+    obj_pool_destroy(&conn_pool);
+}
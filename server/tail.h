@@ -0,0 +1,30 @@
+#ifndef TAIL_H
+#define TAIL_H
+
+#include <sys/types.h>
+
+#include "store.h"
+
+/*
+ * Followers of the log, served by a thread of their own.  A connection
+ * handed over with tail_follow() is replayed from its offset, then gets
+ * every batch pushed as soon as the commit writer has appended it.  All
+ * followers send straight from the store with sendfile(), so a batch is
+ * held once in the page cache no matter how many of them there are.
+ * Anything a follower sends is discarded.
+ */
+
+/* Starts the tail thread, before commit_start() */
+extern int tail_start(struct store* st);
+
+/* Closes every follower and stops the thread */
+extern void tail_stop(void);
+
+/*
+ * Hands fd over to the tail thread, which owns and eventually closes it.
+ * Can be called from any thread.  Returns -1 if the thread is not
+ * running, the caller still owns fd then.
+ */
+extern int tail_follow(int fd, off_t offset);
+
+#endif /* TAIL_H */
@@ -0,0 +1,1229 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "command.h"
+#include "commit.h"
+#include "conn.h"
+#include "framing.h"
+#include "handoff.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "shard.h"
+#include "store.h"
+#include "tail.h"
+#include "uring.h"
+
+#define URING_ENTRIES 256
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 64
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_REPLAY_CHUNK (64 * 1024)
+
+/*
+ * Operation encoded in the low bits of user_data, the rest is the connection
+ * (pool objects are 16 byte aligned)
+ */
+enum uring_op {
+    URING_OP_ACCEPT = 1,
+    URING_OP_ACCEPT_LOCAL,
+    URING_OP_WAKE,
+    URING_OP_SHUTDOWN,
+    URING_OP_CANCEL,
+    URING_OP_RECV,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_TIMEOUT,
+};
+
+#define URING_OP_MASK 15
+
+enum uring_conn_state {
+    URING_CONN_READING,
+    URING_CONN_COMMITTING,
+    URING_CONN_REPLAYING,
+};
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    struct io_uring_sqe* sqes;
+
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+struct uring_loop;
+
+struct uring_conn {
+    int fd;
+    enum uring_conn_state state;
+    /* Requests submitted for the connection that have not completed yet */
+    int inflight;
+    bool failed;
+    struct uring_loop* loop;
+
+    struct framer framer;
+
+    struct commit_req commit;
+    struct frame_batch batch;
+    struct iovec commit_iov[COMMIT_IOV_MAX];
+
+    /* Replay goes through a pooled buffer held only while replaying */
+    char* replay_buf;
+    size_t replay_cap;
+    size_t replay_len;
+    size_t replay_sent;
+    off_t replay_offset;
+    off_t replay_end;
+    uint64_t replay_start;
+    /* Segment read by the chunk in flight */
+    struct store_extent replay_extent;
+
+    LIST_ENTRY(uring_conn) conns;
+};
+
+LIST_HEAD(uring_conn_list, uring_conn);
+
+/* A ring and everything submitted to it, only touched by its own worker */
+struct uring_loop {
+    int index;
+    pthread_t thread_id;
+    /* Listening socket of the shard this ring accepts from, and the local one or -1 */
+    int listen_fd;
+    int local_fd;
+    struct uring ring;
+    struct uring_conn_list conns;
+
+    /* Bound on every replay send when a stall timeout is configured */
+    struct __kernel_timespec stall_ts;
+
+    /* Requests of any kind still waiting for their completion */
+    size_t inflight;
+    bool stopping;
+    /* The multishot accept is cancelled, a successor takes over the listeners */
+    bool draining;
+
+    struct io_uring_buf_ring* buf_ring;
+    char* bufs;
+    unsigned short buf_tail;
+
+    /* Signalled by the commit writer when completed is no longer empty */
+    int wake_fd;
+    uint64_t wake_count;
+    struct commit_req* completed;
+    size_t pending_commits;
+};
+
+static int shutdown_fd = -1;
+static struct store* store;
+static struct obj_pool conn_pool;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(struct uring* ring) {
+    if(ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->ring_ptr) {
+        munmap(ring->ring_ptr, ring->ring_size);
+    }
+    if(ring->fd != -1) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+}
+
+static int uring_init(struct uring* ring, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+
+    if(ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+
+    /* Completions are never dropped and both rings share one mapping */
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        uring_exit(ring);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+
+    if(ring->ring_ptr == MAP_FAILED) {
+        ring->ring_ptr = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+
+    char* ptr = ring->ring_ptr;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned int *)(ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(ptr + p.sq_off.ring_mask);
+    ring->cq_head = (unsigned int *)(ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+    /* Submission slots map one to one onto the sqe array */
+    unsigned int* array = (unsigned int *)(ptr + p.sq_off.array);
+    for(unsigned int i = 0; i < p.sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+/* Submits everything queued and waits for at least wait completions */
+static int uring_enter(struct uring* ring, unsigned int wait) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned int to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(to_submit == 0 && wait == 0) {
+        return 0;
+    }
+
+    return sys_io_uring_enter(ring->fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/*
+ * Returns a free sqe once at least reserve slots are available, submitting
+ * what is queued first if the submission ring is too full.  Linked requests
+ * reserve room for the whole chain with their first sqe, so the chain is
+ * never split across two submissions.
+ */
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring, unsigned int reserve) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(ring->sqe_tail - head + reserve > ring->sq_entries) {
+        if(uring_enter(ring, 0) < 0 && errno != EBUSY && errno != EINTR) {
+            return NULL;
+        }
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        if(ring->sqe_tail - head + reserve > ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ++ring->sqe_tail;
+    return sqe;
+}
+
+static uint64_t uring_tag(void* ptr, enum uring_op op) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static bool probe_ops(int ring_fd) {
+    static const uint8_t needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ,
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_LINK_TIMEOUT,
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, len);
+    bool supported = probe != NULL;
+
+    if(supported && sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        supported = false;
+    }
+
+    for(size_t i = 0; supported && i < sizeof(needed); ++i) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return supported;
+}
+
+static void loop_recycle_buf(struct uring_loop* loop, unsigned short bid) {
+    struct io_uring_buf* buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ++loop->buf_tail;
+
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Provided buffer rings came with multishot accept and IORING_ASYNC_CANCEL_ANY in 5.19 */
+static int loop_register_bufs(struct uring_loop* loop) {
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+
+    loop->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if(loop->buf_ring == MAP_FAILED) {
+        loop->buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if(sys_io_uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+
+    loop->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+
+    if(loop->bufs == NULL) {
+        return -1;
+    }
+
+    for(unsigned short i = 0; i < URING_BUF_COUNT; ++i) {
+        loop_recycle_buf(loop, i);
+    }
+
+    return 0;
+}
+
+bool uring_supported(void) {
+    struct uring_loop loop;
+
+    memset(&loop, 0, sizeof(loop));
+
+    if(uring_init(&loop.ring, 4) != 0) {
+        return false;
+    }
+
+    bool supported = probe_ops(loop.ring.fd) && loop_register_bufs(&loop) == 0;
+
+    uring_exit(&loop.ring);
+    if(loop.buf_ring) {
+        munmap(loop.buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(loop.bufs);
+
+    return supported;
+}
+
+static void conn_close(struct uring_loop* loop, struct uring_conn* conn) {
+    /* A follower's socket belongs to the tail thread now */
+    if(conn->fd != -1) {
+        log_msg(LOG_INFO, "Ring #%d: Closed connection %d", loop->index, conn->fd);
+        close(conn->fd);
+    }
+    LIST_REMOVE(conn, conns);
+
+    store_unpin(store, &conn->replay_extent);
+    buf_free(conn->replay_buf, conn->replay_cap);
+    framer_release(&conn->batch);
+    framer_destroy(&conn->framer);
+    obj_pool_free(&conn_pool, conn);
+    conn_closed();
+}
+
+static int conn_submit_recv(struct uring_loop* loop, struct uring_conn* conn, bool direct) {
+    size_t space = 0;
+    char* buffer = NULL;
+
+    /* No provided buffer left, receive straight into the framer */
+    if(direct && (buffer = framer_reserve(&conn->framer, &space)) == NULL) {
+        log_msg(LOG_ERR, "Connection %d: out of memory", conn->fd);
+        return -1;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, 1);
+
+    if(sqe == NULL) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->user_data = uring_tag(conn, URING_OP_RECV);
+
+    if(direct) {
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = space;
+    } else {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->len = URING_BUF_SIZE;
+    }
+
+    conn->state = URING_CONN_READING;
+    ++conn->inflight;
+    ++loop->inflight;
+    return 0;
+}
+
+/*
+ * Links a timeout to the send just queued: a client that does not take a
+ * whole chunk within the stall timeout gets its send cancelled and is evicted.
+ */
+static void conn_link_timeout(struct uring_loop* loop, struct uring_conn* conn, struct io_uring_sqe* send) {
+    if(conn_limits.stall_ms <= 0) {
+        return;
+    }
+
+    send->flags |= IOSQE_IO_LINK;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, 1);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->stall_ts;
+    sqe->len = 1;
+    sqe->user_data = uring_tag(conn, URING_OP_TIMEOUT);
+
+    conn->inflight += 1;
+    loop->inflight += 1;
+}
+
+/*
+ * Queues the next step of the replay: the rest of a partially sent chunk,
+ * or a read of the next chunk linked to its send.  Returns 1 when the
+ * replay is complete.
+ */
+static int conn_replay(struct uring_loop* loop, struct uring_conn* conn) {
+    struct io_uring_sqe* sqe;
+    unsigned int timeout = conn_limits.stall_ms > 0;
+
+    if(conn->replay_sent < conn->replay_len) {
+        if((sqe = uring_get_sqe(&loop->ring, 1 + timeout)) == NULL) {
+            return -1;
+        }
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(conn->replay_buf + conn->replay_sent);
+        sqe->len = conn->replay_len - conn->replay_sent;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = uring_tag(conn, URING_OP_SEND);
+
+        conn->inflight += 1;
+        loop->inflight += 1;
+        conn_link_timeout(loop, conn, sqe);
+        return 0;
+    }
+
+    if(conn->replay_offset >= conn->replay_end) {
+        return 1;
+    }
+
+    /* Chunks stop at the end of a segment, which stays open until the read completes */
+    struct store_extent* ext = &conn->replay_extent;
+    store_pin(store, conn->replay_offset, conn->replay_end, ext);
+    conn->replay_offset = ext->offset;
+
+    if(ext->len == 0) {
+        return 1;
+    }
+
+    size_t n = ext->len < conn->replay_cap ? ext->len : conn->replay_cap;
+
+    if((sqe = uring_get_sqe(&loop->ring, 2 + timeout)) == NULL) {
+        store_unpin(store, ext);
+        return -1;
+    }
+
+    /* A short read breaks the link and cancels the send */
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = ext->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->replay_buf;
+    sqe->len = n;
+    sqe->off = ext->file_offset;
+    sqe->user_data = uring_tag(conn, URING_OP_READ);
+
+    sqe = uring_get_sqe(&loop->ring, 1);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->replay_buf;
+    sqe->len = n;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uring_tag(conn, URING_OP_SEND);
+
+    conn->replay_len = 0;
+    conn->replay_sent = 0;
+    conn->replay_start = metrics_now();
+    conn->inflight += 2;
+    loop->inflight += 2;
+    conn_link_timeout(loop, conn, sqe);
+    return 0;
+}
+
+static int conn_received(struct uring_loop* loop, struct uring_conn* conn);
+
+/* Runs the replay until it has to wait for a completion, then goes back to reading */
+static int conn_continue(struct uring_loop* loop, struct uring_conn* conn) {
+    int rc = conn_replay(loop, conn);
+
+    if(rc < 0) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    if(rc == 0) {
+        return 0;
+    }
+
+    buf_free(conn->replay_buf, conn->replay_cap);
+    conn->replay_buf = NULL;
+    conn->replay_cap = 0;
+
+    /* The length sent up front no longer holds */
+    if(framer_binary(&conn->framer) && conn->replay_offset < conn->replay_end) {
+        log_msg(LOG_WARNING, "Connection %d: replay cut short by retention", conn->fd);
+        return -1;
+    }
+
+    /* Records left behind by the replay request, lines after a command */
+    if(framer_has_lines(&conn->framer)) {
+        return conn_received(loop, conn);
+    }
+
+    return conn_submit_recv(loop, conn, false);
+}
+
+/*
+ * Replays the whole log, or from the position of a seek command to its end.
+ * A malformed command or a seek past the log gets COMMAND_ERROR_REPLY instead.
+ */
+static int conn_start_replay(struct uring_loop* loop, struct uring_conn* conn, const struct command* cmd) {
+    struct store_snapshot snap;
+    store_snapshot(store, &snap);
+
+    conn->state = URING_CONN_REPLAYING;
+    conn->replay_offset = snap.start;
+    conn->replay_end = snap.length;
+    metrics_add(METRIC_REPLAYS, 1);
+    conn->replay_len = 0;
+    conn->replay_sent = 0;
+
+    bool error = cmd && cmd->type == COMMAND_INVALID;
+
+    if(cmd && cmd->type == COMMAND_SEEKTO &&
+       store_seek(store, &snap, cmd->line, cmd->offset, &conn->replay_offset) != 0) {
+        log_msg(LOG_WARNING, "Connection %d: cannot seek to %zu,%zu", conn->fd, cmd->line, cmd->offset);
+        error = true;
+    }
+
+    if(error) {
+        conn->replay_offset = snap.length;
+    }
+
+    bool binary = framer_binary(&conn->framer);
+
+    if(snap.length > conn->replay_offset || binary || error) {
+        off_t left = snap.length - conn->replay_offset;
+        size_t size = left < URING_REPLAY_CHUNK ? (size_t)left : URING_REPLAY_CHUNK;
+
+        /* Every chunk is a turn, completions of other connections are handled in between */
+        if(conn_limits.replay_quantum > 0 && size > (size_t)conn_limits.replay_quantum) {
+            size = conn_limits.replay_quantum;
+        }
+        if(size < sizeof(COMMAND_ERROR_REPLY)) {
+            size = sizeof(COMMAND_ERROR_REPLY);
+        }
+        conn->replay_buf = buf_alloc(size, &conn->replay_cap);
+
+        if(conn->replay_buf == NULL) {
+            log_msg(LOG_ERR, "Connection %d: out of memory", conn->fd);
+            return -1;
+        }
+    }
+
+    /* The error, or the length, goes out first like the rest of a partially sent chunk */
+    if(error) {
+        conn->replay_len = sizeof(COMMAND_ERROR_REPLY) - 1;
+        memcpy(conn->replay_buf, COMMAND_ERROR_REPLY, conn->replay_len);
+        conn->replay_start = metrics_now();
+    } else if(binary) {
+        framer_reply_header(conn->replay_buf, snap.length - conn->replay_offset);
+        conn->replay_len = FRAMER_REPLY_HEADER;
+        conn->replay_start = metrics_now();
+    }
+
+    return conn_continue(loop, conn);
+}
+
+/* Called from the commit writer thread */
+static void conn_commit_done(struct commit_req* req) {
+    struct uring_conn* conn = (struct uring_conn *)req->arg;
+    struct uring_loop* loop = conn->loop;
+    struct commit_req* head = __atomic_load_n(&loop->completed, __ATOMIC_RELAXED);
+
+    do {
+        req->next = head;
+    } while(!__atomic_compare_exchange_n(&loop->completed, &head, req, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(head == NULL) {
+        uint64_t one = 1;
+        ssize_t rc = write(loop->wake_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+static void conn_committed(struct uring_loop* loop, struct uring_conn* conn) {
+    --loop->pending_commits;
+
+    bool replay = conn->batch.replay;
+    framer_release(&conn->batch);
+
+    if(conn->commit.result != 0 || caught_signal ||
+       (replay ? conn_start_replay(loop, conn, NULL) : conn_received(loop, conn)) != 0) {
+        conn->failed = true;
+    }
+
+    if(conn->failed && conn->inflight == 0) {
+        conn_close(loop, conn);
+    }
+}
+
+static void loop_handle_completions(struct uring_loop* loop) {
+    struct commit_req* req = __atomic_exchange_n(&loop->completed, NULL, __ATOMIC_ACQUIRE);
+
+    while(req) {
+        struct commit_req* next = req->next;
+        conn_committed(loop, (struct uring_conn *)req->arg);
+        req = next;
+    }
+}
+
+static int conn_frame(struct uring_conn* conn, const char* data, size_t len) {
+    while(len > 0) {
+        size_t space;
+        char* buffer = framer_reserve(&conn->framer, &space);
+
+        if(buffer == NULL) {
+            log_msg(LOG_ERR, "Connection %d: out of memory", conn->fd);
+            return -1;
+        }
+
+        size_t n = len < space ? len : space;
+        memcpy(buffer, data, n);
+        framer_fill(&conn->framer, n);
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Hands the complete lines received so far to the commit writer; the replay
+ * starts once they are committed.  Chunks without a newline are replayed
+ * right away.  Binary records are taken batch by batch up to the next one
+ * asking for a replay, and nothing is replayed until one does; text lines up
+ * to the next command, which is handled once they are.
+ */
+static int conn_received(struct uring_loop* loop, struct uring_conn* conn) {
+    bool binary = framer_binary(&conn->framer);
+
+    if(!framer_has_lines(&conn->framer)) {
+        return framer_text(&conn->framer) ? conn_start_replay(loop, conn, NULL) : conn_submit_recv(loop, conn, false);
+    }
+
+    int iovcnt = framer_take(&conn->framer, &conn->batch, conn->commit_iov, COMMIT_IOV_MAX);
+
+    if(iovcnt < 0) {
+        log_msg(LOG_ERR, "Connection %d: Error %d (%s) framing lines", conn->fd, errno, strerror(errno));
+        return -1;
+    }
+
+    /* Commands are not appended */
+    struct command cmd = { .type = COMMAND_NONE };
+    struct store_snapshot snap;
+
+    if(!binary) {
+        command_parse(conn->commit_iov, iovcnt, conn->batch.len, &cmd);
+    }
+
+    switch(cmd.type) {
+    case COMMAND_NONE:
+        break;
+    case COMMAND_INVALID:
+        log_msg(LOG_WARNING, "Connection %d: malformed command", conn->fd);
+        /* fall through */
+    case COMMAND_SEEKTO:
+        framer_release(&conn->batch);
+        return conn_start_replay(loop, conn, &cmd);
+    case COMMAND_SUBSCRIBE:
+        /* Nothing else is in flight on the socket, the tail thread takes it over */
+        framer_release(&conn->batch);
+        store_snapshot(store, &snap);
+
+        if(tail_follow(conn->fd, snap.start) == 0) {
+            metrics_add(METRIC_REPLAYS, 1);
+            conn->fd = -1;
+        }
+        return -1;
+    }
+
+    /* Empty records, at most asking for a replay */
+    if(iovcnt == 0) {
+        bool replay = conn->batch.replay;
+        framer_release(&conn->batch);
+        return replay ? conn_start_replay(loop, conn, NULL) : conn_received(loop, conn);
+    }
+
+    conn->commit.iov = conn->commit_iov;
+    conn->commit.iovcnt = iovcnt;
+    conn->commit.complete = conn_commit_done;
+    conn->commit.arg = conn;
+    conn->state = URING_CONN_COMMITTING;
+
+    ++loop->pending_commits;
+
+    if(commit_submit(&conn->commit) != 0) {
+        log_msg(LOG_ERR, "Connection %d: failed to append to %s", conn->fd, out_filepath);
+        --loop->pending_commits;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int conn_handle_recv(struct uring_loop* loop, struct uring_conn* conn, int res, uint32_t flags) {
+    if(res == -ENOBUFS) {
+        return conn_submit_recv(loop, conn, true);
+    }
+
+    int rc = -1;
+
+    if(res > 0) {
+        metrics_add(METRIC_BYTES_IN, res);
+    }
+
+    if(res < 0) {
+        if(res != -ECANCELED) {
+            log_msg(LOG_ERR, "Connection %d: Error %d (%s) on recv()", conn->fd, -res, strerror(-res));
+        }
+    } else if(flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if(res > 0) {
+            rc = conn_frame(conn, loop->bufs + (size_t)bid * URING_BUF_SIZE, res);
+        }
+        loop_recycle_buf(loop, bid);
+    } else if(res > 0) {
+        framer_fill(&conn->framer, res);
+        rc = 0;
+    }
+
+    if(rc == 0 && !caught_signal) {
+        rc = conn_received(loop, conn);
+    }
+
+    return rc;
+}
+
+static void conn_handle(struct uring_loop* loop, struct uring_conn* conn, enum uring_op op, int res, uint32_t flags) {
+    --conn->inflight;
+
+    switch(op) {
+    case URING_OP_RECV:
+        if(conn->failed || conn_handle_recv(loop, conn, res, flags) != 0) {
+            conn->failed = true;
+        }
+        break;
+    case URING_OP_READ:
+        store_unpin(store, &conn->replay_extent);
+
+        if(res <= 0) {
+            if(res < 0 && res != -ECANCELED) {
+                log_msg(LOG_ERR, "Error %d (%s) on read()", -res, strerror(-res));
+            }
+            conn->failed = true;
+        } else {
+            conn->replay_len = res;
+            conn->replay_offset += res;
+        }
+        break;
+    case URING_OP_SEND:
+        if(res == -ECANCELED) {
+            /* The linked read came up short, its data is sent on its own, or the send timed out */
+        } else if(res < 0) {
+            log_msg(LOG_ERR, "Error %d (%s) on send()", -res, strerror(-res));
+            conn->failed = true;
+        } else {
+            conn->replay_sent += res;
+            metrics_add(METRIC_BYTES_OUT, res);
+
+            if(conn->replay_sent == conn->replay_len) {
+                metrics_observe(METRIC_SEND, conn->replay_start);
+            }
+        }
+        break;
+    case URING_OP_TIMEOUT:
+        if(res == -ETIME) {
+            log_msg(LOG_WARNING, "Ring #%d: Evicting connection %d, stalled for %d ms", loop->index, conn->fd,
+                    conn_limits.stall_ms);
+            metrics_add(METRIC_EVICTIONS, 1);
+            conn->failed = true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if(caught_signal) {
+        conn->failed = true;
+    }
+
+    /* Both halves of a linked read and send have completed, in either order */
+    if(op != URING_OP_RECV && conn->inflight == 0 && !conn->failed && conn_continue(loop, conn) != 0) {
+        conn->failed = true;
+    }
+
+    /* The writer still references the connection until its commit completes */
+    if(conn->failed && conn->inflight == 0 && conn->state != URING_CONN_COMMITTING) {
+        conn_close(loop, conn);
+    }
+}
+
+static int loop_submit_accept(struct uring_loop* loop, bool local) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, 1);
+
+    if(sqe == NULL) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = local ? loop->local_fd : loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(NULL, local ? URING_OP_ACCEPT_LOCAL : URING_OP_ACCEPT);
+
+    ++loop->inflight;
+    return 0;
+}
+
+static int loop_submit_wake(struct uring_loop* loop) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, 1);
+
+    if(sqe == NULL) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->wake_count;
+    sqe->len = sizeof(loop->wake_count);
+    sqe->user_data = uring_tag(NULL, URING_OP_WAKE);
+
+    ++loop->inflight;
+    return 0;
+}
+
+/* Cancels the multishot accepts, queued connections are left to the successor */
+static void loop_stop_accepting(struct uring_loop* loop) {
+    int count = loop->local_fd != -1 ? 2 : 1;
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, count);
+
+    if(sqe == NULL) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_tag(NULL, URING_OP_ACCEPT);
+    sqe->user_data = uring_tag(NULL, URING_OP_CANCEL);
+    ++loop->inflight;
+
+    if(count > 1) {
+        sqe = uring_get_sqe(&loop->ring, 1);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = uring_tag(NULL, URING_OP_ACCEPT_LOCAL);
+        sqe->user_data = uring_tag(NULL, URING_OP_CANCEL);
+        ++loop->inflight;
+    }
+
+    loop->draining = true;
+}
+
+static void loop_handle_accept(struct uring_loop* loop, bool local, int res, uint32_t flags) {
+    if(!(flags & IORING_CQE_F_MORE)) {
+        --loop->inflight;
+
+        if(!loop->stopping && !loop->draining && !caught_signal) {
+            loop_submit_accept(loop, local);
+        }
+    } else if(handoff_draining && !loop->draining && !loop->stopping) {
+        loop_stop_accepting(loop);
+    }
+
+    if(res < 0) {
+        if(res != -ECANCELED && !caught_signal) {
+            log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on accept()", loop->index, -res, strerror(-res));
+        }
+        return;
+    }
+
+    if(loop->stopping) {
+        close(res);
+        return;
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    char ip[INET_ADDRSTRLEN] = "local";
+
+    if(!local && getpeername(res, (struct sockaddr*)&client_addr, &client_len) == 0) {
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+    }
+
+    log_msg(LOG_INFO, "Ring #%d: Accepted connection from %s", loop->index, ip);
+    metrics_add(METRIC_CONNECTIONS, 1);
+
+    struct uring_conn* conn = obj_pool_alloc(&conn_pool);
+
+    if(conn == NULL) {
+        log_msg(LOG_ERR, "Ring #%d: out of memory", loop->index);
+        close(res);
+        return;
+    }
+
+    memset(conn, 0, sizeof(struct uring_conn));
+    conn_opened();
+    conn->fd = res;
+    conn->loop = loop;
+    framer_init(&conn->framer);
+    conn_apply_limits(res, local);
+    LIST_INSERT_HEAD(&loop->conns, conn, conns);
+
+    if(conn_submit_recv(loop, conn, false) != 0) {
+        conn_close(loop, conn);
+    }
+}
+
+static void loop_handle_cqe(struct uring_loop* loop, uint64_t user_data, int res, uint32_t flags) {
+    enum uring_op op = (enum uring_op)(user_data & URING_OP_MASK);
+    void* ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch(op) {
+    case URING_OP_ACCEPT:
+    case URING_OP_ACCEPT_LOCAL:
+        loop_handle_accept(loop, op == URING_OP_ACCEPT_LOCAL, res, flags);
+        return;
+    case URING_OP_WAKE:
+        --loop->inflight;
+        loop_handle_completions(loop);
+        if(!loop->stopping) {
+            loop_submit_wake(loop);
+        }
+        return;
+    case URING_OP_SHUTDOWN:
+    case URING_OP_CANCEL:
+        --loop->inflight;
+        return;
+    default:
+        --loop->inflight;
+        conn_handle(loop, (struct uring_conn *)ptr, op, res, flags);
+        return;
+    }
+}
+
+static void loop_reap(struct uring_loop* loop) {
+    struct uring* ring = &loop->ring;
+
+    for(;;) {
+        unsigned int head = *ring->cq_head;
+
+        if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        loop_handle_cqe(loop, user_data, res, flags);
+    }
+}
+
+/* Cancels everything still pending on the ring, connections close as their requests complete */
+static void loop_stop(struct uring_loop* loop) {
+    loop->stopping = true;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, 1);
+
+    if(sqe == NULL) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = uring_tag(NULL, URING_OP_CANCEL);
+
+    ++loop->inflight;
+}
+
+static void *worker_start(void *param) {
+    struct uring_loop* loop = (struct uring_loop *)param;
+
+    log_msg(LOG_INFO, "Ring #%d started working", loop->index);
+
+    while(!loop->stopping || loop->inflight > 0) {
+        if(caught_signal && !loop->stopping) {
+            loop_stop(loop);
+        }
+
+        if(uring_enter(&loop->ring, 1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_enter()", loop->index, errno, strerror(errno));
+            break;
+        }
+
+        loop_reap(loop);
+    }
+
+    log_msg(LOG_INFO, "Ring #%d finished working", loop->index);
+    return param;
+}
+
+/* Runs once the worker has exited, nothing else touches the loop anymore */
+static void loop_drain(struct uring_loop* loop) {
+    while(loop->pending_commits > 0) {
+        struct pollfd pfd = { .fd = loop->wake_fd, .events = POLLIN };
+
+        if(poll(&pfd, 1, -1) > 0) {
+            uint64_t count;
+            ssize_t rc = read(loop->wake_fd, &count, sizeof(count));
+            (void)rc;
+            loop_handle_completions(loop);
+        }
+    }
+
+    while(!LIST_EMPTY(&loop->conns)) {
+        conn_close(loop, LIST_FIRST(&loop->conns));
+    }
+}
+
+static void loop_destroy(struct uring_loop* loop) {
+    if(loop->wake_fd != -1) {
+        loop_drain(loop);
+        close(loop->wake_fd);
+    }
+
+    uring_exit(&loop->ring);
+
+    if(loop->buf_ring) {
+        munmap(loop->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(loop->bufs);
+}
+
+static int loop_init(struct uring_loop* loop, int index, int listen_fd, int local_fd) {
+    loop->index = index;
+    loop->listen_fd = listen_fd;
+    loop->local_fd = local_fd;
+    LIST_INIT(&loop->conns);
+    loop->stall_ts.tv_sec = conn_limits.stall_ms / 1000;
+    loop->stall_ts.tv_nsec = conn_limits.stall_ms % 1000 * 1000000LL;
+
+    if(uring_init(&loop->ring, URING_ENTRIES) != 0) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_setup()", index, errno, strerror(errno));
+        return -1;
+    }
+
+    if(loop_register_bufs(loop) != 0) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on io_uring_register()", index, errno, strerror(errno));
+        return -1;
+    }
+
+    /* Blocking, io_uring waits for it to become readable by itself */
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+
+    if(loop->wake_fd < 0) {
+        log_msg(LOG_ERR, "Ring #%d: Error %d (%s) on eventfd()", index, errno, strerror(errno));
+        return -1;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring, 1);
+
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    /* A poll rather than a read, so every ring sees it */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shutdown_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(NULL, URING_OP_SHUTDOWN);
+    ++loop->inflight;
+
+    if(loop_submit_wake(loop) != 0 || loop_submit_accept(loop, false) != 0 ||
+       (local_fd != -1 && loop_submit_accept(loop, true) != 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int uring_wakeup(void) {
+    if(shutdown_fd == -1) {
+        return -1;
+    }
+
+    uint64_t one = 1;
+    ssize_t rc = write(shutdown_fd, &one, sizeof(one));
+    (void)rc;
+    return 0;
+}
+
+int uring_run(const struct shards* listeners, int worker_count, bool pin, struct store* data_store) {
+    int ret_code = 0;
+    int started = 0;
+    int efd;
+
+    struct uring_loop* loops = calloc(worker_count, sizeof(struct uring_loop));
+
+    if(loops == NULL) {
+        log_msg(LOG_ERR, "Failed to allocate %d rings", worker_count);
+        return -1;
+    }
+
+    for(int i = 0; i < worker_count; ++i) {
+        loops[i].ring.fd = -1;
+        loops[i].wake_fd = -1;
+    }
+
+    store = data_store;
+    obj_pool_init(&conn_pool, sizeof(struct uring_conn), 64);
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(efd < 0) {
+        log_msg(LOG_ERR, "Error %d (%s) on eventfd()", errno, strerror(errno));
+        ret_code = -1;
+        goto cleanup;
+    }
+
+    shutdown_fd = efd;
+
+    for(int i = 0; i < worker_count; ++i) {
+        if(loop_init(&loops[i], i, listeners->fds[shard_for_loop(listeners, i)], listeners->local_fd) != 0) {
+            ret_code = -1;
+            goto cleanup;
+        }
+    }
+
+    for(; started < worker_count; ++started) {
+        int rc = pthread_create(&loops[started].thread_id, NULL, worker_start, &loops[started]);
+
+        if(rc != 0) {
+            log_msg(LOG_ERR, "Failed to create worker thread");
+            ret_code = -1;
+            break;
+        }
+
+        if(pin) {
+            shard_pin(loops[started].thread_id, started);
+        }
+    }
+
+    log_msg(LOG_INFO, "Running %d io_uring workers on %d listeners", started, listeners->count);
+
+cleanup:
+    if(ret_code != 0) {
+        caught_signal = 1;
+        uring_wakeup();
+    }
+
+    for(int i = 0; i < started; ++i) {
+        int join_rc = pthread_join(loops[i].thread_id, NULL);
+
+        if(join_rc != 0) {
+            log_msg(LOG_ERR, "Failed to join ring #%d", i);
+        }
+    }
+
+    for(int i = 0; i < worker_count; ++i) {
+        loop_destroy(&loops[i]);
+    }
+    free(loops);
+
+    obj_pool_destroy(&conn_pool);
+
+    if(shutdown_fd != -1) {
+        efd = shutdown_fd;
+        shutdown_fd = -1;
+        close(efd);
+    }
+
+    return ret_code;
+}
@@ -0,0 +1,35 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+
+#include "shard.h"
+#include "store.h"
+
+/*
+ * io_uring backend: every worker owns a ring with a multishot accept on its
+ * listener shard, receives into a ring of provided buffers and replays the
+ * store with linked read and send requests, so a connection costs no
+ * syscalls of its own between accept and close.
+ */
+
+/*
+ * Returns true if the running kernel supports everything the backend needs
+ * (provided buffer rings, multishot accept, any-request cancellation).
+ */
+extern bool uring_supported(void);
+
+/*
+ * Ring i accepts from shard i of listeners and every ring from the local
+ * listener; with pin set, its worker is pinned to the i-th CPU.  Blocks until caught_signal is set and all
+ * workers have exited.
+ */
+extern int uring_run(const struct shards* listeners, int worker_count, bool pin, struct store* store);
+
+/*
+ * Wakes up every running ring so it notices caught_signal.
+ * Async-signal-safe.  Returns -1 if the backend is not running.
+ */
+extern int uring_wakeup(void);
+
+#endif /* URING_H */
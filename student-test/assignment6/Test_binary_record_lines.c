@@ -0,0 +1,171 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../server/framing.h"
+#include "../../server/store.h"
+
+#define RECORD_IOV_MAX 16
+
+static char store_dir[] = "/tmp/aesd-record-lines-XXXXXX";
+static char store_path[sizeof(store_dir) + 8];
+
+/**
+* Feeds @param len bytes of @param data to @param framer as one read.
+*/
+static void framer_feed(struct framer *framer, const char *data, size_t len)
+{
+    size_t space;
+    char *buffer = framer_reserve(framer, &space);
+
+    TEST_ASSERT_NOT_NULL(buffer);
+    TEST_ASSERT_TRUE(len <= space);
+    memcpy(buffer, data, len);
+    framer_fill(framer, len);
+}
+
+/**
+* Appends the record of @param len bytes at @param data the way a binary connection would.
+*/
+static void append_record(struct store *store, const char *data, uint32_t len)
+{
+    struct framer framer;
+    struct frame_batch batch;
+    struct iovec iov[RECORD_IOV_MAX];
+    unsigned char header[FRAMER_RECORD_HEADER];
+    uint32_t flagged = len | FRAMER_RECORD_REPLAY;
+    int count;
+
+    header[0] = flagged >> 24;
+    header[1] = flagged >> 16;
+    header[2] = flagged >> 8;
+    header[3] = flagged;
+
+    framer_init(&framer);
+    framer_feed(&framer, FRAMER_BINARY_HELLO, sizeof(FRAMER_BINARY_HELLO) - 1);
+    TEST_ASSERT_TRUE_MESSAGE(framer_binary(&framer), "The hello did not switch to binary framing");
+    framer_feed(&framer, (const char *)header, sizeof(header));
+    framer_feed(&framer, data, len);
+
+    count = framer_take(&framer, &batch, iov, RECORD_IOV_MAX);
+    TEST_ASSERT_TRUE(count > 0);
+    TEST_ASSERT_TRUE(batch.replay);
+    TEST_ASSERT_EQUAL_INT(0, store_append(store, iov, count));
+
+    framer_release(&batch);
+    framer_destroy(&framer);
+}
+
+/**
+* Appends the complete lines in @param text the way a text connection would.
+*/
+static void append_text(struct store *store, const char *text)
+{
+    struct framer framer;
+    struct frame_batch batch;
+    struct iovec iov[RECORD_IOV_MAX];
+    int count;
+
+    framer_init(&framer);
+    framer_feed(&framer, text, strlen(text));
+    TEST_ASSERT_TRUE_MESSAGE(framer_text(&framer), "A text line was not taken for text");
+
+    count = framer_take(&framer, &batch, iov, RECORD_IOV_MAX);
+    TEST_ASSERT_TRUE(count > 0);
+    TEST_ASSERT_EQUAL_INT(0, store_append(store, iov, count));
+
+    framer_release(&batch);
+    framer_destroy(&framer);
+}
+
+/**
+* Checks that line @param line of @param store starts with @param expected.
+*/
+static void assert_seek(struct store *store, size_t line, const char *expected)
+{
+    struct store_snapshot snap;
+    struct store_extent ext;
+    char buffer[64];
+    off_t offset;
+    size_t len = strlen(expected);
+
+    store_snapshot(store, &snap);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, store_seek(store, &snap, line, 0, &offset), "A line could not be sought");
+
+    store_pin(store, offset, offset + len, &ext);
+    TEST_ASSERT_EQUAL(len, ext.len);
+    TEST_ASSERT_EQUAL((ssize_t)len, pread(ext.fd, buffer, len, ext.file_offset));
+    store_unpin(store, &ext);
+
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, buffer, len, "A seek landed on the wrong line");
+}
+
+/**
+* A binary record not ending with a newline is stored as a line of its own, so text written after
+* it is sought by the line number a reader counts, segments still roll, and the index rebuilt on
+* reopen agrees.
+*/
+void test_binary_record_ends_a_line()
+{
+    struct store store;
+    struct store_snapshot snap;
+    unsigned int first_segment;
+    off_t offset;
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(store_dir));
+    strcpy(store_path, store_dir);
+    strcat(store_path, "/data");
+    TEST_ASSERT_EQUAL_INT(0, store_open(&store, store_path, 16, 0));
+    first_segment = store.last_segment;
+
+    append_record(&store, "binary", 6);
+    TEST_ASSERT_TRUE_MESSAGE(store.at_line_start, "A record left its line open");
+    append_text(&store, "text\n");
+    append_record(&store, "two\nlines", 9);
+    append_text(&store, "last\n");
+
+    store_snapshot(&store, &snap);
+    TEST_ASSERT_EQUAL_MESSAGE(5, snap.line_count, "Records were not counted as lines");
+    TEST_ASSERT_EQUAL(27, snap.length);
+    TEST_ASSERT_TRUE_MESSAGE(store.last_segment > first_segment, "Segments stopped rolling after a record");
+
+    assert_seek(&store, 0, "binary\n");
+    assert_seek(&store, 1, "text\n");
+    assert_seek(&store, 2, "two\n");
+    assert_seek(&store, 3, "lines\n");
+    assert_seek(&store, 4, "last\n");
+    TEST_ASSERT_EQUAL_INT(-1, store_seek(&store, &snap, 0, 7, &offset));
+
+    store_close(&store, false);
+    TEST_ASSERT_EQUAL_INT(0, store_open(&store, store_path, 16, 0));
+    store_snapshot(&store, &snap);
+    TEST_ASSERT_EQUAL_MESSAGE(5, snap.line_count, "Reopening counted other lines");
+    assert_seek(&store, 1, "text\n");
+    assert_seek(&store, 3, "lines\n");
+
+    store_close(&store, true);
+    rmdir(store_dir);
+}
+
+/**
+* Only a leading NUL can start the binary hello, a text client sending the start of
+* "AESDCHAR_BINARY" is taken for text as soon as its first byte arrives.
+*/
+void test_binary_hello_needs_leading_nul()
+{
+    struct framer framer;
+
+    framer_init(&framer);
+    framer_feed(&framer, "AESD", 4);
+    TEST_ASSERT_TRUE_MESSAGE(framer_text(&framer), "A text prefix of the hello was held back");
+    framer_destroy(&framer);
+
+    framer_init(&framer);
+    framer_feed(&framer, FRAMER_BINARY_HELLO, 5);
+    TEST_ASSERT_FALSE_MESSAGE(framer_text(&framer) || framer_binary(&framer),
+            "A prefix of the hello was decided on");
+    framer_feed(&framer, FRAMER_BINARY_HELLO + 5, sizeof(FRAMER_BINARY_HELLO) - 1 - 5);
+    TEST_ASSERT_TRUE(framer_binary(&framer));
+    framer_destroy(&framer);
+}
@@ -0,0 +1,195 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static void write_string(struct aesd_circular_buffer *buffer, const char *string)
+{
+    struct aesd_buffer_entry entry;
+
+    entry.buffptr = string;
+    entry.size = strlen(string);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+* in_offs and out_offs are locations in the entry array, equal once the buffer is full,
+* and the entry at in_offs is the next one to be overwritten.
+*/
+void test_circular_buffer_offsets_are_locations()
+{
+    struct aesd_circular_buffer buffer;
+    const char *writes[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1] = {
+        "write1\n", "write2\n", "write3\n", "write4\n", "write5\n", "write6\n",
+        "write7\n", "write8\n", "write9\n", "write10\n", "write11\n",
+    };
+    int i;
+
+    aesd_circular_buffer_init(&buffer);
+
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        TEST_ASSERT_FALSE_MESSAGE(buffer.full, "The buffer was full before capacity entries were added");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(i, buffer.in_offs, "in_offs is not the location of the next write");
+        write_string(&buffer, writes[i]);
+    }
+
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "The buffer was not full after capacity entries were added");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, buffer.in_offs, "in_offs did not wrap around");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(buffer.in_offs, buffer.out_offs, "in_offs and out_offs differ while full");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("write1\n", buffer.entry[buffer.out_offs].buffptr,
+            "The entry at out_offs is not the oldest one");
+
+    write_string(&buffer, writes[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]);
+
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "The buffer was not full after overwriting an entry");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, buffer.out_offs, "out_offs did not advance past the dropped entry");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(buffer.in_offs, buffer.out_offs, "in_offs and out_offs differ while full");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("write11\n", buffer.entry[0].buffptr, "The oldest entry was not overwritten");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("write2\n", buffer.entry[buffer.out_offs].buffptr,
+            "The entry at out_offs is not the oldest one");
+}
+
+/**
+* AESD_CIRCULAR_BUFFER_FOREACH visits every entry of the array exactly once.
+*/
+void test_circular_buffer_foreach_visits_capacity_entries()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+    int visited = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    write_string(&buffer, "write1\n");
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(&buffer.entry[visited], entry, "Entries were not visited in order");
+        visited++;
+    }
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, visited,
+            "FOREACH did not visit every entry of the buffer");
+}
+
+/**
+* A buffer in caller allocated storage of any capacity finds the same entry for every offset
+* as a walk over the entries it holds, zero sized entries included, with or without a hint.
+*/
+void test_circular_buffer_storage_matches_linear_walk()
+{
+    static const uint32_t capacities[] = { 1, 2, 3, 7, 10, 100, 1000 };
+    static char data[64];
+    size_t sizes[3000];
+    unsigned int c;
+
+    srand(1);
+
+    for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        uint32_t capacity = capacities[c];
+        struct aesd_circular_buffer buffer;
+        struct aesd_buffer_entry *entries = malloc(sizeof(struct aesd_buffer_entry) * capacity);
+        size_t *ends = malloc(sizeof(size_t) * capacity);
+        int count = rand() % 3000;
+        int first = count > (int)capacity ? count - (int)capacity : 0;
+        size_t total = 0;
+        size_t offset;
+        uint32_t hint = capacity + 5;
+        int i;
+
+        TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_init_storage(&buffer, entries, ends, capacity),
+                "Caller allocated storage was refused");
+
+        for (i = 0; i < count; i++) {
+            struct aesd_buffer_entry entry = { data, rand() % 4 == 0 ? 0 : (size_t)(rand() % 60) };
+
+            sizes[i] = entry.size;
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+            TEST_ASSERT_TRUE_MESSAGE(buffer.in_offs < capacity && buffer.out_offs < capacity,
+                    "An offset left the entry array");
+        }
+
+        for (i = first; i < count; i++) {
+            total += sizes[i];
+        }
+
+        for (offset = 0; offset <= total; offset++) {
+            size_t entry_offset = 0;
+            size_t hinted_offset = 0;
+            struct aesd_buffer_entry *found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset,
+                    &entry_offset);
+            struct aesd_buffer_entry *hinted = aesd_circular_buffer_find_entry_offset_for_fpos_hint(&buffer,
+                    offset, &hinted_offset, &hint);
+            size_t start = 0;
+            int expected = -1;
+
+            for (i = first; i < count; i++) {
+                if (offset < start + sizes[i]) {
+                    expected = i;
+                    break;
+                }
+                start += sizes[i];
+            }
+
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(found, hinted, "A hinted lookup found another entry");
+            TEST_ASSERT_EQUAL_MESSAGE(entry_offset, hinted_offset, "A hinted lookup returned another offset");
+
+            if (expected < 0) {
+                TEST_ASSERT_NULL_MESSAGE(found, "An offset past the end was found");
+            } else {
+                TEST_ASSERT_EQUAL_PTR_MESSAGE(&buffer.entry[expected % capacity], found,
+                        "The wrong entry was found");
+                TEST_ASSERT_EQUAL_MESSAGE(offset - start, entry_offset, "The wrong entry offset was returned");
+            }
+        }
+
+        free(entries);
+        free(ends);
+    }
+}
+
+/**
+* Storage for no entry is refused.
+*/
+void test_circular_buffer_storage_rejects_zero_capacity()
+{
+    struct aesd_circular_buffer buffer;
+
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_init_storage(&buffer, NULL, NULL, 0),
+            "Storage of capacity 0 was accepted");
+}
+
+/**
+* An empty payload reserved while the arena is full drops no entry, and a commit of more than
+* was reserved only adds the bytes reserved.
+*/
+void test_circular_buffer_arena_reservations()
+{
+    struct aesd_circular_buffer buffer;
+    char arena[16];
+    char *payload;
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_init_arena(&buffer, arena, sizeof(arena));
+
+    TEST_ASSERT_NOT_NULL(aesd_circular_buffer_add_copy(&buffer, "write1\n", 7));
+    TEST_ASSERT_NOT_NULL(aesd_circular_buffer_add_copy(&buffer, "write02\n", 8));
+    TEST_ASSERT_NOT_NULL(aesd_circular_buffer_add_copy(&buffer, "w", 1));
+    TEST_ASSERT_EQUAL_MESSAGE(sizeof(arena), buffer.arena_used, "The arena was not full");
+
+    payload = aesd_circular_buffer_reserve(&buffer, 0);
+    TEST_ASSERT_NOT_NULL_MESSAGE(payload, "An empty payload was refused");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(arena, buffer.entry[buffer.out_offs].buffptr,
+            "Reserving an empty payload dropped an entry");
+    TEST_ASSERT_EQUAL_PTR(payload, aesd_circular_buffer_commit(&buffer, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT32(4, buffer.in_offs);
+    TEST_ASSERT_EQUAL(sizeof(arena), buffer.arena_used);
+
+    payload = aesd_circular_buffer_reserve(&buffer, 4);
+    TEST_ASSERT_NOT_NULL(payload);
+    memcpy(payload, "abcd", 4);
+    TEST_ASSERT_EQUAL_PTR(payload, aesd_circular_buffer_commit(&buffer, 12));
+    TEST_ASSERT_EQUAL_MESSAGE(4, buffer.entry[4].size, "A commit added more than was reserved");
+    TEST_ASSERT_TRUE_MESSAGE(buffer.arena_used <= sizeof(arena), "The arena holds more than its size");
+}
@@ -0,0 +1,216 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../../aesd-char-driver/aesd-concurrent-buffer.h"
+
+/**
+* Entry k points at payload + (k % PAYLOAD_ENTRIES) * PAYLOAD_STRIDE and is 1 + k % 7 bytes long,
+* so a reader can tell from a copy alone whether it was ever added.
+*/
+#define PAYLOAD_ENTRIES (7 * 64)
+#define PAYLOAD_STRIDE 8
+#define STRESS_READERS 4
+#define STRESS_PRODUCERS 3
+#define STRESS_ROUNDS 2000
+
+static char payload[PAYLOAD_ENTRIES * PAYLOAD_STRIDE];
+
+struct stress_state
+{
+    struct aesd_concurrent_buffer *buffers;
+    uint32_t buffer_count;
+    /**
+     * Index of the buffer written to and read from, buffer_count once done
+     */
+    uint32_t current;
+    uint32_t adds_per_buffer;
+    bool mpsc;
+    uint32_t next_entry;
+    uint32_t bad_lookups;
+    unsigned long lookups;
+};
+
+static struct aesd_buffer_entry stress_entry(uint32_t k)
+{
+    struct aesd_buffer_entry entry = {
+        .buffptr = payload + (k % PAYLOAD_ENTRIES) * PAYLOAD_STRIDE,
+        .size = 1 + k % 7,
+    };
+
+    return entry;
+}
+
+static bool stress_entry_valid(const struct aesd_buffer_entry *entry, size_t entry_offset)
+{
+    size_t at;
+
+    if (entry->buffptr < payload || entry->buffptr >= payload + sizeof(payload)) {
+        return false;
+    }
+
+    at = entry->buffptr - payload;
+    return at % PAYLOAD_STRIDE == 0 && entry->size == 1 + (at / PAYLOAD_STRIDE) % 7 && entry_offset < entry->size;
+}
+
+static void *stress_reader(void *param)
+{
+    struct stress_state *state = param;
+    unsigned int seed = (unsigned int)(uintptr_t)&seed;
+    unsigned long lookups = 0;
+    uint32_t current;
+
+    while ((current = __atomic_load_n(&state->current, __ATOMIC_ACQUIRE)) < state->buffer_count) {
+        struct aesd_buffer_entry entry;
+        size_t entry_offset;
+
+        if (aesd_concurrent_buffer_find_entry_offset_for_fpos(&state->buffers[current], rand_r(&seed) % 64,
+                &entry, &entry_offset) && !stress_entry_valid(&entry, entry_offset)) {
+            __atomic_add_fetch(&state->bad_lookups, 1, __ATOMIC_RELAXED);
+        }
+        lookups++;
+    }
+
+    __atomic_add_fetch(&state->lookups, lookups, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void *stress_producer(void *param)
+{
+    struct stress_state *state = param;
+    uint32_t k;
+
+    while ((k = __atomic_fetch_add(&state->next_entry, 1, __ATOMIC_RELAXED)) / state->adds_per_buffer <
+            state->buffer_count) {
+        uint32_t current = k / state->adds_per_buffer;
+        struct aesd_buffer_entry entry = stress_entry(k);
+
+        if (state->mpsc) {
+            aesd_concurrent_buffer_add_entry_mpsc(&state->buffers[current], &entry, NULL);
+        } else {
+            aesd_concurrent_buffer_add_entry(&state->buffers[current], &entry, NULL);
+        }
+
+        /* Readers move on once the last entry is added, entries still being added elsewhere go unread */
+        if (k % state->adds_per_buffer == state->adds_per_buffer - 1) {
+            uint32_t seen = __atomic_load_n(&state->current, __ATOMIC_RELAXED);
+
+            while (seen <= current && !__atomic_compare_exchange_n(&state->current, &seen, current + 1, false,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+* Runs readers against buffers each filled from empty to twice their capacity, so lookups race
+* with the first entries, with the buffer becoming full and with entries being dropped.
+*/
+static void stress_run(uint32_t slot_count, uint32_t capacity, bool mpsc)
+{
+    struct stress_state state;
+    pthread_t readers[STRESS_READERS];
+    pthread_t producers[STRESS_PRODUCERS];
+    struct aesd_concurrent_slot *slots;
+    uint32_t producer_count = mpsc ? STRESS_PRODUCERS : 1;
+    uint32_t i;
+
+    memset(&state, 0, sizeof(state));
+    state.buffer_count = STRESS_ROUNDS;
+    state.adds_per_buffer = 2 * capacity;
+    state.mpsc = mpsc;
+    state.buffers = malloc(sizeof(struct aesd_concurrent_buffer) * state.buffer_count);
+    slots = malloc(sizeof(struct aesd_concurrent_slot) * slot_count * state.buffer_count);
+    TEST_ASSERT_NOT_NULL(state.buffers);
+    TEST_ASSERT_NOT_NULL(slots);
+
+    for (i = 0; i < state.buffer_count; i++) {
+        TEST_ASSERT_TRUE(aesd_concurrent_buffer_init(&state.buffers[i], slots + i * slot_count, slot_count, capacity));
+    }
+
+    for (i = 0; i < STRESS_READERS; i++) {
+        pthread_create(&readers[i], NULL, stress_reader, &state);
+    }
+    for (i = 0; i < producer_count; i++) {
+        pthread_create(&producers[i], NULL, stress_producer, &state);
+    }
+
+    for (i = 0; i < producer_count; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    for (i = 0; i < STRESS_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, state.bad_lookups, "A lookup returned an entry that was never added");
+
+    for (i = 0; i < state.buffer_count; i++) {
+        struct aesd_buffer_entry entry;
+        size_t entry_offset;
+
+        TEST_ASSERT_TRUE_MESSAGE(aesd_concurrent_buffer_find_entry_offset_for_fpos(&state.buffers[i], 0, &entry,
+                &entry_offset), "A full buffer held nothing");
+        TEST_ASSERT_TRUE_MESSAGE(stress_entry_valid(&entry, entry_offset), "A full buffer held an invalid entry");
+    }
+
+    free(slots);
+    free(state.buffers);
+}
+
+void test_concurrent_buffer_stress_single_producer()
+{
+    stress_run(4, 3, false);
+    stress_run(16, 16, false);
+}
+
+void test_concurrent_buffer_stress_mpsc()
+{
+    stress_run(4, 3, true);
+    stress_run(16, 16, true);
+}
+
+/**
+* With one producer the buffer holds the same entries as aesd-circular-buffer would, and every
+* offset is found in the same entry as a walk over them.
+*/
+void test_concurrent_buffer_matches_linear_walk()
+{
+    struct aesd_concurrent_buffer buffer;
+    struct aesd_concurrent_slot slots[8];
+    uint32_t capacity = 5;
+    uint32_t count;
+
+    TEST_ASSERT_FALSE(aesd_concurrent_buffer_init(&buffer, slots, 6, 5));
+    TEST_ASSERT_FALSE(aesd_concurrent_buffer_init(&buffer, slots, 8, 9));
+    TEST_ASSERT_TRUE(aesd_concurrent_buffer_init(&buffer, slots, 8, capacity));
+
+    for (count = 0; count < 40; count++) {
+        uint32_t first = count > capacity ? count - capacity : 0;
+        size_t offset = 0;
+        uint32_t k;
+
+        for (k = first; k < count; k++) {
+            size_t byte;
+
+            for (byte = 0; byte < 1 + k % 7; byte++, offset++) {
+                struct aesd_buffer_entry entry;
+                size_t entry_offset;
+
+                TEST_ASSERT_TRUE(aesd_concurrent_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry,
+                        &entry_offset));
+                TEST_ASSERT_EQUAL_PTR(stress_entry(k).buffptr, entry.buffptr);
+                TEST_ASSERT_EQUAL(byte, entry_offset);
+            }
+        }
+
+        {
+            struct aesd_buffer_entry entry;
+            struct aesd_buffer_entry add = stress_entry(count);
+
+            TEST_ASSERT_FALSE(aesd_concurrent_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry, NULL));
+            aesd_concurrent_buffer_add_entry(&buffer, &add, NULL);
+        }
+    }
+}